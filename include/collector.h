@@ -23,10 +23,95 @@ void gc_unset_root(ScamVal*);
 /* Opposite of gc_unset_root, used internally by some of the sequence APIs. */
 void gc_set_root(ScamVal*);
 
+/* Scan the *count values at *arr along with the roots, wherever the array is moved to. This is
+ * for a stack of values that are pushed and popped too often to make each of them a root, so a
+ * value should be released with gc_unset_root when it is pushed, and set as a root again only if
+ * it is still needed once it has been popped.
+ */
+void gc_add_stack(ScamVal*** arr, size_t* count);
+
+/* Return whether a value is in the root set, i.e. whether it has been allocated or returned by a
+ * lookup and not yet released with gc_unset_root or stored in another object.
+ */
+bool gc_is_root(const ScamVal*);
+
+/* The collector only looks for live objects starting from the roots, so a root that is never
+ * released keeps everything reachable from it alive. These are for finding such leaks: take the
+ * number of roots before some operation and afterwards print to stderr the roots added since,
+ * except the given value (typically the result of the operation). A leaked root can be missed if an
+ * older root was released in the meantime, but a root that was released is never reported.
+ */
+size_t gc_root_count(void);
+void gc_report_roots(size_t n, const ScamVal* except);
+
+/* Call this after storing a reference to the second object in the first one, unless the first
+ * object was allocated after the second one and there has been no allocation since. It lets minor
+ * collections find young objects that are only referred to by old ones, and it keeps incremental
+ * marking from missing objects that are moved around while it is in progress.
+ */
+void gc_write_barrier(ScamVal* obj, ScamVal* v);
+
+/* Bracket any change to the references that an object holds, including the call to
+ * gc_write_barrier, unless the object was freshly allocated as above. While the collector is
+ * marking on another thread, this keeps it from reading the object half changed; otherwise it does
+ * nothing. Nothing in between may allocate.
+ */
+void gc_lock(void);
+void gc_unlock(void);
 
-/* Invoke the garbage collector manually (generally unnecessary). */
+
+/* Invoke the garbage collector manually (generally unnecessary). This collects both generations. */
 void gc_collect(void);
 
+/* Mark the old generation incrementally, at most the given number of objects at a time, instead of
+ * stopping the program for the whole of a major collection. Zero, the default, turns it off.
+ */
+void gc_set_mark_budget(size_t);
+
+/* Mark the old generation on a separate thread while the program carries on, so that a major
+ * collection only stops the program to mark the roots and the nursery once more at the end.
+ */
+void gc_set_concurrent(bool);
+
+/* Limit the old generation to about the given number of bytes, counting the blocks that its
+ * objects own, or lift the limit with zero. While a major collection can't bring it under the
+ * limit, or after malloc has failed, gc_heap_exhausted returns true and the evaluators fail with
+ * an out of memory error, until a major collection finds enough room again.
+ */
+void gc_set_heap_limit(size_t);
+bool gc_heap_exhausted(void);
+
+/* The collector's counters since the program started. The heap is the memory that the collector
+ * has allocated for objects and for the blocks that they own, and the live bytes are the size of
+ * the old generation, measured as for the heap limit. The per-type counts are indexed by ScamType,
+ * and the bytes counted for an object don't include its blocks. An object is counted as freed under
+ * the type it has at the time, so an S-expression that is turned into a list is freed as a list.
+ * Pause times are in seconds.
+ */
+enum { GC_NTYPES = SCAM_ANY + 1 };
+typedef struct {
+    size_t minor_collections;
+    size_t major_collections;
+    size_t pauses;
+    double pause_total;
+    double pause_max;
+    size_t heap_bytes;
+    size_t heap_peak;
+    size_t live_bytes;
+    size_t allocated[GC_NTYPES];
+    size_t allocated_bytes[GC_NTYPES];
+    size_t freed[GC_NTYPES];
+    size_t freed_bytes[GC_NTYPES];
+} gc_stats_t;
+
+const gc_stats_t* gc_get_stats(void);
+void gc_print_stats(FILE*);
+
+/* Print the number of times that the collector has paused the program and how long for, since the
+ * last report.
+ */
+void gc_report_pauses(FILE*);
+
 /* Close the garbage collector and free all objects (obviously don't do this until the very end of 
  * the program, as all remaining refs become invalid).
  */
@@ -40,7 +125,28 @@ void gc_print(void);
 void gc_smart_print(void);
 
 
-/* Allocate/reallocate from the actual program heap, handling out of memory errors gracefully. */
+/* Allocate, resize and free blocks of memory that belong to a ScamVal, such as the entries of a
+ * dictionary. Small blocks are packed into slabs instead of being allocated one by one. The size
+ * passed to gc_realloc_block and gc_free_block must be the one the block was allocated with.
+ * Allocating zero bytes returns NULL.
+ */
+void* gc_alloc_block(size_t);
+void* gc_realloc_block(void*, size_t old_size, size_t new_size);
+void gc_free_block(void*, size_t);
+
+/* Like gc_realloc_block and gc_realloc, for memory whose size the program controls, such as the
+ * elements of a list or the characters of a string, which may be more than malloc will ever give.
+ * If a request can't be met even once the reserve is given up, they return NULL and leave the old
+ * memory as it was, and the evaluators fail with an out of memory error.
+ */
+void* gc_try_realloc_block(void*, size_t old_size, size_t new_size);
+void* gc_try_realloc(void*, size_t);
+
+
+/* Allocate/reallocate from the actual program heap. If malloc fails, the collector collects and then
+ * gives up its reserve, after which the evaluators fail with an out of memory error. Only if malloc
+ * fails again after that does the program exit.
+ */
 void* gc_malloc(size_t);
 void* gc_realloc(void*, size_t);
 void* gc_calloc(size_t, size_t);
@@ -0,0 +1,58 @@
+#pragma once
+#include <stddef.h>
+#include "scamval.h"
+
+
+/* The instructions of the virtual machine, populated with an X-macro. Each instruction is followed
+ * in the code array by a fixed number of integer operands:
+ *
+ *   CODE_CONST k           push constant k
+ *   CODE_LOOKUP k d        push the value bound to the symbol in constant k, searching from the
+ *                          environment d frames up
+ *   CODE_LOCAL d s         push the value in slot s of the frame d frames up
+ *   CODE_MOVE d s          like CODE_LOCAL, where the slot is never read again, so that an owned
+ *                          value (see ScamVal_is_owned) stays owned
+ *   CODE_DEFINE k          pop a value, bind it to the symbol in constant k and push null
+ *   CODE_DEFINE_LOCAL s    pop a value, store it in slot s of the current frame and push null
+ *   CODE_LAMBDA k          push a closure over the function template in constant k
+ *   CODE_CALL n            pop n arguments and a function, and push the result of the call
+ *   CODE_TAIL_CALL n       like CODE_CALL, but a compiled function replaces the running code and
+ *                          frame instead of being called recursively
+ *   CODE_LIST n            pop n values and push a list of them
+ *   CODE_DICT n            pop n [key value] lists and push a dictionary of them
+ *   CODE_JUMP t            continue at index t
+ *   CODE_JUMP_IF_FALSE t   pop a boolean and continue at index t if it is false
+ *   CODE_AND i t           pop operand i of an and expression, if false push it and jump to t
+ *   CODE_OR i t            pop operand i of an or expression, if true push it and jump to t
+ *                          (the last operand of either is not checked, it is the result)
+ *   CODE_POP               discard the top of the stack
+ *   CODE_ERROR k           return the error in constant k
+ *   CODE_RETURN            return the top of the stack
+ *
+ * To define a new instruction, edit the src/bytecode.def file.
+ */
+typedef enum {
+#define EXPAND_BYTECODE(inst, nargs) \
+    inst,
+#include "../src/bytecode.def"
+} bytecode_t;
+
+
+/* Compile a Scam AST into bytecode. The returned code shares the atoms of the AST.
+ *   - Malformed special forms are not reported until the code that contains them is run, just as
+ *     in the tree-walking evaluator.
+ *   - The parameters and local defines of lambda expressions are resolved to frame slots, so the
+ *     bodies of compiled functions must be run with vm_apply.
+ *   - The last read of a slot on every path through a function is a CODE_MOVE, unless a nested
+ *     lambda expression refers to the slot.
+ */
+ScamCode* ScamVal_compile(ScamVal*);
+
+
+/* Return the number of operands that follow an instruction. */
+size_t bytecode_nargs(bytecode_t);
+const char* bytecode_name(bytecode_t);
+
+
+/* Print a listing of the bytecode, including the code of any nested lambda expressions. */
+void ScamCode_print(const ScamCode*, int indent);
@@ -1,4 +1,5 @@
 #pragma once
+#include <stdbool.h>
 #include <stdio.h>
 #include "scamval.h"
 
@@ -7,6 +8,51 @@
 ScamVal* eval(ScamVal*, ScamEnv*);
 
 
+/* Choose how eval_str and eval_file run programs: with the tree-walking evaluator (the default) or
+ * by compiling them to bytecode for the virtual machine.
+ */
+void eval_set_vm(bool);
+
+
+/* When set, eval_str and eval_file report any value that they leave in the collector's root set,
+ * apart from their result, which is a sign of a missing call to gc_unset_root.
+ */
+void eval_set_check_roots(bool);
+
+
+/* Set the maximum depth of nested evaluation, counted in calls to Scam functions that have not yet
+ * returned. Deeper recursion fails with a "stack overflow" error. Both evaluators keep their frames
+ * on the heap, so the limit is bounded by memory rather than by the C stack.
+ */
+void eval_set_max_depth(size_t);
+
+/* Used by the evaluators to count the depth of nested evaluation. eval_enter returns an error if
+ * the maximum depth has been reached or the collector has run out of memory, and NULL otherwise, in
+ * which case it must be matched by a call to eval_leave.
+ */
+ScamVal* eval_enter(void);
+void eval_leave(void);
+
+
+/* The values that the evaluators are working on, which both of them keep on this one stack. It is
+ * a plain array, which the collector scans as a single root, so the values on it aren't roots
+ * themselves (see gc_add_stack). Each call of an evaluator leaves it as it found it.
+ */
+extern ScamVal** eval_stack;
+extern size_t eval_stack_count;
+
+/* Push a value onto the stack, which releases it. */
+void eval_push(ScamVal*);
+
+/* Remove the top n values of the stack and return them in a new sequence. */
+ScamSeq* eval_pop_n(size_t n);
+
+/* Call the function below the top n values of the stack with those values as its arguments, which
+ * it sees in place on the stack, and remove it and them from the stack.
+ */
+ScamVal* eval_call_top(size_t n);
+
+
 /* Parse a string into a Scam AST and evaluate it. */
 ScamVal* eval_str(char* s, ScamEnv*);
 
@@ -15,5 +61,12 @@ ScamVal* eval_str(char* s, ScamEnv*);
 ScamVal* eval_file(char* fp, ScamEnv*);
 
 
-/* Evaluate a function application. */
+/* Evaluate a function application. The result is never owned (see ScamVal_is_owned), since the
+ * caller may keep it anywhere.
+ */
 ScamVal* eval_apply(ScamVal* fun, ScamSeq* arglist);
+
+/* Like eval_apply, but for the evaluators themselves, which know where the result goes, so an
+ * owned result stays owned.
+ */
+ScamVal* eval_call(ScamVal* fun, ScamSeq* arglist);
@@ -0,0 +1,106 @@
+#pragma once
+#include <stdbool.h>
+#include <stdio.h>
+#include "scamval.h"
+
+
+/* The profiler keeps a shadow call stack of the Scam functions and builtins that the program is in,
+ * along with a tree of every distinct stack that it has seen. Functions are told apart by their
+ * name and the location of their parameter list, so that the report can point at the source.
+ *
+ * With allocation profiling on, every object that the collector allocates is charged to the stack
+ * it was allocated in, and to its site: the innermost S-expression that the tree walker is
+ * evaluating, or the function that the virtual machine is running, in the innermost Scam function.
+ *
+ * With sampling on, a timer interrupts the program with SIGPROF every millisecond of CPU time that
+ * it uses, and the signal handler counts a sample for the stack that it interrupted. The time that
+ * a function takes can then be estimated from the samples taken while it was on top of the stack
+ * (its self time) and while it was anywhere on the stack (its total time).
+ */
+void prof_set_allocations(bool);
+void prof_set_sampling(bool);
+
+
+/* Called by the evaluators around every call to a function or builtin, including tail calls, which
+ * replace the function on top of the stack instead of pushing a new one. These and the other hooks
+ * below only test a flag unless profiling is on, so that they cost next to nothing otherwise.
+ */
+extern bool prof_profiling;
+extern bool prof_allocating;
+
+void prof_push(const ScamVal* fun);
+void prof_pop(void);
+
+static inline void prof_enter(const ScamVal* fun) {
+    if (prof_profiling) {
+        prof_push(fun);
+    }
+}
+
+static inline void prof_leave(void) {
+    if (prof_profiling) {
+        prof_pop();
+    }
+}
+
+static inline void prof_replace(const ScamVal* fun) {
+    if (prof_profiling) {
+        prof_pop();
+        prof_push(fun);
+    }
+}
+
+
+/* Called by the tree walker to tell the profiler which expression it is evaluating. The location
+ * is saved on entry to eval and restored on the way out, so that it is the caller's again once the
+ * expression has been evaluated.
+ */
+typedef struct {
+    unsigned int line, column;
+} prof_location_t;
+
+prof_location_t prof_get_location(void);
+void prof_set_location(prof_location_t);
+
+static inline prof_location_t prof_save_location(void) {
+    return prof_profiling ? prof_get_location() : (prof_location_t){ 0, 0 };
+}
+
+static inline void prof_restore_location(prof_location_t location) {
+    if (prof_profiling) {
+        prof_set_location(location);
+    }
+}
+
+static inline void prof_locate(const ScamSeq* ast) {
+    if (prof_profiling && ScamSeq_line(ast) != 0) {
+        prof_set_location((prof_location_t){ ScamSeq_line(ast), ScamSeq_column(ast) });
+    }
+}
+
+
+/* Called by the collector for every object that it allocates. */
+void prof_record_allocation(size_t bytes);
+
+static inline void prof_allocation(size_t bytes) {
+    if (prof_allocating) {
+        prof_record_allocation(bytes);
+    }
+}
+
+
+/* Print the allocation sites, most bytes first, and write the stacks that allocated in the format
+ * that flamegraph.pl takes: one line per stack, with the frames separated by semicolons and
+ * followed by the number of bytes.
+ */
+void prof_report_allocations(FILE*);
+void prof_write_allocation_stacks(FILE*);
+
+/* Likewise, print the self and total samples of each function, most self samples first, and write
+ * the number of samples taken in each stack.
+ */
+void prof_report_samples(FILE*);
+void prof_write_sample_stacks(FILE*);
+
+/* Free everything that the profiler has recorded. */
+void prof_close(void);
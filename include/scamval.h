@@ -1,5 +1,6 @@
 #pragma once
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 
@@ -15,11 +16,34 @@ enum ScamType {
 };
 
 
+/* The names of the special forms, and of the builtins that the parser inserts into the AST, which
+ * the evaluators handle directly. Every symbol records which of these it is when it is interned.
+ *
+ * The parser inserts "#begin", "#list" and "#dict" rather than the names of the builtins: no symbol
+ * in the source can start with '#', so a program that binds begin, list or dict to something else
+ * still calls whatever it bound when it uses the name. Only the bodies and literals the parser built
+ * are handled directly.
+ *
+ * To define a new keyword, edit the src/keyword.def file.
+ */
+enum ScamKeyword {
+    KEYWORD_NONE,
+#define EXPAND_KEYWORD(kw, name) \
+    kw,
+#include "../src/keyword.def"
+};
+
+
 #define SCAMVAL_HEADER \
     enum ScamType type; \
     /* Bookkeeping for the garbage collector. */ \
-    bool seen; \
-    bool is_root;
+    bool old; \
+    bool remembered; \
+    bool permanent; \
+    unsigned char size_class; \
+    unsigned int root : 31; \
+    /* Set on a list or string that nothing but the evaluator refers to, see ScamVal_is_owned. */ \
+    unsigned int owned : 1;
 
 
 /* Used by SCAM_NULL, inherited by everything else. */
@@ -49,11 +73,30 @@ typedef struct {
 } ScamDec;
 
 
+/* A buffer that more than one sequence or string refers to (internal). None of them may change it:
+ * the first one that needs to gets a copy of its own instead, and the last one to be freed frees it.
+ */
+typedef struct {
+    size_t refs;
+    void* base;
+    size_t size;
+} ScamBuffer;
+
+
 /* Used by SCAM_SEXPR, SCAM_LIST and SCAM_DOT_SYM. */
 typedef struct {
     SCAMVAL_HEADER;
+    /* Where the parser found the sequence, for the profiler. These fit in the padding after the
+     * header, so they don't make sequences any bigger.
+     */
+    unsigned int line : 20;
+    unsigned int column : 12;
     size_t count, mem_size;
     ScamVal** arr;
+    /* The buffer that arr points into if it is shared, or NULL. A sequence made from part of
+     * another one shares the other's buffer too, so arr needn't be the start of it.
+     */
+    ScamBuffer* shared;
 } ScamSeq;
 
 
@@ -62,42 +105,89 @@ typedef struct {
     SCAMVAL_HEADER;
     size_t count, mem_size;
     char* s;
+    /* The buffer that s is the start of if it is shared, or NULL. */
+    ScamBuffer* shared;
+    /* Only used by SCAM_SYM, computed once when the symbol is interned. */
+    size_t hash;
+    enum ScamKeyword keyword;
 } ScamStr;
 
 
-typedef struct ScamDict_list {
-    struct ScamDict_list* next;
+/* An entry of a dictionary, with the hash of its key cached so that it never has to be computed
+ * again, and the number of keys inserted before it, which gives the order to iterate in. In the
+ * nodes of a trie, an entry with a NULL key holds a child node as its value instead.
+ */
+typedef struct {
     ScamVal* key;
     ScamVal* val;
-} ScamDict_list;
+    size_t hash;
+    size_t order;
+} ScamDict_entry;
 
 
-enum { SCAM_DICT_SIZE = 256 };
-#define SCAMDICT_HEADER \
-    SCAMVAL_HEADER; \
-    size_t len; \
-    ScamDict_list* data[SCAM_DICT_SIZE];
+/* Used by SCAM_TRIE, the nodes of a dictionary (internal). Each node branches on five bits of the
+ * hash, starting from the lowest, and only has slots for the branches set in its bitmap. Keys whose
+ * hashes are the same in every bit end up together in a node past the last level, which is searched
+ * linearly.
+ *
+ * Nodes are shared by every version of a dictionary that hasn't changed them. A node may only be
+ * changed in place by the dictionary whose edit number it carries; any other copies it first.
+ */
+typedef struct {
+    SCAMVAL_HEADER;
+    uint32_t bitmap;
+    unsigned int count;
+    size_t edit;
+    ScamDict_entry* slots;
+} ScamTrie;
 
 
-/* Used by SCAM_DICT. */
+/* Used by SCAM_DICT. A dictionary is a persistent hash array mapped trie, so that binding a key
+ * makes a new version in O(log n) that shares all but the path to the key with the old one. The
+ * entries are also kept in insertion order, once they are first iterated over, until the next
+ * change.
+ */
 typedef struct {
-    SCAMDICT_HEADER;
+    SCAMVAL_HEADER;
+    size_t len;
+    size_t edit, next_order;
+    ScamTrie* trie; /* NULL if the dictionary is empty. */
+    ScamDict_entry* ordered;
 } ScamDict;
 
 
 /* Used by SCAM_ENV. */
 typedef struct ScamEnv_rec {
-    SCAMDICT_HEADER;
+    SCAMVAL_HEADER;
+    ScamDict* names; /* Variables bound by name, NULL if the environment has none. */
+    /* Variables that the compiler resolved to slot numbers, and the names of the slots. A slot is
+     * NULL until its variable is bound.
+     */
+    size_t nslots;
+    ScamVal** slots;
+    ScamSeq* slot_names;
     struct ScamEnv_rec* enclosing;
 } ScamEnv;
 
 
+/* Used by SCAM_CODE. */
+typedef struct {
+    SCAMVAL_HEADER;
+    size_t count, mem_size;
+    int* arr; /* Instructions and their operands, see src/bytecode.def */
+    ScamSeq* constants; /* The values, symbols and nested code that the instructions refer to. */
+    ScamSeq* slot_names; /* For function bodies, the parameters followed by the local defines. */
+} ScamCode;
+
+
 /* Used by SCAM_FUNCTION. */
 typedef struct {
     SCAMVAL_HEADER;
     ScamEnv* env; /* A pointer to the environment the function was created in, for closures. */
+    ScamStr* name; /* The variable that the function was first defined as, or NULL. */
     ScamSeq* parameters;
     ScamSeq* body;
+    ScamCode* code; /* The compiled body, or NULL if the function was made by the tree walker. */
 } ScamFunction;
 
 
@@ -110,21 +200,61 @@ typedef struct {
 } ScamPort;
 
 
-/* Used by SCAM_BUILTIN. */
+/* Used by SCAM_BUILTIN. A builtin declares how it uses each of its arguments with a string of
+ * ScamArgMode letters, the last of which applies to any arguments past the end of the string:
+ *   - 'b' if it only reads the argument (borrows it),
+ *   - 'c' if it may keep a reference to it, e.g. by storing it somewhere or returning it or one of
+ *     its elements without copying them (consumes it),
+ *   - 'm' if it changes the argument in place (mutates it), which it may then also return.
+ * An empty string is taken to be "b".
+ * Only a builtin's mutated arguments are ever copied before it is called, and only those that
+ * something else refers to.
+ */
+enum ScamArgMode { ARG_BORROW = 'b', ARG_CONSUME = 'c', ARG_MUTATE = 'm' };
+
 typedef ScamVal* (*scambuiltin_fun)(ScamSeq*);
 typedef struct {
     SCAMVAL_HEADER;
     scambuiltin_fun fun;
-    bool constant;
+    const char* modes;
+    size_t nmodes;
+    const char* name;
 } ScamBuiltin;
 
 
 
+/*** IMMEDIATE VALUES ***/
+/* Most integers are never allocated: an integer that fits in 63 bits is stored in the ScamInt
+ * pointer itself, shifted left by one with the lowest bit (which is never set in a real pointer)
+ * set. Booleans and null are shared objects that live outside the garbage collector's heap.
+ *
+ * So the type of a value must always be read with ScamVal_type instead of from the type field, and
+ * the value of an integer with ScamInt_unbox.
+ *
+ * These two are read on nearly every step of both evaluators, so they are forced inline: the
+ * interpreter is built without optimization, and as ordinary calls they cost more than the field
+ * read that they replace.
+ */
+static inline __attribute__((always_inline)) bool ScamVal_is_immediate(const void* v) {
+    return ((uintptr_t)v & 1) != 0;
+}
+
+static inline __attribute__((always_inline)) enum ScamType ScamVal_type(const void* v) {
+    return ScamVal_is_immediate(v) ? SCAM_INT : ((const ScamVal*)v)->type;
+}
+
+
 /*** SCAMVAL CONSTRUCTORS ***/
+/* Symbols are interned: there is only ever one symbol with a given name, so two symbols are equal
+ * exactly when they are the same object. ScamSym_no_copy takes ownership of its argument.
+ */
 ScamStr* ScamSym_new(const char*);
 ScamStr* ScamSym_no_copy(char*);
 ScamVal* ScamNull_new(void);
 
+/* Return the keyword that the symbol names, or KEYWORD_NONE. */
+enum ScamKeyword ScamSym_keyword(const ScamStr*);
+
 
 /*** NUMERIC API ***/
 ScamInt* ScamInt_new(long long);
@@ -168,12 +298,42 @@ void ScamSeq_append(ScamSeq* seq, ScamVal* v);
 void ScamSeq_prepend(ScamSeq* seq, ScamVal* v);
 
 /* Concatenate the second argument to the first.
- *   - The second argument is free'd.
+ *   - The second argument is released, but left as it was: its elements are shared, not moved.
  */
 void ScamSeq_concat(ScamSeq* seq1, ScamSeq* seq2);
 
-/* Return a newly allocated subsequence. */
-ScamVal* ScamSeq_subseq(const ScamSeq* seq, size_t start, size_t end);
+/* Return a new sequence with the same elements as the given one (which are shared, not copied).
+ * The two share a buffer until either of them is changed.
+ */
+ScamSeq* ScamSeq_copy(ScamSeq*);
+
+/* Return a new subsequence, which shares the buffer of the sequence like ScamSeq_copy. */
+ScamVal* ScamSeq_subseq(ScamSeq* seq, size_t start, size_t end);
+
+/* Return a new sequence of the n values at arr, which it reads in place instead of copying them,
+ * e.g. the arguments of a call on the virtual machine's stack. Values may be popped from either end
+ * of a view, but any other change gives it an array of its own first, as for a shared buffer.
+ *   - The array must not change or move while the view is open, except with ScamSeq_move_view.
+ *   - ScamSeq_close_view copies the values that the view still sees, if it is kept, and otherwise
+ *     empties it.
+ */
+ScamSeq* ScamSeq_view(ScamVal** arr, size_t n);
+void ScamSeq_move_view(ScamSeq*, ScamVal** from, ScamVal** to);
+void ScamSeq_close_view(ScamSeq*, bool keep);
+
+/* Sort the sequence in place with the given qsort comparison function. */
+void ScamSeq_sort(ScamSeq*, int compar(const void*, const void*));
+
+/* Record the line and column, both counted from one, where the parser found the sequence. Zero
+ * means that the sequence didn't come from the parser, and numbers too big to store are stored as
+ * zero too.
+ */
+void ScamSeq_set_location(ScamSeq*, unsigned int line, unsigned int column);
+unsigned int ScamSeq_line(const ScamSeq*);
+unsigned int ScamSeq_column(const ScamSeq*);
+
+/* Free the elements array of the sequence, or release its share of it, for the garbage collector. */
+void ScamSeq_free(ScamSeq*);
 
 
 /*** STRING API ***/
@@ -202,27 +362,59 @@ void ScamStr_truncate(ScamStr*, size_t);
 
 /* Return a newly-allocated substring. */
 ScamStr* ScamStr_substr(const ScamStr*, size_t, size_t);
+
+/* Return a new string (or error) with the same characters, which shares the character array of the
+ * given one until either of them is changed.
+ */
+ScamStr* ScamStr_copy(ScamStr*);
 void ScamStr_concat(ScamStr* s1, ScamStr* s2);
 size_t ScamStr_len(const ScamStr*);
 
+/* Return the hash of a character array, as used by dictionaries and the symbol table. */
+size_t scamstr_hash(const char*);
+
+/* Free the character array of a string or error, or release its share of it, for the garbage
+ * collector.
+ */
+void ScamStr_free(ScamStr*);
+
+/* Remove a symbol from the symbol table and free its name, for the garbage collector. */
+void ScamSym_free(ScamStr*);
+
 
 /*** FUNCTION API ***/
 ScamFunction* ScamFunction_new(ScamEnv* env, ScamSeq* parameters, ScamSeq* body);
-ScamBuiltin* ScamBuiltin_new(scambuiltin_fun);
-
-/* Construct a constant scambuiltin (one that doesn't change its arguments). */
-ScamBuiltin* ScamBuiltin_new_const(scambuiltin_fun);
+ScamFunction* ScamFunction_compiled(ScamEnv* env, ScamSeq* parameters, ScamSeq* body,
+                                    ScamCode* code);
+ScamBuiltin* ScamBuiltin_new(const char* name, scambuiltin_fun, const char* modes);
 size_t ScamFunction_nparams(const ScamFunction*);
+
+/* Name a function after the variable that it is being defined as, unless it has a name already.
+ * Anonymous functions are named by the first define they are bound by.
+ */
+void ScamFunction_set_name(ScamFunction*, ScamStr*);
+
+/* Return the function's name, or NULL if it was never defined as a variable. */
+ScamStr* ScamFunction_name(const ScamFunction*);
+
+/* Return references to a parameter name and the body of the function. These are shared with the
+ * AST the function was created from and by every call to the function, so they must not be
+ * modified.
+ */
 ScamStr* ScamFunction_param(const ScamFunction*, size_t);
 ScamSeq* ScamFunction_body(const ScamFunction*);
 
+/* Return the compiled body of the function, or NULL if it has none. */
+ScamCode* ScamFunction_code(const ScamFunction*);
+
 /* Initialize an environment enclosed by the function's environment. */
 ScamEnv* ScamFunction_env(const ScamFunction*);
 
 /* Return a reference to the function's environment itself. */
 const ScamEnv* ScamFunction_env_ref(const ScamFunction*);
 scambuiltin_fun ScamBuiltin_function(const ScamBuiltin*);
-int ScamBuiltin_is_const(const ScamBuiltin*);
+enum ScamArgMode ScamBuiltin_arg_mode(const ScamBuiltin*, size_t i);
+const char* ScamBuiltin_name(const ScamBuiltin*);
 
 
 /*** ERROR API ***/
@@ -244,9 +436,22 @@ void ScamPort_set_status(ScamPort*, int);
 ScamDict* ScamDict_new();
 ScamEnv* ScamEnv_new(ScamEnv* enclosing);
 ScamDict* ScamDict_from(size_t, ...);
+
+/* Initialize a dictionary from a sequence of [key value] lists, as the dict builtin does, or return
+ * an error if any element isn't a pair. The keys and values are shared with the lists.
+ */
+ScamVal* ScamDict_from_pairs(const ScamSeq* pairs);
+
+/* Initialize an environment with one empty slot for each of the given names, for the call frames of
+ * compiled functions.
+ */
+ScamEnv* ScamEnv_frame(ScamEnv* enclosing, ScamSeq* slot_names);
 ScamEnv* ScamEnv_builtins(void);
 
-/* Insert a key-value pair into the dictionary, or update an existing one. */
+/* Insert a key-value pair into the dictionary, or update an existing one. The dictionary is changed
+ * in place, reusing the nodes that no other version shares, so a run of inserts into a new
+ * dictionary builds it without any copying.
+ */
 void ScamDict_insert(ScamDict* dct, ScamVal* sym, ScamVal* val);
 void ScamEnv_insert(ScamEnv* env, ScamStr* sym, ScamVal* val);
 
@@ -254,15 +459,41 @@ void ScamEnv_insert(ScamEnv* env, ScamStr* sym, ScamVal* val);
  * it doesn't.
  */
 ScamVal* ScamDict_lookup(const ScamDict* dct, const ScamVal* key);
+/* Environment lookups search the bound slots of each environment by name as well, so that compiled
+ * and uncompiled code can see each other's variables.
+ */
 ScamVal* ScamEnv_lookup(const ScamEnv* env, const ScamStr* key);
 
+/* Like the above, but return NULL if the key isn't found instead of allocating an error, for lookups
+ * whose misses the program never sees.
+ */
+ScamVal* ScamDict_get(const ScamDict* dct, const ScamVal* key);
+ScamVal* ScamEnv_get(const ScamEnv* env, const ScamStr* key);
+
 size_t ScamDict_len(const ScamDict* dct);
 ScamEnv* ScamEnv_enclosing(const ScamEnv*);
 
-void ScamDict_list_free(ScamDict_list*);
+/* Return references to the key and the value of the i'th entry of the dictionary, counting in the
+ * order that the keys were first inserted.
+ */
+ScamVal* ScamDict_key(const ScamDict* dct, size_t i);
+ScamVal* ScamDict_val(const ScamDict* dct, size_t i);
+
+/* Return a new version of the dictionary with the key bound to the value, leaving the dictionary
+ * itself as it was.
+ */
+ScamDict* ScamDict_bind(ScamDict* dct, ScamVal* sym, ScamVal* val);
+
+/* Return a copy of the dictionary in constant time, by sharing its nodes. */
+ScamDict* ScamDict_copy(ScamDict* dct);
+
+/* Free the blocks that a dictionary or a node owns, for the garbage collector. */
+void ScamDict_free_table(ScamDict*);
+void ScamTrie_free(ScamTrie*);
 
 
 /*** SCAMVAL PRINTING ***/
+void ScamVal_write(const ScamVal*, FILE*);
 char* ScamVal_to_repr(const ScamVal*);
 char* ScamVal_to_str(const ScamVal*);
 void ScamVal_print(const ScamVal*);
@@ -276,6 +507,23 @@ int ScamVal_eq(const ScamVal*, const ScamVal*);
 int ScamVal_gt(const ScamVal*, const ScamVal*);
 
 
+/*** OWNERSHIP ***/
+/* A list or string is owned while the evaluators know that nothing refers to it but the expression
+ * being evaluated, as when it was just returned by a builtin that changed it, so that the next
+ * builtin to change it may do so in place instead of changing a copy. The value stops being owned
+ * as soon as a reference to it is kept anywhere else, e.g. in a variable or another list.
+ */
+bool ScamVal_is_owned(const ScamVal*);
+
+/* Mark a value as no longer owned. */
+void ScamVal_share(ScamVal*);
+
+/* Return the value itself if it is owned, and otherwise an owned copy of it, which shares its
+ * elements. Values of other types than list and string are returned as they are.
+ */
+ScamVal* ScamVal_own(ScamVal*);
+
+
 /*** TYPECHECKING ***/
 /* Return the names of types as strings. */
 const char* scamtype_name(enum ScamType);
@@ -0,0 +1,9 @@
+#pragma once
+#include "scamval.h"
+
+
+/* Run compiled code in the given environment and return the result. */
+ScamVal* vm_run(ScamCode*, ScamEnv*);
+
+/* Call a compiled function with a frame holding the arguments. The caller checks the arity. */
+ScamVal* vm_apply(ScamFunction*, ScamSeq* arglist);
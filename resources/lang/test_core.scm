@@ -80,6 +80,20 @@ ERROR
 18
 >>> double
 ERROR
+; closures over local defines of an enclosing function
+>>> (define (make-fun3 x) (define y (* x 2)) (define (add z) (+ x y z)) add)
+>>> ((make-fun3 10) 12)
+42
+; a local define doesn't hide a global of the same name until it has run
+>>> (define z 5)
+>>> (define (shadow-z) (define w z) (define z 7) [w z])
+>>> (shadow-z)
+[5 7]
+>>> z
+5
+; the last of two parameters with the same name wins
+>>> ((lambda (x x) x) 1 2)
+2
 ; recursive range function (range1 because range is a builtin name)
 >>> (define (range1 i) (if (= i 0) [] (append (range1 (- i 1)) i))) 
 >>> (range1 5)
@@ -135,4 +149,28 @@ ERROR
 >>> [(* 2 2) (* 3 3) (* 4 4)]
 [4 9 16]
 >>> {(* 2 2):"four"  (* 3 3):(concat "nin" "e") 16:"sixteen"}
-{9:"nine" 4:"four" 16:"sixteen"}
+{4:"four" 9:"nine" 16:"sixteen"}
+; a function that binds list, dict or begin calls what it bound, but literals are unaffected
+>>> (define (call-list list) (list 1 2))
+>>> (call-list +)
+3
+>>> (define (call-begin begin) (begin 1 2))
+>>> (call-begin +)
+3
+>>> (define (call-dict dict) (dict [1 2]))
+>>> (call-dict len)
+2
+>>> (define (literals list dict) [list {dict:list}])
+>>> (literals 1 2)
+[1 {2:1}]
+>>> (begin 1 2)
+2
+
+; the collector's counters
+>>> (define stats (gc-stats))
+>>> (>= (get stats "heap-peak-bytes") (get stats "heap-bytes"))
+true
+>>> (> (get (get stats "allocated") "symbol") 0)
+true
+>>> (gc-stats 1)
+ERROR
@@ -10,6 +10,30 @@
 "one"
 >>> (dict [1 "one"] [2 "two"] [3 "three"])
 {1:"one" 2:"two" 3:"three"}
+;; dictionaries keep their keys in the order they were first inserted
+>>> (bind (dict [3 "three"] [1 "one"] [2 "two"]) 1 "uno")
+{3:"three" 1:"uno" 2:"two"}
+;; enough keys to grow the table several times
+>>> (define (fill dct i) (if (= i 0) dct (fill (bind dct i (* i i)) (- i 1))))
+>>> (define big (fill {} 500))
+>>> (get big 1)
+1
+>>> (get big 500)
+250000
+>>> (get big 501)
+ERROR
+;; binding makes a new version, which shares the rest of the dictionary with the old one
+>>> (define other (bind big 1 "one"))
+>>> (get other 1)
+"one"
+>>> (get big 1)
+1
+>>> (get other 250)
+62500
+>>> (= big other)
+false
+>>> (= big (bind other 1 1))
+true
 ; parse errors
 >>> {1}
 ERROR
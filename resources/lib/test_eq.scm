@@ -29,3 +29,12 @@ false
 true
 >>> (= ["a string" 10 true] ["a string" 10 true])
 true
+; dictionary equality
+>>> (= {1:"one" 2:"two"} {2:"two" 1:"one"})
+true
+>>> (= {1:"one"} {1:"one" 2:"two"})
+false
+>>> (= {1:"one" 2:"two"} {1:"one"})
+false
+>>> (= {1:"one"} {1:"uno"})
+false
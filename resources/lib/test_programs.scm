@@ -20,3 +20,91 @@ true
 2
 >>> (my-pow 2 8)
 256
+; loops written as tail calls run in constant space
+>>> (define (count-to n) (define (count-helper i) (if (= i n) i (count-helper (+ i 1)))) (count-helper 0))
+>>> (count-to 100000)
+100000
+>>> (define (even2? n) (or (= n 0) (odd2? (- n 1))))
+>>> (define (odd2? n) (and (not (= n 0)) (even2? (- n 1))))
+>>> (even2? 10001)
+false
+; recursion that is too deep is an error, not a crash
+>>> (define (count-down n) (if (= n 0) 0 (+ 1 (count-down (- n 1)))))
+>>> (count-down 1000)
+1000
+>>> (count-down 1000000)
+ERROR
+>>> (count-down 1000)
+1000
+>>> (count-down 9000)
+9000
+; values stored in long-lived objects survive later collections
+>>> (define (build n acc) (if (= n 0) acc (build (- n 1) (append acc [n "x"]))))
+>>> (define built (build 2000 []))
+>>> (len (build 2000 []))
+2000
+>>> (len built)
+2000
+>>> (last built)
+[1 "x"]
+; collecting deeply nested values doesn't overflow the C stack
+>>> (define (nest n acc) (if (= n 0) acc (nest (- n 1) [acc])))
+>>> (len (nest 300000 []))
+1
+; builtins that change their arguments in place never change a value that a variable refers to
+>>> (define xs [1 2 3])
+>>> (append xs 4)
+[1 2 3 4]
+>>> (concat xs xs)
+[1 2 3 1 2 3]
+>>> (sort (prepend 9 xs))
+[1 2 3 9]
+>>> xs
+[1 2 3]
+>>> (define nested [xs [4 5]])
+>>> (append (head nested) 6)
+[1 2 3 6]
+>>> nested
+[[1 2 3] [4 5]]
+>>> (define (add-one lst) (append lst 1))
+>>> (add-one xs)
+[1 2 3 1]
+>>> (map add-one [xs xs])
+[[1 2 3 1] [1 2 3 1]]
+>>> xs
+[1 2 3]
+>>> (define word "abc")
+>>> (upper word)
+"ABC"
+>>> word
+"abc"
+>>> (define (adder lst) (lambda (x) (append lst x)))
+>>> (define add-to-xs (adder xs))
+>>> (add-to-xs 4)
+[1 2 3 4]
+>>> (add-to-xs 5)
+[1 2 3 5]
+; a list built up by a loop is appended to in place
+>>> (define (upto n) (define (loop i acc) (if (= i n) acc (loop (+ i 1) (append acc i)))) (loop 0 []))
+>>> (len (upto 1000))
+1000
+>>> (define (pairs n) (define (loop i acc) (if (= i n) acc (loop (+ i 1) (append acc [i acc])))) (loop 0 []))
+>>> (pairs 3)
+[[0 []] [1 [[0 []]]] [2 [[0 []] [1 [[0 []]]]]]]
+; copies and slices share their buffers until one of them is changed
+>>> (define digits [1 2 3 4 5 6])
+>>> (define middle (slice digits 1 4))
+>>> (append middle 9)
+[2 3 4 9]
+>>> (sort (drop [5 3 1 4] 1))
+[1 3 4]
+>>> (define (total lst acc) (if (empty? lst) acc (total (tail lst) (+ acc (head lst)))))
+>>> (total (range 0 2000) 0)
+1999000
+>>> [digits middle]
+[[1 2 3 4 5 6] [2 3 4]]
+>>> (define greeting "hello")
+>>> (concat (lower greeting) (upper greeting))
+"helloHELLO"
+>>> greeting
+"hello"
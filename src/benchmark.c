@@ -1,11 +1,14 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include "collector.h"
+#include "compile.h"
 #include "eval.h"
 #include "parse.h"
 #include "scamval.h"
+#include "vm.h"
 
 
 #define E (ScamVal*)ScamExpr_from
@@ -14,6 +17,13 @@
 
 
 void benchmark(ScamVal* ast, unsigned int reps, ScamEnv* env, const char* test_name, FILE* fp);
+void run_benchmarks(FILE* fp);
+void run_gc_benchmarks(FILE* fp);
+void run_dict_benchmarks(FILE* fp);
+
+
+/* Whether the benchmarks are run on the virtual machine or on the tree-walking evaluator. */
+static bool use_vm = false;
 
 
 int main() {
@@ -27,24 +37,82 @@ int main() {
         return 1;
     }
 
+    fputs("=== TREE-WALKING EVALUATOR ===\n", fp);
+    run_benchmarks(fp);
+    use_vm = true;
+    eval_set_vm(true);
+    fputs("\n=== BYTECODE VIRTUAL MACHINE ===\n", fp);
+    run_benchmarks(fp);
+    fputs("\n=== GARBAGE COLLECTOR ===\n", fp);
+    run_gc_benchmarks(fp);
+    fputs("\n=== DICTIONARIES ===\n", fp);
+    run_dict_benchmarks(fp);
+
+    fclose(fp);
+    return 0;
+}
+
+
+/* Evaluate an AST once with the evaluator being benchmarked. */
+static ScamVal* evaluate(ScamVal* ast, ScamEnv* env) {
+    if (use_vm) {
+        ScamCode* code = ScamVal_compile(ast);
+        ScamVal* ret = vm_run(code, env);
+        gc_unset_root((ScamVal*)code);
+        return ret;
+    } else {
+        return eval(ast, env);
+    }
+}
+
+
+void run_benchmarks(FILE* fp) {
     ScamEnv* env = ScamEnv_builtins();
+    /* DISPATCH: these expressions do little more than find out what kind of expression they are. */
+    /* (+ 1 2) */
+    benchmark(E(3, S("+"), I(1), I(2)), 1000000, env, "Builtin call", fp);
+    /* [1 2 3] */
+    benchmark(E(4, S("#list"), I(1), I(2), I(3)), 1000000, env, "List literal", fp);
+    /* {1:2} */
+    benchmark(E(2, S("#dict"), E(3, S("#list"), I(1), I(2))), 100000, env, "Dictionary literal", fp);
+
     /* FUNCTION APPLICATION */
     eval_str("(define (f x) (* x 2))", env);
     /* (f 100) */
     benchmark(E(2, S("f"), I(100)), 100000, env, "Function application", fp);
 
+    /* RECURSIVE FUNCTION */
+    eval_str("(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))", env);
+    /* (fib 15) */
+    benchmark(E(2, S("fib"), I(15)), 20, env, "Recursive function", fp);
+
     /* ARRAY APPEND */
     eval_str("(define items [])", env);
     /* (append items 0) */
     benchmark(E(3, S("append"), S("items"), I(0)), 100000, env, "Array append", fp);
 
+    /* APPEND IN A LOOP: the accumulator is only ever referred to by the loop, so it need not be
+     * copied before each append.
+     */
+    eval_str("(define (upto n) (define (loop i acc) (if (= i n) acc (loop (+ i 1) (append acc i)))) "
+             "(loop 0 []))", env);
+    /* (upto 10000) */
+    benchmark(E(2, S("upto"), I(10000)), 10, env, "Append in a loop", fp);
+
+    /* WALK A LIST: each tail shares the elements of the list instead of copying them. */
+    eval_str("(define (total lst acc) (if (empty? lst) acc (total (tail lst) (+ acc (head lst)))))",
+             env);
+    eval_str("(define numbers (range 0 10000))", env);
+    /* (total numbers 0) */
+    benchmark(E(3, S("total"), S("numbers"), I(0)), 10, env, "Walk a list with tail", fp);
+
     /* DICTIONARY INSERTION */
-    eval_str("(define dct {}", env);
+    eval_str("(define dct {})", env);
     clock_t begin = clock();
     for (int i = 0; i < 10000; i++) {
         /* (bind dct i i) */
         ScamVal* ast = E(4, S("bind"), S("dct"), I(i), I(i));
-        eval(ast, env);
+        gc_unset_root(evaluate(ast, env));
         gc_unset_root(ast);
     }
     clock_t end = clock();
@@ -54,20 +122,203 @@ int main() {
     /* DICTIONARY LOOKUP */
     /* (get dct -1) */
     benchmark(E(3, S("get"), S("dct"), I(-1)), 10000, env, "Dictionary lookup", fp);
+    gc_unset_root((ScamVal*)env);
+}
 
-    fclose(fp);
-    return 0;
+
+/* Time full collections of a heap whose only large object is the given one. */
+static void benchmark_gc(ScamEnv* env, ScamVal* v, unsigned int reps, const char* test_name,
+                         FILE* fp) {
+    ScamEnv_insert(env, S("v"), v);
+    gc_collect();
+    clock_t begin = clock();
+    for (size_t i = 0; i < reps; i++) {
+        gc_collect();
+    }
+    clock_t end = clock();
+    double this = (end - begin + 0.0) / CLOCKS_PER_SEC;
+    fprintf(fp, "%s: %f seconds, %d reps\n", test_name, this, reps);
+    ScamEnv_insert(env, S("v"), ScamNull_new());
 }
 
 
-void benchmark(ScamVal* ast, unsigned int reps, ScamEnv* env, const char* test_name, FILE* fp) {
+/* Allocate garbage and replace the elements of a large list, and report how long the collector
+ * paused the program for.
+ */
+static void benchmark_pauses(ScamSeq* big, const char* test_name, FILE* fp) {
+    clock_t begin = clock();
+    for (int i = 0; i < 3000000; i++) {
+        ScamSeq* v = ScamList_from(2, I(i), ScamStr_new("abc"));
+        gc_unset_root((ScamVal*)v);
+        if (i % 10 == 0) {
+            ScamSeq_set(big, i % ScamSeq_len(big), (ScamVal*)v);
+        }
+    }
+    clock_t end = clock();
+    double this = (end - begin + 0.0) / CLOCKS_PER_SEC;
+    fprintf(fp, "%s: %f seconds, ", test_name, this);
+    gc_report_pauses(fp);
+}
+
+
+/* Time the allocation of short-lived objects, which is all that the program does in between
+ * collections.
+ */
+static void benchmark_alloc(unsigned int reps, const char* test_name, FILE* fp) {
     clock_t begin = clock();
     for (size_t i = 0; i < reps; i++) {
-        ScamVal* ast_copy = gc_copy_ScamVal(ast);
-        eval(ast_copy, env);
-        gc_unset_root(ast_copy);
+        gc_unset_root((ScamVal*)ScamList_from(1, ScamStr_new("abc")));
+    }
+    clock_t end = clock();
+    double this = (end - begin + 0.0) / CLOCKS_PER_SEC;
+    fprintf(fp, "%s: %f seconds, %d reps\n", test_name, this, reps);
+}
+
+
+void run_gc_benchmarks(FILE* fp) {
+    ScamEnv* env = ScamEnv_builtins();
+    benchmark_alloc(1000000, "Allocate in an empty heap", fp);
+
+    /* A list of 200000 lists of one string each, of which every other one is then dropped, so that
+     * the free cells are spread across the whole heap.
+     */
+    ScamSeq* sparse = ScamList_new();
+    for (int i = 0; i < 200000; i++) {
+        ScamSeq_append(sparse, (ScamVal*)ScamList_from(1, ScamStr_new("abc")));
+    }
+    ScamEnv_insert(env, S("sparse"), (ScamVal*)sparse);
+    for (size_t i = 1; i < ScamSeq_len(sparse); i += 2) {
+        ScamSeq_set(sparse, i, (ScamVal*)ScamNull_new());
+    }
+    gc_collect();
+    benchmark_alloc(1000000, "Allocate in a fragmented heap", fp);
+    ScamEnv_insert(env, S("sparse"), ScamNull_new());
+
+    /* A list of 100000 lists of one string each */
+    ScamSeq* list = ScamList_new();
+    for (int i = 0; i < 100000; i++) {
+        ScamSeq_append(list, (ScamVal*)ScamList_from(1, ScamStr_new("abc")));
+    }
+    benchmark_gc(env, (ScamVal*)list, 20, "Mark wide list", fp);
+
+    /* A list nested 1000000 deep */
+    ScamSeq* nested = ScamList_new();
+    for (int i = 0; i < 1000000; i++) {
+        ScamSeq* outer = ScamList_new();
+        ScamSeq_append(outer, (ScamVal*)nested);
+        nested = outer;
+    }
+    benchmark_gc(env, (ScamVal*)nested, 20, "Mark deep list", fp);
+
+    /* A dictionary of 100000 strings */
+    ScamDict* dct = ScamDict_new();
+    for (int i = 0; i < 100000; i++) {
+        ScamDict_insert(dct, (ScamVal*)I(i), (ScamVal*)ScamStr_new("abc"));
+    }
+    benchmark_gc(env, (ScamVal*)dct, 20, "Mark dictionary", fp);
+
+    /* PAUSES: the same garbage beside a list of 300000 lists, with each way of marking. */
+    ScamSeq* big = ScamList_new();
+    for (int i = 0; i < 300000; i++) {
+        ScamSeq_append(big, (ScamVal*)ScamList_from(2, I(i), ScamStr_new("abc")));
+    }
+    ScamEnv_insert(env, S("big"), (ScamVal*)big);
+    fputs("Building the heap: ", fp);
+    gc_report_pauses(fp);
+    benchmark_pauses(big, "Stop-the-world pauses", fp);
+    gc_set_mark_budget(1000);
+    benchmark_pauses(big, "Incremental pauses", fp);
+    gc_set_mark_budget(0);
+    gc_set_concurrent(true);
+    benchmark_pauses(big, "Concurrent pauses", fp);
+    gc_set_concurrent(false);
+    gc_unset_root((ScamVal*)env);
+}
+
+
+/* Time inserting n keys into a new dictionary, looking each of them up, binding them one by one in
+ * new versions and iterating over them, each repeated enough times that every benchmark does about
+ * the same amount of work.
+ */
+static void benchmark_dict(int n, FILE* fp) {
+    unsigned int reps = 1000000 / n;
+    ScamDict* dct = NULL;
+    clock_t begin = clock();
+    for (size_t i = 0; i < reps; i++) {
+        if (dct != NULL) {
+            gc_unset_root((ScamVal*)dct);
+        }
+        dct = ScamDict_new();
+        for (int j = 0; j < n; j++) {
+            ScamDict_insert(dct, (ScamVal*)I(j), (ScamVal*)I(j));
+        }
+    }
+    clock_t end = clock();
+    fprintf(fp, "Insert %d keys: %f seconds, %d reps\n", n, (end - begin + 0.0) / CLOCKS_PER_SEC,
+            reps);
+
+    /* Small integers are unboxed, so the keys can be made afresh without allocating. */
+    begin = clock();
+    for (size_t i = 0; i < reps; i++) {
+        for (int j = 0; j < n; j++) {
+            ScamDict_lookup(dct, (ScamVal*)I(j));
+        }
+    }
+    end = clock();
+    fprintf(fp, "Look up %d keys: %f seconds, %d reps\n", n, (end - begin + 0.0) / CLOCKS_PER_SEC,
+            reps);
+
+    /* Bind each key in a new version of the dictionary, dropping the old one. */
+    begin = clock();
+    for (size_t i = 0; i < reps; i++) {
+        ScamDict* version = ScamDict_new();
+        for (int j = 0; j < n; j++) {
+            ScamDict* next = ScamDict_bind(version, (ScamVal*)I(j), (ScamVal*)I(j));
+            gc_unset_root((ScamVal*)version);
+            version = next;
+        }
+        gc_unset_root((ScamVal*)version);
+    }
+    end = clock();
+    fprintf(fp, "Bind %d keys: %f seconds, %d reps\n", n, (end - begin + 0.0) / CLOCKS_PER_SEC, reps);
+
+    long long total = 0;
+    begin = clock();
+    for (size_t i = 0; i < reps; i++) {
+        for (size_t j = 0; j < ScamDict_len(dct); j++) {
+            total += ScamInt_unbox((ScamInt*)ScamDict_val(dct, j));
+        }
+    }
+    end = clock();
+    fprintf(fp, "Iterate over %d keys: %f seconds, %d reps (total %lld)\n", n,
+            (end - begin + 0.0) / CLOCKS_PER_SEC, reps, total);
+    gc_unset_root((ScamVal*)dct);
+}
+
+
+void run_dict_benchmarks(FILE* fp) {
+    benchmark_dict(10, fp);
+    benchmark_dict(10000, fp);
+    benchmark_dict(1000000, fp);
+}
+
+
+void benchmark(ScamVal* ast, unsigned int reps, ScamEnv* env, const char* test_name, FILE* fp) {
+    clock_t begin = clock();
+    if (use_vm) {
+        /* The AST only needs to be compiled once. */
+        ScamCode* code = ScamVal_compile(ast);
+        for (size_t i = 0; i < reps; i++) {
+            gc_unset_root(vm_run(code, env));
+        }
+        gc_unset_root((ScamVal*)code);
+    } else {
+        for (size_t i = 0; i < reps; i++) {
+            gc_unset_root(eval(ast, env));
+        }
     }
     clock_t end = clock();
     double this = (end - begin + 0.0) / CLOCKS_PER_SEC;
     fprintf(fp, "%s: %f seconds, %d reps\n", test_name, this, reps);
+    gc_unset_root(ast);
 }
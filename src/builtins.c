@@ -27,15 +27,15 @@
 #define ASSERT_NO_ZEROS(args) { \
     if (ScamSeq_len(args) > 2) { \
         ScamVal* first = ScamSeq_get(args, 0); \
-        if ((first->type == SCAM_INT && ScamInt_unbox((ScamInt*)first) == 0) || \
-            (first->type == SCAM_DEC && ScamDec_unbox((ScamDec*)first) == 0.0)) { \
+        if ((ScamVal_type(first) == SCAM_INT && ScamInt_unbox((ScamInt*)first) == 0) || \
+            (ScamVal_type(first) == SCAM_DEC && ScamDec_unbox((ScamDec*)first) == 0.0)) { \
             return (ScamVal*)ScamErr_new("cannot divide by zero"); \
         } \
     } \
     for (size_t i = 1; i < ScamSeq_len(args); i++) { \
         ScamVal* v = ScamSeq_get(args, i); \
-        if ((v->type == SCAM_INT && ScamInt_unbox((ScamInt*)v) == 0) || \
-            (v->type == SCAM_DEC && ScamDec_unbox((ScamDec*)v) == 0.0)) { \
+        if ((ScamVal_type(v) == SCAM_INT && ScamInt_unbox((ScamInt*)v) == 0) || \
+            (ScamVal_type(v) == SCAM_DEC && ScamDec_unbox((ScamDec*)v) == 0.0)) { \
             return (ScamVal*)ScamErr_new("cannot divide by zero"); \
         } \
     } \
@@ -52,7 +52,7 @@ ScamVal* typecheck_args(char* name, ScamSeq* args, size_t arity, ...) {
         int type_we_need = va_arg(vlist, int);
         ScamVal* v = ScamSeq_get(args, i);
         if (!ScamVal_typecheck(v, type_we_need)) {
-            return (ScamVal*)ScamErr_type(name, i, v->type, type_we_need);
+            return (ScamVal*)ScamErr_type(name, i, ScamVal_type(v), type_we_need);
         }
     }
     return NULL;
@@ -66,7 +66,7 @@ ScamVal* typecheck_all(char* name, ScamSeq* args, unsigned int min, int type_we_
     for (size_t i = 0; i < n; i++) {
         ScamVal* v = ScamSeq_get(args, i);
         if (!ScamVal_typecheck(v, type_we_need)) {
-            return (ScamVal*)ScamErr_type(name, i, v->type, type_we_need);
+            return (ScamVal*)ScamErr_type(name, i, ScamVal_type(v), type_we_need);
         }
     }
     return NULL;
@@ -88,10 +88,10 @@ ScamVal* generic_mixed_arith(char* name, ScamSeq* args, arith_func op, int coerc
     TYPECHECK_ALL(name, args, 2, SCAM_NUM);
     ScamDec* first = (ScamDec*)ScamSeq_get(args, 0);
     double sum = ScamDec_unbox(first);
-    int seen_double = (first->type == SCAM_DEC) ? 1 : 0;
+    int seen_double = (ScamVal_type(first) == SCAM_DEC) ? 1 : 0;
     for (size_t i = 1; i < ScamSeq_len(args); i++) {
         ScamVal* v = ScamSeq_get(args, i);
-        if (v->type == SCAM_INT) {
+        if (ScamVal_type(v) == SCAM_INT) {
             sum = op(sum, ScamInt_unbox((ScamInt*)v));
         } else {
             sum = op(sum, ScamDec_unbox((ScamDec*)v));
@@ -113,7 +113,7 @@ ScamVal* builtin_add(ScamSeq* args) {
 ScamVal* builtin_negate(ScamSeq* args) {
     TYPECHECK_ARGS("-", args, 1, SCAM_NUM);
     ScamVal* v = ScamSeq_get(args, 0);
-    if (v->type == SCAM_INT) {
+    if (ScamVal_type(v) == SCAM_INT) {
         return (ScamVal*)ScamInt_new(-1 * ScamInt_unbox((ScamInt*)v));
     } else {
         return (ScamVal*)ScamDec_new(-1 * ScamDec_unbox((ScamDec*)v));
@@ -155,7 +155,7 @@ ScamVal* builtin_floor_div(ScamSeq* args) {
 ScamVal* builtin_len(ScamSeq* args) {
     TYPECHECK_ARGS("len", args, 1, SCAM_SEQ);
     ScamVal* arg = ScamSeq_get(args, 0);
-    if (arg->type == SCAM_STR) {
+    if (ScamVal_type(arg) == SCAM_STR) {
         return (ScamVal*)ScamInt_new(ScamStr_len((ScamStr*)arg));
     } else {
         return (ScamVal*)ScamInt_new(ScamSeq_len((ScamSeq*)arg));
@@ -165,7 +165,7 @@ ScamVal* builtin_len(ScamSeq* args) {
 ScamVal* builtin_empty(ScamSeq* args) {
     TYPECHECK_ARGS("empty?", args, 1, SCAM_SEQ);
     ScamVal* arg = ScamSeq_get(args, 0);
-    if (arg->type == SCAM_STR) {
+    if (ScamVal_type(arg) == SCAM_STR) {
         return (ScamVal*)ScamBool_new(ScamStr_len((ScamStr*)arg) == 0);
     } else {
         return (ScamVal*)ScamBool_new(ScamSeq_len((ScamSeq*)arg) == 0);
@@ -200,7 +200,7 @@ ScamVal* builtin_dict_get(ScamSeq* args) {
 
 ScamVal* builtin_get(ScamSeq* args) {
     TYPECHECK_ARGS("get", args, 2, SCAM_CONTAINER, SCAM_ANY);
-    int type = ScamSeq_get(args, 0)->type;
+    int type = ScamVal_type(ScamSeq_get(args, 0));
     if (type == SCAM_DICT) {
         return builtin_dict_get(args);
     } else {
@@ -229,7 +229,7 @@ ScamVal* builtin_list_slice(ScamSeq* args) {
 
 ScamVal* builtin_slice(ScamSeq* args) {
     TYPECHECK_ARGS("slice", args, 3, SCAM_SEQ, SCAM_INT, SCAM_INT);
-    int type = ScamSeq_get(args, 0)->type;
+    int type = ScamVal_type(ScamSeq_get(args, 0));
     if (type == SCAM_STR) {
         return builtin_str_slice(args);
     } else {
@@ -251,7 +251,7 @@ ScamVal* builtin_list_take(ScamSeq* args) {
 
 ScamVal* builtin_take(ScamSeq* args) {
     TYPECHECK_ARGS("take", args, 2, SCAM_SEQ, SCAM_INT);
-    int type = ScamSeq_get(args, 0)->type;
+    int type = ScamVal_type(ScamSeq_get(args, 0));
     if (type == SCAM_STR) {
         return builtin_str_take(args);
     } else {
@@ -273,7 +273,7 @@ ScamVal* builtin_list_drop(ScamSeq* args) {
 
 ScamVal* builtin_drop(ScamSeq* args) {
     TYPECHECK_ARGS("drop", args, 2, SCAM_SEQ, SCAM_INT);
-    int type = ScamSeq_get(args, 0)->type;
+    int type = ScamVal_type(ScamSeq_get(args, 0));
     if (type == SCAM_STR) {
         return builtin_str_drop(args);
     } else {
@@ -301,7 +301,7 @@ ScamVal* builtin_str_head(ScamSeq* args) {
 
 ScamVal* builtin_head(ScamSeq* args) {
     TYPECHECK_ARGS("head", args, 1, SCAM_SEQ);
-    int type = ScamSeq_get(args, 0)->type;
+    int type = ScamVal_type(ScamSeq_get(args, 0));
     if (type == SCAM_STR) {
         return builtin_str_head(args);
     } else {
@@ -323,7 +323,7 @@ ScamVal* builtin_str_tail(ScamSeq* args) {
 
 ScamVal* builtin_tail(ScamSeq* args) {
     TYPECHECK_ARGS("tail", args, 1, SCAM_SEQ);
-    int type = ScamSeq_get(args, 0)->type;
+    int type = ScamVal_type(ScamSeq_get(args, 0));
     if (type == SCAM_STR) {
         return builtin_str_tail(args);
     } else {
@@ -352,7 +352,7 @@ ScamVal* builtin_str_last(ScamSeq* args) {
 
 ScamVal* builtin_last(ScamSeq* args) {
     TYPECHECK_ARGS("last", args, 1, SCAM_SEQ);
-    int type = ScamSeq_get(args, 0)->type;
+    int type = ScamVal_type(ScamSeq_get(args, 0));
     if (type == SCAM_STR) {
         return builtin_str_last(args);
     } else {
@@ -375,7 +375,7 @@ ScamVal* builtin_str_init(ScamSeq* args) {
 
 ScamVal* builtin_init(ScamSeq* args) {
     TYPECHECK_ARGS("init", args, 1, SCAM_SEQ);
-    int type = ScamSeq_get(args, 0)->type;
+    int type = ScamVal_type(ScamSeq_get(args, 0));
     if (type == SCAM_STR) {
         return builtin_str_init(args);
     } else {
@@ -392,6 +392,8 @@ ScamVal* builtin_insert(ScamSeq* args) {
         ScamSeq_insert(list_arg, i, to_insert);
         return (ScamVal*)list_arg;
     } else {
+        gc_unset_root((ScamVal*)list_arg);
+        gc_unset_root(to_insert);
         return (ScamVal*)ScamErr_new("attempted sequence access out of range");
     }
 }
@@ -563,8 +565,7 @@ ScamVal* builtin_bind(ScamSeq* args) {
     ScamDict* dict_arg = (ScamDict*)ScamSeq_get(args, 0);
     ScamVal* key_arg = ScamSeq_get(args, 1);
     ScamVal* val_arg = ScamSeq_get(args, 2);
-    ScamDict_insert(dict_arg, key_arg, val_arg);
-    return (ScamVal*)dict_arg;
+    return (ScamVal*)ScamDict_bind(dict_arg, key_arg, val_arg);
 }
 
 ScamVal* builtin_list(ScamSeq* args) {
@@ -573,20 +574,7 @@ ScamVal* builtin_list(ScamSeq* args) {
 }
 
 ScamVal* builtin_dict(ScamSeq* args) {
-    TYPECHECK_ALL("dict", args, 0, SCAM_LIST);
-    ScamDict* ret = ScamDict_new(NULL);
-    for (size_t i = 0; i < ScamSeq_len(args); i++) {
-        ScamSeq* pair = (ScamSeq*)ScamSeq_get(args, i);
-        if (ScamSeq_len(pair) == 2) {
-            ScamVal* key = ScamSeq_get(pair, 0);
-            ScamVal* val = ScamSeq_get(pair, 1);
-            ScamDict_insert(ret, key, val);
-        } else {
-            gc_unset_root((ScamVal*)ret);
-            return (ScamVal*)ScamErr_new("'dict' expects each argument to be a pair");
-        }
-    }
-    return (ScamVal*)ret;
+    return ScamDict_from_pairs(args);
 }
 
 ScamVal* builtin_str(ScamSeq* args) {
@@ -602,7 +590,7 @@ ScamVal* builtin_repr(ScamSeq* args) {
 ScamVal* builtin_print(ScamSeq* args) {
     TYPECHECK_ARGS("print", args, 1, SCAM_ANY);
     ScamVal* arg = ScamSeq_get(args, 0);
-    if (arg->type != SCAM_STR) {
+    if (ScamVal_type(arg) != SCAM_STR) {
         ScamVal_print(arg);
     } else {
         printf("%s", ScamStr_unbox((ScamStr*)arg));
@@ -613,7 +601,7 @@ ScamVal* builtin_print(ScamSeq* args) {
 ScamVal* builtin_println(ScamSeq* args) {
     TYPECHECK_ARGS("println", args, 1, SCAM_ANY);
     ScamVal* arg = ScamSeq_get(args, 0);
-    if (arg->type != SCAM_STR) {
+    if (ScamVal_type(arg) != SCAM_STR) {
         ScamVal_println(arg);
     } else {
         printf("%s\n", ScamStr_unbox((ScamStr*)arg));
@@ -707,7 +695,7 @@ ScamVal* builtin_divmod(ScamSeq* args) {
 ScamVal* builtin_abs(ScamSeq* args) {
     TYPECHECK_ARGS("abs", args, 1, SCAM_NUM);
     ScamVal* num_arg = ScamSeq_get(args, 0);
-    if (num_arg->type == SCAM_DEC) {
+    if (ScamVal_type(num_arg) == SCAM_DEC) {
         double d = ScamDec_unbox((ScamDec*)num_arg);
         return (ScamVal*)ScamDec_new(fabs(d));
     } else {
@@ -733,7 +721,7 @@ ScamVal* builtin_pow(ScamSeq* args) {
     ScamVal* exp_arg = ScamSeq_get(args, 1);
     double base = ScamDec_unbox((ScamDec*)base_arg);
     double exp = ScamDec_unbox((ScamDec*)exp_arg);
-    if (base_arg->type == SCAM_INT && exp_arg->type == SCAM_INT) {
+    if (ScamVal_type(base_arg) == SCAM_INT && ScamVal_type(exp_arg) == SCAM_INT) {
         return (ScamVal*)ScamInt_new(pow(base, exp));
     } else {
         return (ScamVal*)ScamDec_new(pow(base, exp));
@@ -773,7 +761,8 @@ ScamVal* builtin_range(ScamSeq* args) {
     if (ScamInt_unbox(lower) <= ScamInt_unbox(upper)) {
         int count = ScamInt_unbox(lower);
         ScamSeq* ret = ScamList_new();
-        while (count < ScamInt_unbox(upper)) {
+        /* Nothing more can be appended once memory has run out. */
+        while (count < ScamInt_unbox(upper) && !gc_heap_exhausted()) {
             ScamSeq_append(ret, (ScamVal*)ScamInt_new(count));
             count++;
         }
@@ -798,7 +787,7 @@ int ScamVal_cmp(const void* a, const void* b) {
 ScamVal* builtin_sort(ScamSeq* args) {
     TYPECHECK_ARGS("sort", args, 1, SCAM_LIST);
     ScamSeq* list_arg = (ScamSeq*)ScamSeq_pop(args, 0);
-    qsort(list_arg->arr, ScamSeq_len(list_arg), sizeof *list_arg->arr, ScamVal_cmp);
+    ScamSeq_sort(list_arg, ScamVal_cmp);
     return (ScamVal*)list_arg;
 }
 
@@ -811,8 +800,9 @@ ScamVal* builtin_map(ScamSeq* args) {
         ScamSeq* arglist = ScamExpr_from(1, v);
         ScamVal* res = eval_apply(fun, arglist);
         gc_unset_root((ScamVal*)arglist);
-        if (res->type != SCAM_ERR) {
+        if (ScamVal_type(res) != SCAM_ERR) {
             ScamSeq_set(list_arg, i, res);
+            gc_unset_root(res);
         } else {
             gc_unset_root(fun);
             gc_unset_root((ScamVal*)list_arg);
@@ -832,12 +822,12 @@ ScamVal* builtin_filter(ScamSeq* args) {
         ScamSeq* arglist = ScamExpr_from(1, v);
         ScamVal* cond = eval_apply(fun, arglist);
         gc_unset_root((ScamVal*)arglist);
-        if (cond->type == SCAM_BOOL) {
+        if (ScamVal_type(cond) == SCAM_BOOL) {
             if (!ScamBool_unbox((ScamBool*)cond)) {
                 ScamSeq_delete(list_arg, i);
             }
             gc_unset_root(cond);
-        } else if (cond->type == SCAM_ERR) {
+        } else if (ScamVal_type(cond) == SCAM_ERR) {
             return cond;
         } else {
             gc_unset_root(cond);
@@ -904,25 +894,63 @@ ScamVal* builtin_error(ScamSeq* args) {
         return (ScamVal*)ScamErr_new("");
     } else {
         ScamStr* concatenated = (ScamStr*)builtin_str_concat(args);
+        ScamStr* ret = ScamErr_new(ScamStr_unbox(concatenated));
         gc_unset_root((ScamVal*)concatenated);
-        return (ScamVal*)ScamErr_new(ScamStr_unbox(concatenated));
+        return (ScamVal*)ret;
     }
 }
 
-void add_builtin(ScamEnv* env, char* sym, scambuiltin_fun bltin) {
-    ScamEnv_insert(env, ScamSym_new(sym), (ScamVal*)ScamBuiltin_new(bltin));
+/* Make a dictionary from the name of each type to its count in the array, leaving out zeros. */
+static ScamDict* type_counts(const size_t counts[GC_NTYPES]) {
+    ScamDict* ret = ScamDict_new();
+    for (size_t type = 0; type < GC_NTYPES; type++) {
+        if (counts[type] > 0) {
+            ScamDict_insert(ret, (ScamVal*)ScamStr_new(scamtype_name(type)),
+                            (ScamVal*)ScamInt_new(counts[type]));
+        }
+    }
+    return ret;
+}
+
+static void insert_stat(ScamDict* dct, const char* name, ScamVal* v) {
+    ScamDict_insert(dct, (ScamVal*)ScamStr_new(name), v);
+}
+
+ScamVal* builtin_gc_stats(ScamSeq* args) {
+    TYPECHECK_ARGS("gc-stats", args, 0);
+    /* Take a copy, since building the dictionary changes the counters. */
+    gc_stats_t stats = *gc_get_stats();
+    ScamDict* ret = ScamDict_new();
+    insert_stat(ret, "minor-collections", (ScamVal*)ScamInt_new(stats.minor_collections));
+    insert_stat(ret, "major-collections", (ScamVal*)ScamInt_new(stats.major_collections));
+    insert_stat(ret, "pauses", (ScamVal*)ScamInt_new(stats.pauses));
+    insert_stat(ret, "pause-total-ms", (ScamVal*)ScamDec_new(stats.pause_total * 1000));
+    insert_stat(ret, "pause-max-ms", (ScamVal*)ScamDec_new(stats.pause_max * 1000));
+    insert_stat(ret, "heap-bytes", (ScamVal*)ScamInt_new(stats.heap_bytes));
+    insert_stat(ret, "heap-peak-bytes", (ScamVal*)ScamInt_new(stats.heap_peak));
+    insert_stat(ret, "live-bytes", (ScamVal*)ScamInt_new(stats.live_bytes));
+    insert_stat(ret, "allocated", (ScamVal*)type_counts(stats.allocated));
+    insert_stat(ret, "allocated-bytes", (ScamVal*)type_counts(stats.allocated_bytes));
+    insert_stat(ret, "freed", (ScamVal*)type_counts(stats.freed));
+    insert_stat(ret, "freed-bytes", (ScamVal*)type_counts(stats.freed_bytes));
+    return (ScamVal*)ret;
+}
+
+/* The modes say how the builtin uses each of its arguments, see ScamBuiltin. */
+void add_builtin(ScamEnv* env, char* sym, scambuiltin_fun bltin, const char* modes) {
+    ScamEnv_insert(env, ScamSym_new(sym), (ScamVal*)ScamBuiltin_new(sym, bltin, modes));
 }
 
-/* If a builtin doesn't change its arguments, then it should be registered as constant so that the
- * evaluator doesn't bother copying the argument list.
+/* Most builtins only read their arguments, so they are registered as constant, which means that
+ * they borrow all of them.
  */
 void add_const_builtin(ScamEnv* env, char* sym, scambuiltin_fun bltin) {
-    ScamEnv_insert(env, ScamSym_new(sym), (ScamVal*)ScamBuiltin_new_const(bltin));
+    add_builtin(env, sym, bltin, "b");
 }
 
 ScamEnv* ScamEnv_builtins(void) {
     ScamEnv* env = ScamEnv_new(NULL);
-    add_builtin(env, "begin", builtin_begin);
+    add_builtin(env, "begin", builtin_begin, "c");
     add_const_builtin(env, "-", builtin_sub);
     add_const_builtin(env, "+", builtin_add);
     add_const_builtin(env, "*", builtin_mult);
@@ -938,31 +966,34 @@ ScamEnv* ScamEnv_builtins(void) {
     /* Sequence functions */
     add_const_builtin(env, "len", builtin_len);
     add_const_builtin(env, "empty?", builtin_empty);
+    /* head, last and get borrow their container: they return a copy of a list element, a new
+     * string, or a dictionary value that the dictionary has already shared (see ScamDict_insert).
+     */
     add_const_builtin(env, "head", builtin_head);
-    add_builtin(env, "tail", builtin_tail);
+    add_builtin(env, "tail", builtin_tail, "m");
     add_const_builtin(env, "last", builtin_last);
-    add_builtin(env, "init", builtin_init);
+    add_builtin(env, "init", builtin_init, "m");
     add_const_builtin(env, "get", builtin_get);
-    add_builtin(env, "slice", builtin_slice);
-    add_builtin(env, "take", builtin_take);
-    add_builtin(env, "drop", builtin_drop);
-    add_builtin(env, "insert", builtin_insert);
-    add_builtin(env, "append", builtin_append);
-    add_builtin(env, "prepend", builtin_prepend);
-    add_builtin(env, "concat", builtin_concat);
+    add_const_builtin(env, "slice", builtin_slice);
+    add_const_builtin(env, "take", builtin_take);
+    add_const_builtin(env, "drop", builtin_drop);
+    add_builtin(env, "insert", builtin_insert, "mbc");
+    add_builtin(env, "append", builtin_append, "mc");
+    add_builtin(env, "prepend", builtin_prepend, "cm");
+    add_builtin(env, "concat", builtin_concat, "mb");
     add_const_builtin(env, "find", builtin_find);
     add_const_builtin(env, "rfind", builtin_rfind);
     /* String functions */
-    add_builtin(env, "upper", builtin_upper);
-    add_builtin(env, "lower", builtin_lower);
+    add_builtin(env, "upper", builtin_upper, "m");
+    add_builtin(env, "lower", builtin_lower, "m");
     add_const_builtin(env, "isupper", builtin_isupper);
     add_const_builtin(env, "islower", builtin_islower);
-    add_builtin(env, "trim", builtin_trim);
-    add_builtin(env, "split", builtin_split);
+    add_builtin(env, "trim", builtin_trim, "m");
+    add_const_builtin(env, "split", builtin_split);
     /* Dictionary functions */
-    add_builtin(env, "bind", builtin_bind);
+    add_builtin(env, "bind", builtin_bind, "bcc");
     /* Constructors */
-    add_const_builtin(env, "list", builtin_list);
+    add_builtin(env, "list", builtin_list, "c");
     add_const_builtin(env, "dict", builtin_dict);
     add_const_builtin(env, "str", builtin_str);
     add_const_builtin(env, "repr", builtin_repr);
@@ -970,10 +1001,10 @@ ScamEnv* ScamEnv_builtins(void) {
     add_const_builtin(env, "print", builtin_print);
     add_const_builtin(env, "println", builtin_println);
     add_const_builtin(env, "open", builtin_open);
-    add_builtin(env, "close", builtin_close);
+    add_const_builtin(env, "close", builtin_close);
     add_const_builtin(env, "port-good?", builtin_port_good);
-    add_builtin(env, "readline", builtin_readline);
-    add_builtin(env, "readchar", builtin_readchar);
+    add_const_builtin(env, "readline", builtin_readline);
+    add_const_builtin(env, "readchar", builtin_readchar);
     /* Math functions */
     add_const_builtin(env, "ceil", builtin_ceil);
     add_const_builtin(env, "floor", builtin_floor);
@@ -986,11 +1017,13 @@ ScamEnv* ScamEnv_builtins(void) {
     /* Miscellaneous functions */
     add_const_builtin(env, "assert", builtin_assert);
     add_const_builtin(env, "range", builtin_range);
-    add_builtin(env, "sort", builtin_sort);
-    add_builtin(env, "map", builtin_map);
-    add_builtin(env, "filter", builtin_filter);
+    add_builtin(env, "sort", builtin_sort, "m");
+    add_builtin(env, "map", builtin_map, "bm");
+    add_builtin(env, "filter", builtin_filter, "bm");
+    /* id returns the address of its argument as a new integer, never the argument itself. */
     add_const_builtin(env, "id", builtin_id);
-    add_builtin(env, "error", builtin_error);
+    add_builtin(env, "error", builtin_error, "mb");
+    add_const_builtin(env, "gc-stats", builtin_gc_stats);
     /* stdin, stdout and stderr */
     ScamEnv_insert(env, ScamSym_new("stdin"), (ScamVal*)ScamPort_new(stdin));
     ScamEnv_insert(env, ScamSym_new("stdout"), (ScamVal*)ScamPort_new(stdout));
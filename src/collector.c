@@ -1,296 +1,1340 @@
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "collector.h"
+#include "profiler.h"
 
 
-static ScamVal** scamval_objs = NULL;
-static size_t count = 0;
-static size_t first_avail = 0;
+/* The heap is split into two generations. New objects are recorded in the nursery, which is
+ * emptied by each minor collection. Objects that survive a collection are promoted to the old
+ * generation, which is only collected once it has grown to major_threshold bytes, counting the
+ * blocks that its objects own as well as the objects themselves. The threshold is set after each
+ * major collection so that the objects that survived it take up LIVE_PERCENT of the heap. Objects
+ * never move, since the rest of the interpreter holds raw pointers to them.
+ */
+static size_t old_count = 0;
+static size_t old_bytes = 0;
+static size_t major_threshold = 0;
+
+/* The nursery is between NURSERY_SIZE and NURSERY_MAX objects long. It grows when many of its
+ * objects survive a minor collection, which gives them more time to die young and spreads the cost
+ * of the remembered set over more allocations, and shrinks back when few do.
+ */
+static ScamVal** nursery = NULL;
+static size_t nursery_count = 0;
+static size_t nursery_limit = 0;
+
+/* With a non-zero heap limit, the evaluators fail with an out of memory error while a major
+ * collection can't bring the old generation under it. The same happens if malloc fails, in which
+ * case the reserve is given up to let the program unwind, and taken back by the next major
+ * collection.
+ */
+static size_t heap_limit = 0;
+static bool heap_exhausted = false;
+static void* reserve = NULL;
+
+/* Old objects that have been changed to refer to a young object since the last collection. */
+static ScamVal** remembered = NULL;
+static size_t remembered_count = 0;
+static size_t remembered_size = 0;
+
+/* Every object that is in use by the interpreter itself rather than reachable from another object
+ * is in the root set. An object's root field is its index in the array plus one, or zero if it
+ * isn't a root. Roots are mostly released in the reverse of the order they were added in, so
+ * removing one by moving the last root into its place keeps the array in order of age.
+ */
+static ScamVal** roots = NULL;
+static size_t roots_count = 0;
+static size_t roots_size = 0;
+
+/* Stacks of values that are scanned along with the roots, see gc_add_stack. */
+typedef struct {
+    ScamVal*** arr;
+    size_t* count;
+} gc_stack_t;
 
+static gc_stack_t* stacks = NULL;
+static size_t stacks_count = 0;
 
-/* If you change either of these, make sure that the ScamDict_new function in dict.c will still
- * work.
+/* Whether the collection in progress is a minor one, which doesn't look into old objects. */
+static bool minor = false;
+
+/* With a non-zero mark budget, a major collection marks incrementally: every SLICE_INTERVAL
+ * allocations, a slice of at most mark_budget objects is scanned, until the mark stack is empty.
+ * The slices only mark old objects, and leave the young ones to the minor collections that carry on
+ * in the meantime. Objects that a minor collection promotes are pushed onto the mark stack, and the
+ * young objects that are left at the end are marked along with the roots.
  */
-enum { HEAP_INIT = 1024, HEAP_GROW = 2 };
+static bool marking = false;
+static bool skip_young = false;
+static size_t mark_budget = 0;
+static size_t slice_countdown = 0;
+
+/* With concurrent marking, the mark stack is emptied by a separate thread, MARK_BATCH objects at a
+ * time, while the program carries on, and the program only stops to finish the collection once the
+ * stack is empty. The marker thread holds heap_lock while it marks, and while marking is in
+ * progress the program takes it too, through gc_lock, to change the references that an object
+ * holds, as well as for its own part of the collection. lock_depth is the number of times the
+ * program has taken the lock without releasing it, and lock_waiters tells the marker thread to let
+ * it have the lock between batches.
+ */
+static bool concurrent = false;
+static pthread_t marker;
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t marker_wakeup = PTHREAD_COND_INITIALIZER;
+static bool marker_idle = false;
+static bool marker_exit = false;
+static unsigned int lock_depth = 0;
+static int lock_waiters = 0;
+
+/* The number of objects marked by the major collection in progress, and their size in bytes. */
+static size_t marked_count = 0;
+static size_t marked_bytes = 0;
+
+/* The length of the collector's pauses since the last report, in seconds. */
+static size_t pause_count = 0;
+static double pause_max = 0.0;
+static double pause_total = 0.0;
+
+static gc_stats_t stats;
+
+
+enum { HEAP_INIT = 1024, HEAP_GROW = 2, NURSERY_SIZE = 4096, NURSERY_MAX = 32768,
+       SLICE_INTERVAL = 256, MARK_BATCH = 1024 };
+enum { HEAP_INIT_BYTES = 262144, LIVE_PERCENT = 50, RESERVE_SIZE = 262144 };
 static void gc_init();
 
 
-/* Mark all objects which can be reached from the given object. */
-static void gc_mark(ScamVal* v) {
-    if (v != NULL && !v->seen) {
-        v->seen = true;
-        switch (v->type) {
-            case SCAM_LIST:
-            case SCAM_SEXPR:
-                for (size_t i = 0; i < ScamSeq_len((ScamSeq*)v); i++) {
-                    gc_mark(ScamSeq_get((ScamSeq*)v, i));
+/* Objects of up to 256 bytes are packed into slabs: chunks of SLAB_SIZE bytes divided into cells of
+ * one size class. Each size class has a pool of slabs for ScamVals and another for blocks, such as
+ * dictionary tables and sequence arrays, which are freed explicitly rather than swept. Anything
+ * larger comes from malloc, and large ScamVals are kept on a doubly-linked list so that they can be
+ * swept too.
+ *
+ * Mark bits are kept beside the objects rather than in them: each slab starts with a bitmap with
+ * one bit for every MARK_GRANULE bytes, and each large object has a flag in front of it. Marking
+ * therefore only reads objects, and clearing the marks of a slab is a memset. Slabs are aligned to
+ * their size, so that the slab of an object can be found by masking its address.
+ */
+enum { SLAB_SIZE = 16384, MARK_GRANULE = 8, MARK_WORD_BITS = 64 };
+static const size_t class_sizes[] = { 24, 32, 40, 48, 56, 64, 80, 96, 128, 192, 256 };
+enum { NCLASSES = sizeof class_sizes / sizeof *class_sizes, LARGE_CLASS = NCLASSES,
+       FREE_CELL = 0xff };
+
+typedef struct slab_rec {
+    struct slab_rec* next;
+    size_t cell_size;
+    /* Whether the slab still has to be swept after the last major collection. */
+    bool unswept;
+    uint64_t marks[SLAB_SIZE / MARK_GRANULE / MARK_WORD_BITS];
+} slab_t;
+
+/* A cell that is not in use. In a ScamVal slab the header remains valid, with a size class of
+ * FREE_CELL, so that the sweep can tell it apart from live objects.
+ */
+typedef struct free_cell_rec {
+    SCAMVAL_HEADER;
+    struct free_cell_rec* next;
+} free_cell;
+
+/* After a major collection the slabs of each ScamVal pool are swept one at a time, starting from
+ * the unswept field, whenever the pool runs out of free cells. New slabs are added at the front of
+ * the list, behind the slabs that are waiting to be swept.
+ */
+typedef struct {
+    slab_t* slabs;
+    slab_t* unswept;
+    free_cell* free_list;
+} pool_t;
+
+static pool_t object_pools[NCLASSES];
+static pool_t block_pools[NCLASSES];
+
+typedef struct large_rec {
+    struct large_rec* prev;
+    struct large_rec* next;
+    size_t size;
+    bool marked;
+} large_t;
+
+static large_t large_objects = { &large_objects, &large_objects, 0, false };
+
+/* The number of slabs, over all the pools, that have not been swept since the last major
+ * collection.
+ */
+static size_t unswept_count = 0;
+
+
+/* Return the index of the smallest size class that fits the size, or LARGE_CLASS. */
+static size_t size_class(size_t size) {
+    size_t i = 0;
+    while (i < NCLASSES && class_sizes[i] < size) {
+        i++;
+    }
+    return i;
+}
+
+
+static slab_t* slab_of(const ScamVal* v) {
+    return (slab_t*)((uintptr_t)v & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+
+static bool slab_is_marked(const slab_t* slab, size_t offset) {
+    size_t i = offset / MARK_GRANULE;
+    return (slab->marks[i / MARK_WORD_BITS] >> (i % MARK_WORD_BITS)) & 1;
+}
+
+
+static bool gc_is_marked(const ScamVal* v) {
+    if (v->size_class == LARGE_CLASS) {
+        return ((large_t*)v - 1)->marked;
+    }
+    return slab_is_marked(slab_of(v), (uintptr_t)v & (SLAB_SIZE - 1));
+}
+
+
+/* Mark the object, and return whether it was marked already. */
+static bool gc_test_and_mark(const ScamVal* v) {
+    if (v->size_class == LARGE_CLASS) {
+        large_t* large = (large_t*)v - 1;
+        bool ret = large->marked;
+        large->marked = true;
+        return ret;
+    }
+    size_t i = ((uintptr_t)v & (SLAB_SIZE - 1)) / MARK_GRANULE;
+    uint64_t* word = &slab_of(v)->marks[i / MARK_WORD_BITS];
+    uint64_t bit = (uint64_t)1 << (i % MARK_WORD_BITS);
+    bool ret = (*word & bit) != 0;
+    *word |= bit;
+    return ret;
+}
+
+
+static void gc_set_marked(const ScamVal* v, bool marked) {
+    if (v->size_class == LARGE_CLASS) {
+        ((large_t*)v - 1)->marked = marked;
+    } else {
+        size_t i = ((uintptr_t)v & (SLAB_SIZE - 1)) / MARK_GRANULE;
+        uint64_t bit = (uint64_t)1 << (i % MARK_WORD_BITS);
+        if (marked) {
+            slab_of(v)->marks[i / MARK_WORD_BITS] |= bit;
+        } else {
+            slab_of(v)->marks[i / MARK_WORD_BITS] &= ~bit;
+        }
+    }
+}
+
+
+/* Keep track of the memory that the collector has taken from malloc for objects and blocks. */
+static void gc_heap_grow(size_t size) {
+    stats.heap_bytes += size;
+    if (stats.heap_bytes > stats.heap_peak) {
+        stats.heap_peak = stats.heap_bytes;
+    }
+}
+
+
+static void gc_heap_shrink(size_t size) {
+    stats.heap_bytes -= size;
+}
+
+
+static bool gc_make_room(int attempt, bool can_collect);
+static void gc_out_of_memory(void);
+
+static slab_t* gc_alloc_slab(void) {
+    void* ret;
+    for (int attempt = 0; posix_memalign(&ret, SLAB_SIZE, SLAB_SIZE) != 0; attempt++) {
+        if (!gc_make_room(attempt, true)) {
+            gc_out_of_memory();
+        }
+    }
+    gc_heap_grow(SLAB_SIZE);
+    return ret;
+}
+
+
+static void gc_del_ScamVal(ScamVal* v);
+
+/* Sweep the next slab of a ScamVal pool that is waiting to be swept, freeing the old objects that
+ * were not marked by the last major collection, and clear its marks. Young objects in the slab
+ * were allocated since then and are left to the minor collections.
+ */
+static void pool_sweep_slab(pool_t* pool) {
+    slab_t* slab = pool->unswept;
+    pool->unswept = slab->next;
+    for (size_t off = sizeof *slab; off + slab->cell_size <= SLAB_SIZE; off += slab->cell_size) {
+        ScamVal* v = (ScamVal*)((char*)slab + off);
+        if (v->size_class != FREE_CELL && v->old && !slab_is_marked(slab, off)) {
+            gc_del_ScamVal(v);
+        }
+    }
+    memset(slab->marks, 0, sizeof slab->marks);
+    slab->unswept = false;
+    unswept_count--;
+}
+
+
+/* Sweep every slab that is still waiting to be swept. */
+static void gc_finish_sweep(void) {
+    for (size_t cls = 0; cls < NCLASSES && unswept_count > 0; cls++) {
+        while (object_pools[cls].unswept != NULL) {
+            pool_sweep_slab(&object_pools[cls]);
+        }
+    }
+}
+
+
+static void* pool_alloc(pool_t* pool, size_t cls) {
+    while (pool->free_list == NULL && pool->unswept != NULL) {
+        pool_sweep_slab(pool);
+    }
+    if (pool->free_list == NULL) {
+        slab_t* slab = gc_alloc_slab();
+        slab->next = pool->slabs;
+        slab->cell_size = class_sizes[cls];
+        slab->unswept = false;
+        memset(slab->marks, 0, sizeof slab->marks);
+        pool->slabs = slab;
+        /* Thread the cells backwards, so that they are handed out in order of address. */
+        size_t ncells = (SLAB_SIZE - sizeof *slab) / slab->cell_size;
+        for (size_t i = ncells; i-- > 0; ) {
+            free_cell* cell = (free_cell*)((char*)(slab + 1) + i * slab->cell_size);
+            cell->size_class = FREE_CELL;
+            cell->next = pool->free_list;
+            pool->free_list = cell;
+        }
+    }
+    free_cell* ret = pool->free_list;
+    pool->free_list = ret->next;
+    return ret;
+}
+
+
+static void pool_free(pool_t* pool, void* p) {
+    free_cell* cell = p;
+    cell->size_class = FREE_CELL;
+    cell->next = pool->free_list;
+    pool->free_list = cell;
+}
+
+
+static ScamVal* gc_alloc_object(size_t size) {
+    size_t cls = size_class(size);
+    ScamVal* ret;
+    if (cls == LARGE_CLASS) {
+        large_t* large = gc_malloc(sizeof *large + size);
+        gc_heap_grow(sizeof *large + size);
+        large->size = size;
+        large->marked = false;
+        large->prev = &large_objects;
+        large->next = large_objects.next;
+        large_objects.next->prev = large;
+        large_objects.next = large;
+        ret = (ScamVal*)(large + 1);
+    } else {
+        ret = pool_alloc(&object_pools[cls], cls);
+    }
+    ret->size_class = cls;
+    return ret;
+}
+
+
+/* Return the number of bytes that the collector allocated for an object. */
+static size_t gc_cell_size(const ScamVal* v) {
+    if (v->size_class == LARGE_CLASS) {
+        return ((const large_t*)v - 1)->size;
+    } else {
+        return class_sizes[v->size_class];
+    }
+}
+
+
+/* Return the number of bytes that an object takes up, along with the blocks and strings it owns. */
+static size_t gc_sizeof(const ScamVal* v) {
+    size_t size = gc_cell_size(v);
+    switch (ScamVal_type(v)) {
+        case SCAM_LIST:
+        case SCAM_SEXPR:
+            return size + ((const ScamSeq*)v)->mem_size * sizeof(ScamVal*);
+        case SCAM_STR:
+        case SCAM_SYM:
+        case SCAM_ERR:
+            return size + ((const ScamStr*)v)->mem_size;
+        case SCAM_DICT:
+            /* The entries in insertion order are a cache that reads fill in without the heap lock,
+             * so the marker thread can't count it here. Its block still counts towards the heap.
+             */
+            return size;
+        case SCAM_TRIE:
+            return size + ((const ScamTrie*)v)->count * sizeof(ScamDict_entry);
+        case SCAM_ENV:
+            return size + ((const ScamEnv*)v)->nslots * sizeof(ScamVal*);
+        case SCAM_CODE:
+            return size + ((const ScamCode*)v)->mem_size * sizeof(int);
+        default:
+            return size;
+    }
+}
+
+
+static void gc_free_object(ScamVal* v) {
+    stats.freed[v->type]++;
+    stats.freed_bytes[v->type] += gc_cell_size(v);
+    if (v->size_class == LARGE_CLASS) {
+        large_t* large = (large_t*)v - 1;
+        large->prev->next = large->next;
+        large->next->prev = large->prev;
+        gc_heap_shrink(sizeof *large + large->size);
+        free(large);
+    } else {
+        pool_free(&object_pools[v->size_class], v);
+    }
+}
+
+
+/* Call the function on every object in the heap. The function may free the object. */
+static void gc_walk(void (*visit)(ScamVal*)) {
+    for (size_t cls = 0; cls < NCLASSES; cls++) {
+        for (slab_t* slab = object_pools[cls].slabs; slab != NULL; slab = slab->next) {
+            char* end = (char*)slab + SLAB_SIZE - slab->cell_size;
+            for (char* p = (char*)(slab + 1); p <= end; p += slab->cell_size) {
+                ScamVal* v = (ScamVal*)p;
+                if (v->size_class != FREE_CELL) {
+                    visit(v);
                 }
-                break;
-            case SCAM_FUNCTION:
-                {
-                    ScamFunction* f = (ScamFunction*)v;
-                    gc_mark((ScamVal*)(f->parameters));
-                    gc_mark((ScamVal*)(f->body));
-                    gc_mark((ScamVal*)(f->env));
+            }
+        }
+    }
+    for (large_t* large = large_objects.next; large != &large_objects; ) {
+        large_t* next = large->next;
+        visit((ScamVal*)(large + 1));
+        large = next;
+    }
+}
+
+
+void* gc_alloc_block(size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+    size_t cls = size_class(size);
+    if (cls == LARGE_CLASS) {
+        gc_heap_grow(size);
+        return gc_malloc(size);
+    } else {
+        return pool_alloc(&block_pools[cls], cls);
+    }
+}
+
+
+void* gc_try_realloc_block(void* p, size_t old_size, size_t new_size) {
+    if (size_class(new_size) != LARGE_CLASS) {
+        /* A slab is smaller than the reserve, so giving it up always makes room for one. */
+        return gc_realloc_block(p, old_size, new_size);
+    }
+    bool large = p != NULL && size_class(old_size) == LARGE_CLASS;
+    void* ret = gc_try_realloc(large ? p : NULL, new_size);
+    if (ret == NULL) {
+        return NULL;
+    }
+    if (large) {
+        gc_heap_shrink(old_size);
+    } else if (p != NULL) {
+        memcpy(ret, p, old_size);
+        gc_free_block(p, old_size);
+    }
+    gc_heap_grow(new_size);
+    return ret;
+}
+
+
+void* gc_realloc_block(void* p, size_t old_size, size_t new_size) {
+    if (p == NULL) {
+        return gc_alloc_block(new_size);
+    }
+    size_t old_cls = size_class(old_size);
+    size_t new_cls = size_class(new_size);
+    if (old_cls == LARGE_CLASS && new_cls == LARGE_CLASS) {
+        gc_heap_shrink(old_size);
+        gc_heap_grow(new_size);
+        return gc_realloc(p, new_size);
+    } else if (old_cls == new_cls) {
+        return p;
+    } else {
+        void* ret = gc_alloc_block(new_size);
+        memcpy(ret, p, old_size < new_size ? old_size : new_size);
+        gc_free_block(p, old_size);
+        return ret;
+    }
+}
+
+
+void gc_free_block(void* p, size_t size) {
+    if (p != NULL) {
+        size_t cls = size_class(size);
+        if (cls == LARGE_CLASS) {
+            gc_heap_shrink(size);
+            free(p);
+        } else {
+            pool_free(&block_pools[cls], p);
+        }
+    }
+}
+
+
+/* Objects that have been reached but whose children have not been scanned yet. Marking works
+ * through this stack instead of recursing, so that deeply nested objects can't overflow the C stack.
+ */
+static ScamVal** mark_stack = NULL;
+static size_t mark_count = 0;
+static size_t mark_size = 0;
+
+/* The grey objects of an incremental major collection are put aside here during a minor one. */
+static ScamVal** grey_stack = NULL;
+static size_t grey_count = 0;
+static size_t grey_size = 0;
+
+
+/* Push an object reached by marking onto the mark stack. Whether it has been marked already is only
+ * checked when it is popped, so that its header can be prefetched in the meantime.
+ */
+static void gc_mark(ScamVal* v) {
+    if (v == NULL || ScamVal_is_immediate(v) || (skip_young && !v->old)) {
+        return;
+    }
+    if (mark_count == mark_size) {
+        mark_size = mark_size ? mark_size * HEAP_GROW : HEAP_INIT;
+        /* Not gc_realloc, which would start another collection if memory ran out. */
+        ScamVal** new_stack;
+        for (int attempt = 0;
+             (new_stack = realloc(mark_stack, mark_size * sizeof *mark_stack)) == NULL; attempt++) {
+            if (!gc_make_room(attempt, false)) {
+                gc_out_of_memory();
+            }
+        }
+        mark_stack = new_stack;
+    }
+    __builtin_prefetch(v);
+    mark_stack[mark_count++] = v;
+}
+
+
+/* Push all objects which the given object refers to onto the mark stack. */
+static void gc_mark_children(ScamVal* v) {
+    switch (ScamVal_type(v)) {
+        case SCAM_LIST:
+        case SCAM_SEXPR:
+            for (size_t i = 0; i < ScamSeq_len((ScamSeq*)v); i++) {
+                gc_mark(ScamSeq_get((ScamSeq*)v, i));
+            }
+            break;
+        case SCAM_FUNCTION:
+            {
+                ScamFunction* f = (ScamFunction*)v;
+                gc_mark((ScamVal*)(f->parameters));
+                gc_mark((ScamVal*)(f->body));
+                gc_mark((ScamVal*)(f->env));
+                gc_mark((ScamVal*)(f->name));
+                gc_mark((ScamVal*)(f->code));
+            }
+            break;
+        case SCAM_CODE:
+            gc_mark((ScamVal*)(((ScamCode*)v)->constants));
+            gc_mark((ScamVal*)(((ScamCode*)v)->slot_names));
+            break;
+        case SCAM_DICT:
+            /* The entries in insertion order are only copies of those in the trie. */
+            gc_mark((ScamVal*)(((ScamDict*)v)->trie));
+            break;
+        case SCAM_TRIE:
+            {
+                ScamTrie* node = (ScamTrie*)v;
+                for (unsigned int i = 0; i < node->count; i++) {
+                    gc_mark(node->slots[i].key);
+                    gc_mark(node->slots[i].val);
                 }
-                break;
-            case SCAM_ENV:
-            case SCAM_DICT:
-                {
-                    ScamDict* dct = (ScamDict*)v;
-                    for (size_t i = 0; i < SCAM_DICT_SIZE; i++) {
-                        for (ScamDict_list* p = dct->data[i]; p != NULL; p = p->next) {
-                            gc_mark(p->key);
-                            gc_mark(p->val);
-                        }
-                    }
-                    if (v->type == SCAM_ENV) {
-                        gc_mark((ScamVal*)(((ScamEnv*)v)->enclosing));
-                    }
+            }
+            break;
+        case SCAM_ENV:
+            {
+                ScamEnv* env = (ScamEnv*)v;
+                gc_mark((ScamVal*)(env->names));
+                for (size_t i = 0; i < env->nslots; i++) {
+                    gc_mark(env->slots[i]);
                 }
-                break;
-            default:
-                break;
+                gc_mark((ScamVal*)(env->slot_names));
+                gc_mark((ScamVal*)(env->enclosing));
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+
+/* Pop objects from the mark stack until it is empty or budget objects have been popped, and return
+ * whether it is empty. A minor collection stops at old objects, since any young object that they
+ * refer to is in the remembered set.
+ */
+static bool gc_mark_some(size_t budget) {
+    for (; mark_count > 0 && budget > 0; budget--) {
+        ScamVal* v = mark_stack[--mark_count];
+        if (!v->permanent && !(minor && v->old) && !gc_test_and_mark(v)) {
+            marked_count++;
+            marked_bytes += gc_sizeof(v);
+            gc_mark_children(v);
         }
     }
+    return mark_count == 0;
+}
+
+
+/* Mark every object that can be reached from the objects on the mark stack. */
+static void gc_mark_all(void) {
+    gc_mark_some(SIZE_MAX);
 }
 
 
 static void gc_del_ScamVal(ScamVal* v) {
-    switch (v->type) {
+    switch (ScamVal_type(v)) {
         case SCAM_LIST:
         case SCAM_SEXPR:
-            free(((ScamSeq*)v)->arr);
+            ScamSeq_free((ScamSeq*)v);
+            break;
+        case SCAM_CODE:
+            free(((ScamCode*)v)->arr);
             break;
-        case SCAM_ERR:
         case SCAM_SYM:
+            ScamSym_free((ScamStr*)v);
+            break;
+        case SCAM_ERR:
         case SCAM_STR:
-            free(((ScamStr*)v)->s);
+            ScamStr_free((ScamStr*)v);
             break;
         case SCAM_PORT:
-            if (ScamPort_status((ScamPort*)v) == SCAMPORT_OPEN)
-                fclose(ScamPort_unbox((ScamPort*)v));
+        {
+            /* The standard streams outlive the environments that have ports for them. */
+            FILE* fp = ScamPort_unbox((ScamPort*)v);
+            if (ScamPort_status((ScamPort*)v) == SCAMPORT_OPEN && fp != stdin && fp != stdout &&
+                fp != stderr)
+                fclose(fp);
             break;
-        case SCAM_ENV:
+        }
         case SCAM_DICT:
-            for (size_t i = 0; i < SCAM_DICT_SIZE; i++) {
-                ScamDict_list_free(((ScamDict*)v)->data[i]);
-            }
+            ScamDict_free_table((ScamDict*)v);
+            break;
+        case SCAM_TRIE:
+            ScamTrie_free((ScamTrie*)v);
+            break;
+        case SCAM_ENV:
+            gc_free_block(((ScamEnv*)v)->slots, ((ScamEnv*)v)->nslots * sizeof(ScamVal*));
             break;
         default:
             break;
     }
-    free(v);
+    gc_free_object(v);
+}
+
+
+/* Return whether the object is in a slab that is waiting to be swept. */
+static bool gc_is_unswept(const ScamVal* v) {
+    return v->size_class != LARGE_CLASS && slab_of(v)->unswept;
 }
 
 
-/* Sweep the entire heap, freeing items that have not been marked and resetting the marks on those
- * that have.
+/* Free the young objects that have not been marked and promote the rest, which empties the
+ * nursery. A survivor in a slab that is waiting to be swept keeps its mark, so that the sweep
+ * doesn't mistake it for an old object that died in the last major collection. During incremental
+ * marking, survivors go on the mark stack, since they may refer to old objects that nothing else
+ * does any more. The size of the nursery is then adjusted to the proportion that survived.
+ */
+static void gc_sweep_nursery(void) {
+    size_t promoted = 0;
+    for (size_t i = 0; i < nursery_count; i++) {
+        ScamVal* v = nursery[i];
+        if (!gc_is_marked(v)) {
+            gc_del_ScamVal(v);
+        } else {
+            if (!gc_is_unswept(v)) {
+                gc_set_marked(v, false);
+            }
+            v->old = true;
+            old_count++;
+            old_bytes += gc_sizeof(v);
+            promoted++;
+            if (marking) {
+                gc_mark(v);
+            }
+        }
+    }
+    if (promoted * 4 > nursery_count && nursery_limit < NURSERY_MAX) {
+        nursery_limit *= 2;
+    } else if (promoted * 16 < nursery_count && nursery_limit > NURSERY_SIZE) {
+        nursery_limit /= 2;
+    }
+    nursery_count = 0;
+}
+
+
+/* Finish a major collection without sweeping the slabs, which is left to pool_alloc. The nursery
+ * and the large objects are swept straight away, since there are comparatively few of them, which
+ * leaves only old objects to the lazy sweep.
  */
 static void gc_sweep(void) {
-    for (size_t i = 0; i < count; i++) {
-        ScamVal* v = scamval_objs[i];
-        if (v != NULL) {
-            if (!v->seen) {
-                gc_del_ScamVal(v);
-                scamval_objs[i] = NULL;
-                if (i < first_avail) {
-                    first_avail = i;
-                }
-            } else {
-                v->seen = false;
+    for (size_t i = 0; i < nursery_count; i++) {
+        if (gc_is_marked(nursery[i])) {
+            nursery[i]->old = true;
+        } else {
+            gc_del_ScamVal(nursery[i]);
+        }
+    }
+    nursery_count = 0;
+    for (large_t* large = large_objects.next; large != &large_objects; ) {
+        large_t* next = large->next;
+        if (!large->marked) {
+            gc_del_ScamVal((ScamVal*)(large + 1));
+        } else {
+            large->marked = false;
+        }
+        large = next;
+    }
+    for (size_t cls = 0; cls < NCLASSES; cls++) {
+        pool_t* pool = &object_pools[cls];
+        pool->unswept = pool->slabs;
+        for (slab_t* slab = pool->slabs; slab != NULL; slab = slab->next) {
+            slab->unswept = true;
+            unswept_count++;
+        }
+    }
+}
+
+
+/* Empty the remembered set. This is done by every collection, after which there are no young
+ * objects left for an old object to refer to.
+ */
+static void gc_forget(void) {
+    for (size_t i = 0; i < remembered_count; i++) {
+        remembered[i]->remembered = false;
+    }
+    remembered_count = 0;
+}
+
+
+static void gc_swap_mark_stacks(void) {
+    ScamVal** stack = mark_stack;
+    size_t count = mark_count;
+    size_t size = mark_size;
+    mark_stack = grey_stack;
+    mark_count = grey_count;
+    mark_size = grey_size;
+    grey_stack = stack;
+    grey_count = count;
+    grey_size = size;
+}
+
+
+/* Mark the roots and every value on the stacks. */
+static void gc_mark_roots(void) {
+    for (size_t i = 0; i < roots_count; i++) {
+        gc_mark(roots[i]);
+    }
+    for (size_t i = 0; i < stacks_count; i++) {
+        ScamVal** arr = *stacks[i].arr;
+        for (size_t j = 0; j < *stacks[i].count; j++) {
+            gc_mark(arr[j]);
+        }
+    }
+}
+
+
+/* Collect the nursery only. Its roots are the young objects marked as roots and the young objects
+ * that old objects have been changed to refer to, so the time taken depends only on the number of
+ * young objects and not on the size of the whole heap.
+ */
+static void gc_collect_minor(void) {
+    stats.minor_collections++;
+    if (marking) {
+        gc_swap_mark_stacks();
+        skip_young = false;
+    }
+    minor = true;
+    gc_mark_roots();
+    for (size_t i = 0; i < remembered_count; i++) {
+        gc_mark_children(remembered[i]);
+    }
+    gc_mark_all();
+    minor = false;
+    gc_forget();
+    if (marking) {
+        gc_swap_mark_stacks();
+        skip_young = true;
+    }
+    gc_sweep_nursery();
+}
+
+
+/* A major collection only marks: the slabs are swept lazily. The previous collection's sweep has to
+ * be finished first, since the marks that are left in unswept slabs are still needed.
+ */
+static void gc_start_major(void) {
+    gc_finish_sweep();
+    marked_count = 0;
+    marked_bytes = 0;
+    gc_mark_roots();
+}
+
+
+/* Set the threshold for the next major collection from the size of the live objects, and check
+ * them against the heap limit.
+ */
+static void gc_finish_major(void) {
+    stats.major_collections++;
+    old_count = marked_count;
+    old_bytes = marked_bytes;
+    gc_forget();
+    gc_sweep();
+    major_threshold = old_bytes / LIVE_PERCENT * 100;
+    if (major_threshold < HEAP_INIT_BYTES) {
+        major_threshold = HEAP_INIT_BYTES;
+    }
+    if (heap_limit > 0 && major_threshold > heap_limit) {
+        major_threshold = heap_limit;
+    }
+    if (reserve == NULL) {
+        reserve = malloc(RESERVE_SIZE);
+    }
+    heap_exhausted = reserve == NULL || (heap_limit > 0 && old_bytes > heap_limit);
+}
+
+
+static void gc_collect_major(void) {
+    gc_start_major();
+    gc_mark_all();
+    gc_finish_major();
+}
+
+
+static void gc_start_marking(void) {
+    marking = true;
+    skip_young = true;
+    gc_start_major();
+    slice_countdown = SLICE_INTERVAL;
+}
+
+
+/* End an incremental major collection once the mark stack is empty. The roots are not covered by
+ * the write barrier, so they have to be marked again, and so do the young objects, along with the
+ * old objects that refer to them. This takes time in proportion to the roots and the nursery
+ * rather than the whole heap.
+ */
+static void gc_finish_marking(void) {
+    skip_young = false;
+    gc_mark_roots();
+    for (size_t i = 0; i < remembered_count; i++) {
+        gc_mark_children(remembered[i]);
+    }
+    gc_mark_all();
+    marking = false;
+    gc_finish_major();
+}
+
+
+static double gc_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void gc_record_pause(double start) {
+    double pause = gc_now() - start;
+    pause_count++;
+    pause_total += pause;
+    if (pause > pause_max) {
+        pause_max = pause;
+    }
+    stats.pauses++;
+    stats.pause_total += pause;
+    if (pause > stats.pause_max) {
+        stats.pause_max = pause;
+    }
+}
+
+
+static void gc_lock_heap(void) {
+    if (lock_depth++ == 0) {
+        __atomic_add_fetch(&lock_waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&heap_lock);
+        __atomic_sub_fetch(&lock_waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+
+/* Take the heap lock only if the marker thread doesn't have it, and return whether it was taken. */
+static bool gc_try_lock_heap(void) {
+    if (lock_depth == 0 && pthread_mutex_trylock(&heap_lock) != 0) {
+        return false;
+    }
+    lock_depth++;
+    return true;
+}
+
+
+/* Release the heap lock, waking the marker thread if the program has given it objects to mark. */
+static void gc_unlock_heap(void) {
+    if (--lock_depth == 0) {
+        if (marker_idle && marking && mark_count > 0) {
+            pthread_cond_signal(&marker_wakeup);
+        }
+        pthread_mutex_unlock(&heap_lock);
+    }
+}
+
+
+/* Bracket the collector's own work on the program's side, which the marker thread mustn't see half
+ * done.
+ */
+static void gc_enter(void) {
+    if (concurrent) {
+        gc_lock_heap();
+    }
+}
+
+
+static void gc_leave(void) {
+    if (concurrent) {
+        gc_unlock_heap();
+    }
+}
+
+
+void gc_lock(void) {
+    if (lock_depth > 0 || (concurrent && marking)) {
+        gc_lock_heap();
+    }
+}
+
+
+void gc_unlock(void) {
+    if (lock_depth > 0) {
+        gc_unlock_heap();
+    }
+}
+
+
+static void* gc_marker_main(void* arg) {
+    (void)arg;
+    /* Leave signals, such as the profiler's, to the program's own thread. */
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_mutex_lock(&heap_lock);
+    while (!marker_exit) {
+        if (marking && mark_count > 0) {
+            gc_mark_some(MARK_BATCH);
+            pthread_mutex_unlock(&heap_lock);
+            while (__atomic_load_n(&lock_waiters, __ATOMIC_SEQ_CST) > 0) {
+                sched_yield();
             }
+            pthread_mutex_lock(&heap_lock);
+        } else {
+            marker_idle = true;
+            pthread_cond_wait(&marker_wakeup, &heap_lock);
+            marker_idle = false;
         }
     }
+    pthread_mutex_unlock(&heap_lock);
+    return NULL;
 }
 
 
 void gc_collect(void) {
-    for (size_t i = 0; i < count; i++) {
-        ScamVal* v = scamval_objs[i];
-        if (v != NULL && !v->seen && v->is_root) {
-            gc_mark(v);
+    double start = gc_now();
+    gc_enter();
+    if (marking) {
+        gc_finish_marking();
+    }
+    gc_collect_major();
+    gc_leave();
+    gc_record_pause(start);
+}
+
+
+void gc_set_mark_budget(size_t budget) {
+    gc_enter();
+    if (budget == 0 && !concurrent && marking) {
+        gc_finish_marking();
+    }
+    mark_budget = budget;
+    gc_leave();
+}
+
+
+void gc_set_concurrent(bool on) {
+    if (on == concurrent) {
+        return;
+    }
+    if (on) {
+        marker_exit = false;
+        if (pthread_create(&marker, NULL, gc_marker_main, NULL) != 0) {
+            return;
+        }
+        concurrent = true;
+    } else {
+        gc_lock_heap();
+        if (marking && mark_budget == 0) {
+            gc_finish_marking();
         }
+        marker_exit = true;
+        pthread_cond_signal(&marker_wakeup);
+        gc_unlock_heap();
+        pthread_join(marker, NULL);
+        concurrent = false;
     }
-    gc_sweep();
+}
+
+
+void gc_set_heap_limit(size_t limit) {
+    heap_limit = limit;
+    if (limit > 0 && major_threshold > limit) {
+        major_threshold = limit;
+    }
+    if (limit == 0) {
+        heap_exhausted = reserve == NULL;
+    }
+}
+
+
+bool gc_heap_exhausted(void) {
+    return heap_exhausted;
+}
+
+
+const gc_stats_t* gc_get_stats(void) {
+    stats.live_bytes = old_bytes;
+    return &stats;
+}
+
+
+void gc_print_stats(FILE* fp) {
+    gc_get_stats();
+    fprintf(fp, "%zu minor and %zu major collections\n", stats.minor_collections,
+            stats.major_collections);
+    fprintf(fp, "%zu pauses, longest %.3f ms, %.3f ms in total\n", stats.pauses,
+            stats.pause_max * 1000, stats.pause_total * 1000);
+    fprintf(fp, "heap: %zu bytes, at most %zu; old generation: %zu bytes\n", stats.heap_bytes,
+            stats.heap_peak, stats.live_bytes);
+    fprintf(fp, "%-16s %12s %14s %12s %14s\n", "type", "allocated", "bytes", "freed", "bytes");
+    for (size_t type = 0; type < GC_NTYPES; type++) {
+        if (stats.allocated[type] > 0) {
+            fprintf(fp, "%-16s %12zu %14zu %12zu %14zu\n", scamtype_name(type),
+                    stats.allocated[type], stats.allocated_bytes[type], stats.freed[type],
+                    stats.freed_bytes[type]);
+        }
+    }
+}
+
+
+void gc_report_pauses(FILE* fp) {
+    fprintf(fp, "%zu collector pauses, longest %.3f ms, %.3f ms in total\n", pause_count,
+            pause_max * 1000, pause_total * 1000);
+    pause_count = 0;
+    pause_max = 0.0;
+    pause_total = 0.0;
+}
+
+
+/* Return whether the object is managed by the collector. */
+static bool gc_is_managed(const ScamVal* v) {
+    return !ScamVal_is_immediate(v) && !v->permanent;
 }
 
 
 void gc_unset_root(ScamVal* v) {
-    v->is_root = false;
+    if (gc_is_managed(v) && v->root != 0) {
+        ScamVal* last = roots[--roots_count];
+        roots[v->root - 1] = last;
+        last->root = v->root;
+        v->root = 0;
+    }
+}
+
+
+/* The symbol table refers to symbols weakly, so an unreachable symbol can be looked up again before
+ * its slab is swept. Marking it keeps the sweep from freeing it.
+ */
+static void gc_revive(ScamVal* v) {
+    if (v->old && gc_is_unswept(v) && !gc_is_marked(v)) {
+        gc_set_marked(v, true);
+        old_count++;
+        old_bytes += gc_sizeof(v);
+    }
 }
 
 
 void gc_set_root(ScamVal* v) {
-    v->is_root = true;
+    if (unswept_count > 0 && gc_is_managed(v) && v->type == SCAM_SYM) {
+        gc_revive(v);
+    }
+    if (gc_is_managed(v) && v->root == 0) {
+        if (roots_count == roots_size) {
+            roots_size = roots_size ? roots_size * HEAP_GROW : HEAP_INIT;
+            roots = gc_realloc(roots, roots_size * sizeof *roots);
+        }
+        roots[roots_count++] = v;
+        v->root = roots_count;
+    }
+}
+
+
+void gc_add_stack(ScamVal*** arr, size_t* count) {
+    stacks = gc_realloc(stacks, (stacks_count + 1) * sizeof *stacks);
+    stacks[stacks_count++] = (gc_stack_t){ arr, count };
+}
+
+
+bool gc_is_root(const ScamVal* v) {
+    return gc_is_managed(v) && v->root != 0;
+}
+
+
+size_t gc_root_count(void) {
+    return roots_count;
+}
+
+
+void gc_report_roots(size_t n, const ScamVal* ret) {
+    for (size_t i = n; i < roots_count; i++) {
+        if (roots[i] != ret) {
+            char* repr = ScamVal_to_repr(roots[i]);
+            fprintf(stderr, "leaked root: %s (%s)\n", repr, scamtype_debug_name(ScamVal_type(roots[i])));
+            free(repr);
+        }
+    }
+}
+
+
+void gc_write_barrier(ScamVal* obj, ScamVal* v) {
+    if (v == NULL || ScamVal_is_immediate(v)) {
+        return;
+    }
+    /* An object that has been marked must not be left referring to one that hasn't. */
+    if (marking) {
+        gc_lock();
+        if (gc_is_marked(obj)) {
+            gc_mark(v);
+        }
+        gc_unlock();
+    }
+    if (obj->old && !obj->remembered && !v->old) {
+        if (remembered_count == remembered_size) {
+            remembered_size = remembered_size ? remembered_size * HEAP_GROW : HEAP_INIT;
+            remembered = gc_realloc(remembered, remembered_size * sizeof *remembered);
+        }
+        obj->remembered = true;
+        remembered[remembered_count++] = obj;
+    }
 }
 
 
 ScamVal* gc_new_ScamVal(int type, size_t sz) {
-    if (scamval_objs == NULL) {
+    if (nursery == NULL) {
         /* Initialize internal heap for the first time. */
         gc_init();
-    } else if (first_avail == count) {
-        gc_collect();
-        if (first_avail == count) {
-            /* Grow internal heap. */
-            size_t new_count = count * HEAP_GROW;
-            scamval_objs = gc_realloc(scamval_objs, new_count*sizeof *scamval_objs);
-            for (size_t i = count; i < new_count; i++) {
-                scamval_objs[i] = NULL;
+    } else if (nursery_count >= nursery_limit) {
+        double start = gc_now();
+        gc_enter();
+        gc_collect_minor();
+        if (!marking && old_bytes > major_threshold) {
+            if (mark_budget > 0 || concurrent) {
+                gc_start_marking();
+            } else {
+                gc_collect_major();
             }
-            count = new_count;
         }
+        gc_leave();
+        gc_record_pause(start);
     }
-    ScamVal* ret = gc_malloc(sz);
+    if (marking && --slice_countdown == 0) {
+        double start = gc_now();
+        slice_countdown = SLICE_INTERVAL;
+        if (!concurrent) {
+            if (gc_mark_some(mark_budget)) {
+                gc_finish_marking();
+            }
+            gc_record_pause(start);
+        } else if (gc_try_lock_heap()) {
+            /* The marker thread does the marking, so only look in on it when it isn't busy. */
+            if (mark_count == 0) {
+                gc_finish_marking();
+                gc_record_pause(start);
+            }
+            gc_unlock_heap();
+        }
+    }
+    ScamVal* ret = gc_alloc_object(sz);
     ret->type = type;
-    ret->seen = false;
-    ret->is_root = true;
-    scamval_objs[first_avail] = ret;
-    /* Update first_avail to be the first available heap location. */
-    while (++first_avail < count && scamval_objs[first_avail] != NULL)
-        ;
+    stats.allocated[type]++;
+    stats.allocated_bytes[type] += gc_cell_size(ret);
+    ret->old = false;
+    ret->remembered = false;
+    ret->permanent = false;
+    ret->root = 0;
+    ret->owned = false;
+    nursery[nursery_count++] = ret;
+    gc_set_root(ret);
+    prof_allocation(gc_cell_size(ret));
     return ret;
 }
 
 
 ScamVal* gc_copy_ScamVal(ScamVal* v) {
-    switch (v->type) {
+    switch (ScamVal_type(v)) {
         case SCAM_LIST:
         case SCAM_SEXPR:
-        {
-            ScamSeq* seq = (ScamSeq*)v;
-            SCAMVAL_NEW(ret, ScamSeq, seq->type);
-            ret->arr = gc_malloc(seq->count * sizeof *seq->arr);
-            ret->count = 0;
-            ret->mem_size = seq->count;
-            for (size_t i = 0; i < seq->count; i++) {
-                ret->arr[i] = gc_copy_ScamVal(seq->arr[i]);
-                gc_unset_root(ret->arr[i]);
-                /* count must always contain an accurate count of the allocated elements of the
-                 * list, in case the garbage collector is invoked in the middle of copying and needs
-                 * to mark the elements of this list.
-                 */
-                ret->count++;
-            }
-            return (ScamVal*)ret;
-        }
+            return (ScamVal*)ScamSeq_copy((ScamSeq*)v);
         case SCAM_STR:
-            return (ScamVal*)ScamStr_new(ScamStr_unbox((ScamStr*)v));
+        case SCAM_ERR:
+            return (ScamVal*)ScamStr_copy((ScamStr*)v);
         case SCAM_SYM:
             return (ScamVal*)ScamSym_new(ScamStr_unbox((ScamStr*)v));
-        case SCAM_ERR:
-            return (ScamVal*)ScamErr_new(ScamStr_unbox((ScamStr*)v));
         case SCAM_DICT:
-        {
-            ScamDict* dct = (ScamDict*)v;
-            ScamDict* ret = ScamDict_new();
-            for (size_t i = 0; i < SCAM_DICT_SIZE; i++) {
-                for (ScamDict_list* p = dct->data[i]; p != NULL; p = p->next) {
-                    ScamDict_insert(ret, p->key, p->val);
-                }
-            }
-            return (ScamVal*)ret;
-        }
+            return (ScamVal*)ScamDict_copy((ScamDict*)v);
         case SCAM_ENV:
         {
             ScamEnv* env = (ScamEnv*)v;
-            ScamEnv* ret = ScamEnv_new(ScamEnv_enclosing(env));
-            for (size_t i = 0; i < SCAM_DICT_SIZE; i++) {
-                for (ScamDict_list* p = env->data[i]; p != NULL; p = p->next) {
-                    ScamDict_insert((ScamDict*)ret, p->key, p->val);
+            ScamEnv* ret;
+            if (env->slot_names != NULL) {
+                ret = ScamEnv_frame(ScamEnv_enclosing(env), env->slot_names);
+                for (size_t i = 0; i < env->nslots; i++) {
+                    ret->slots[i] = env->slots[i];
+                }
+            } else {
+                ret = ScamEnv_new(ScamEnv_enclosing(env));
+            }
+            if (env->names != NULL) {
+                for (size_t i = 0; i < ScamDict_len(env->names); i++) {
+                    ScamEnv_insert(ret, (ScamStr*)ScamDict_key(env->names, i),
+                                   ScamDict_val(env->names, i));
                 }
             }
             return (ScamVal*)ret;
         }
         default:
-            v->is_root = true;
+            gc_set_root(v);
             return v;
     }
 }
 
 
-void gc_close(void) {
-    for (size_t i = 0; i < count; i++) {
-        ScamVal* v = scamval_objs[i];
-        if (v != NULL) {
-            gc_del_ScamVal(v);
+static void gc_free_slabs(pool_t* pools) {
+    for (size_t cls = 0; cls < NCLASSES; cls++) {
+        for (slab_t* slab = pools[cls].slabs; slab != NULL; ) {
+            slab_t* next = slab->next;
+            gc_heap_shrink(SLAB_SIZE);
+            free(slab);
+            slab = next;
         }
+        pools[cls].slabs = NULL;
+        pools[cls].unswept = NULL;
+        pools[cls].free_list = NULL;
     }
-    free(scamval_objs);
 }
 
 
-void gc_print(void) {
-    printf("Allocated space for %ld references\n", count);
-    for (size_t i = 0; i < count; i++) {
-        ScamVal* v = scamval_objs[i];
-        if (v != NULL) {
-            printf("%.4ld: ", i);
-            ScamVal_print_debug(v);
-            if (v->is_root)
-                printf(" (root)");
-            printf("\n");
-        }
-    }
-}
-
-
-static size_t first_interesting_index(void) {
-    /* The first 3 refs are for the global environment. */
-    int reached_the_builtin_ports = 0;
-    for (size_t i = 3; i < count; i++) {
-        ScamVal* v = scamval_objs[i];
-        if (v == NULL) {
-            return i;
-        }
-        /* Even indices should be builtins. */
-        if (i % 2 == 0) {
-            if (v->type != SCAM_SYM) {
-                return i;
-            } else if (reached_the_builtin_ports) {
-                if (strcmp(ScamStr_unbox((ScamStr*)v), "stdout") != 0 &&
-                    strcmp(ScamStr_unbox((ScamStr*)v), "stdin")  != 0 &&
-                    strcmp(ScamStr_unbox((ScamStr*)v), "stderr") != 0) {
-                    return i - 1;
-                }
-            }
-        /* Odd indices should be symbols. */
-        } else {
-            if (v->type == SCAM_PORT) {
-                reached_the_builtin_ports = 1;
-            } else if (v->type != SCAM_BUILTIN) {
-                return i;
-            }
-        }
+void gc_close(void) {
+    gc_set_concurrent(false);
+    gc_walk(gc_del_ScamVal);
+    gc_free_slabs(object_pools);
+    gc_free_slabs(block_pools);
+    unswept_count = 0;
+    free(nursery);
+    free(remembered);
+    free(roots);
+    free(stacks);
+    free(mark_stack);
+    free(grey_stack);
+    free(reserve);
+    reserve = NULL;
+}
+
+
+static size_t print_count = 0;
+
+static void gc_print_object(ScamVal* v) {
+    printf("%.4ld: ", print_count++);
+    ScamVal_print_debug(v);
+    if (v->root != 0)
+        printf(" (root)");
+    if (!v->old)
+        printf(" (young)");
+    printf("\n");
+}
+
+
+static void gc_print_interesting_object(ScamVal* v) {
+    if (ScamVal_type(v) != SCAM_BUILTIN && ScamVal_type(v) != SCAM_SYM) {
+        gc_print_object(v);
+    } else {
+        print_count++;
     }
-    return count;
+}
+
+
+void gc_print(void) {
+    gc_finish_sweep();
+    printf("%ld objects in the old generation and %ld in the nursery\n", old_count, nursery_count);
+    print_count = 0;
+    gc_walk(gc_print_object);
 }
 
 
 void gc_smart_print(void) {
-    printf("Allocated space for %ld references\n", count);
-    for (size_t i = first_interesting_index(); i < count; i++) {
-        ScamVal* v = scamval_objs[i];
-        if (v != NULL) {
-            printf("%.4ld: ", i);
-            ScamVal_print_debug(v);
-            if (v->is_root)
-                printf(" (root)");
-            printf("\n");
-        }
+    gc_finish_sweep();
+    printf("%ld objects in the old generation and %ld in the nursery\n", old_count, nursery_count);
+    print_count = 0;
+    gc_walk(gc_print_interesting_object);
+}
+
+
+/* Make room after malloc has refused a request, and return whether it is worth trying again. The
+ * first attempt collects, unless the collector is the one asking or has already run out, and the
+ * next gives up the reserve, which makes the evaluators fail with an out of memory error until a
+ * major collection takes it back. The reserve is claimed atomically, since the marker thread may
+ * need it for its mark stack.
+ */
+static bool gc_make_room(int attempt, bool can_collect) {
+    if (attempt == 0 && can_collect && !heap_exhausted) {
+        gc_collect();
+        return true;
     }
+    void* r = __atomic_exchange_n(&reserve, NULL, __ATOMIC_SEQ_CST);
+    heap_exhausted = true;
+    if (r == NULL) {
+        return false;
+    }
+    free(r);
+    return true;
+}
+
+
+/* The reserve is already gone, so there is nothing left to unwind the program with. */
+static void gc_out_of_memory(void) {
+    fputs("out of memory... exiting program\n", stderr);
+    exit(EXIT_FAILURE);
 }
 
 
 void* gc_malloc(size_t size) {
-    void* ret = malloc(size);
-    if (ret == NULL) {
-        gc_collect();
-        ret = malloc(size);
-        if (ret == NULL) {
-            fputs("out of memory... exiting program\n", stderr);
-            exit(EXIT_FAILURE);
+    void* ret;
+    for (int attempt = 0; (ret = malloc(size)) == NULL; attempt++) {
+        if (!gc_make_room(attempt, true)) {
+            gc_out_of_memory();
         }
     }
     return ret;
@@ -298,13 +1342,10 @@ void* gc_malloc(size_t size) {
 
 
 void* gc_realloc(void* ptr, size_t size) {
-    void* ret = realloc(ptr, size);
-    if (ret == NULL) {
-        gc_collect();
-        ret = realloc(ptr, size);
-        if (ret == NULL) {
-            fputs("out of memory... exiting program\n", stderr);
-            exit(EXIT_FAILURE);
+    void* ret;
+    for (int attempt = 0; (ret = realloc(ptr, size)) == NULL; attempt++) {
+        if (!gc_make_room(attempt, true)) {
+            gc_out_of_memory();
         }
     }
     return ret;
@@ -312,13 +1353,21 @@ void* gc_realloc(void* ptr, size_t size) {
 
 
 void* gc_calloc(size_t num, size_t size) {
-    void* ret = calloc(num, size);
-    if (ret == NULL) {
-        gc_collect();
-        ret = calloc(num, size);
-        if (ret == NULL) {
-            fputs("out of memory... exiting program\n", stderr);
-            exit(EXIT_FAILURE);
+    void* ret;
+    for (int attempt = 0; (ret = calloc(num, size)) == NULL; attempt++) {
+        if (!gc_make_room(attempt, true)) {
+            gc_out_of_memory();
+        }
+    }
+    return ret;
+}
+
+
+void* gc_try_realloc(void* ptr, size_t size) {
+    void* ret;
+    for (int attempt = 0; (ret = realloc(ptr, size)) == NULL; attempt++) {
+        if (!gc_make_room(attempt, true)) {
+            return NULL;
         }
     }
     return ret;
@@ -326,9 +1375,11 @@ void* gc_calloc(size_t num, size_t size) {
 
 
 static void gc_init() {
-    count = HEAP_INIT;
-    scamval_objs = gc_malloc(count * sizeof *scamval_objs);
-    for (size_t i = 0; i < count; i++) {
-        scamval_objs[i] = NULL;
+    major_threshold = HEAP_INIT_BYTES;
+    if (heap_limit > 0 && major_threshold > heap_limit) {
+        major_threshold = heap_limit;
     }
+    nursery_limit = NURSERY_SIZE;
+    nursery = gc_malloc(NURSERY_MAX * sizeof *nursery);
+    reserve = malloc(RESERVE_SIZE);
 }
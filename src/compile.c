@@ -1,55 +1,455 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "collector.h"
+#include "compile.h"
 #include "scamval.h"
 
 
-typedef enum { CODE_ADD } bytecode_t;
+/* The compiler's view of the function being compiled. The scopes of the enclosing functions are
+ * kept so that variables can be resolved to the frame and slot they will occupy at runtime.
+ */
+typedef struct scope_rec {
+    ScamCode* code;
+    bool* captured; /* For each slot, whether a nested lambda expression refers to it. */
+    struct scope_rec* enclosing;
+} scope_t;
 
 
-typedef struct {
-    bytecode_t inst;
-    ScamVal* arg1, *arg2;
-} codeobj;
+/* The tail argument says whether the expression is in tail position, i.e. whether its value is
+ * returned by the enclosing function as is.
+ */
+static void compile(scope_t*, ScamVal*, bool tail);
+static void compile_symbol(scope_t*, ScamStr*);
+static void compile_define(scope_t*, ScamSeq*);
+static void compile_if(scope_t*, ScamSeq*, bool tail);
+static void compile_lambda(scope_t*, ScamSeq*);
+static void compile_and_or(scope_t*, ScamSeq*, bytecode_t, bool tail);
+static void compile_begin(scope_t*, ScamSeq*, bool tail);
+static void compile_call(scope_t*, ScamSeq*, bool tail);
+static void compile_elements(scope_t*, ScamSeq*, bytecode_t);
+static void mark_moves(scope_t*);
 
 
-char* codeobj_to_str(const codeobj*);
+static ScamCode* ScamCode_new(void) {
+    SCAMVAL_NEW(ret, ScamCode, SCAM_CODE);
+    ret->count = 0;
+    ret->mem_size = 0;
+    ret->arr = NULL;
+    /* constants must be valid before the next allocation, in case it invokes the collector. */
+    ret->constants = NULL;
+    ret->slot_names = NULL;
+    ScamSeq* constants = ScamList_new();
+    gc_unset_root((ScamVal*)constants);
+    gc_lock();
+    ret->constants = constants;
+    gc_write_barrier((ScamVal*)ret, (ScamVal*)constants);
+    gc_unlock();
+    return ret;
+}
+
+
+enum { CODE_SIZE_INITIAL = 16, CODE_SIZE_GROW = 2 };
+/* Append an integer to the code array and return its index. */
+static size_t emit(ScamCode* code, int x) {
+    if (code->count == code->mem_size) {
+        code->mem_size = code->mem_size ? code->mem_size * CODE_SIZE_GROW : CODE_SIZE_INITIAL;
+        code->arr = gc_realloc(code->arr, code->mem_size * sizeof *code->arr);
+    }
+    code->arr[code->count] = x;
+    return code->count++;
+}
+
+
+/* Fill in the target of a jump emitted before the target was known. */
+static void patch(ScamCode* code, size_t operand_index) {
+    code->arr[operand_index] = code->count;
+}
+
+
+/* Add a value to the constant table and return its index. Symbols are only stored once. */
+static int add_constant(ScamCode* code, ScamVal* v) {
+    if (ScamVal_type(v) == SCAM_SYM) {
+        for (size_t i = 0; i < ScamSeq_len(code->constants); i++) {
+            ScamVal* c = ScamSeq_get(code->constants, i);
+            if (ScamVal_type(c) == SCAM_SYM && ScamVal_eq(c, v)) {
+                return i;
+            }
+        }
+    }
+    ScamSeq_append(code->constants, v);
+    return ScamSeq_len(code->constants) - 1;
+}
+
+
+/* Compile an error that will be returned when the code is run. */
+static void compile_error(ScamCode* code, ScamStr* err) {
+    emit(code, CODE_ERROR);
+    emit(code, add_constant(code, (ScamVal*)err));
+}
+
+
+/* Return the index of the slot for the symbol, or -1 if there is none. The search goes backwards
+ * so that when a parameter name is repeated, the last one wins, as it does in the tree walker.
+ */
+static int find_slot(const ScamSeq* slot_names, const ScamVal* sym) {
+    for (size_t i = ScamSeq_len(slot_names); i-- > 0; ) {
+        if (ScamVal_eq(ScamSeq_get(slot_names, i), sym)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/* Add a slot for every variable defined in the body of a function, except those defined inside
+ * nested lambda expressions, which get slots of their own.
+ */
+static void collect_defines(ScamSeq* slot_names, ScamVal* ast) {
+    if (ScamVal_type(ast) != SCAM_SEXPR || ScamSeq_len((ScamSeq*)ast) == 0) {
+        return;
+    }
+    ScamSeq* seq = (ScamSeq*)ast;
+    if (ScamVal_type(ScamSeq_get(seq, 0)) == SCAM_SYM) {
+        switch (ScamSym_keyword((ScamStr*)ScamSeq_get(seq, 0))) {
+            case KEYWORD_LAMBDA:
+                return;
+            case KEYWORD_DEFINE:
+                if (ScamSeq_len(seq) == 3 && ScamVal_type(ScamSeq_get(seq, 1)) == SCAM_SYM &&
+                    find_slot(slot_names, ScamSeq_get(seq, 1)) == -1) {
+                    ScamSeq_append(slot_names, ScamSeq_get(seq, 1));
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    for (size_t i = 0; i < ScamSeq_len(seq); i++) {
+        collect_defines(slot_names, ScamSeq_get(seq, i));
+    }
+}
+
+
+ScamCode* ScamVal_compile(ScamVal* ast) {
+    scope_t scope = { ScamCode_new(), NULL, NULL };
+    compile(&scope, ast, true);
+    emit(scope.code, CODE_RETURN);
+    return scope.code;
+}
+
+
+/* Compile the body of a function, whose frame has a slot for each parameter and local define. */
+static ScamCode* compile_function(scope_t* enclosing, ScamSeq* parameters, ScamVal* body) {
+    scope_t scope = { ScamCode_new(), NULL, enclosing };
+    ScamSeq* slot_names = ScamList_new();
+    for (size_t i = 0; i < ScamSeq_len(parameters); i++) {
+        ScamSeq_append(slot_names, ScamSeq_get(parameters, i));
+    }
+    collect_defines(slot_names, body);
+    gc_unset_root((ScamVal*)slot_names);
+    gc_lock();
+    scope.code->slot_names = slot_names;
+    gc_write_barrier((ScamVal*)scope.code, (ScamVal*)slot_names);
+    gc_unlock();
+    size_t nslots = ScamSeq_len(slot_names);
+    if (nslots > 0) {
+        scope.captured = gc_calloc(nslots, sizeof *scope.captured);
+    }
+    compile(&scope, body, true);
+    emit(scope.code, CODE_RETURN);
+    if (nslots > 0) {
+        mark_moves(&scope);
+        free(scope.captured);
+    }
+    return scope.code;
+}
+
+
+/* Add the slots that may be read at the given index to those in live. */
+static void merge_live(bool* live, const bool* live_at, size_t nslots) {
+    for (size_t s = 0; s < nslots; s++) {
+        live[s] = live[s] || live_at[s];
+    }
+}
+
+
+/* Turn the last read of each slot on every path through the function into a CODE_MOVE. Jumps only
+ * go forwards, so the slots that may still be read after each instruction can be worked out in one
+ * pass backwards over the code. A slot that a nested lambda expression refers to can be read
+ * whenever the closure is called, so it is never moved.
+ */
+static void mark_moves(scope_t* scope) {
+    ScamCode* code = scope->code;
+    size_t nslots = ScamSeq_len(code->slot_names);
+    /* Row i holds the slots that may be read at or after index i of the code. */
+    bool* live = gc_calloc((code->count + 1) * nslots, sizeof *live);
+    size_t* starts = gc_malloc(code->count * sizeof *starts);
+    size_t ninsts = 0;
+    for (size_t i = 0; i < code->count; i += bytecode_nargs(code->arr[i]) + 1) {
+        starts[ninsts++] = i;
+    }
+    while (ninsts-- > 0) {
+        size_t i = starts[ninsts];
+        int* inst = &code->arr[i];
+        bool* live_here = &live[i * nslots];
+        size_t next = i + bytecode_nargs(inst[0]) + 1;
+        switch (inst[0]) {
+            case CODE_RETURN:
+            case CODE_ERROR:
+                break;
+            case CODE_JUMP:
+                merge_live(live_here, &live[inst[1] * nslots], nslots);
+                break;
+            case CODE_JUMP_IF_FALSE:
+                merge_live(live_here, &live[next * nslots], nslots);
+                merge_live(live_here, &live[inst[1] * nslots], nslots);
+                break;
+            case CODE_AND:
+            case CODE_OR:
+                merge_live(live_here, &live[next * nslots], nslots);
+                merge_live(live_here, &live[inst[2] * nslots], nslots);
+                break;
+            default:
+                merge_live(live_here, &live[next * nslots], nslots);
+                break;
+        }
+        if (inst[0] == CODE_LOCAL && inst[1] == 0) {
+            if (!live_here[inst[2]] && !scope->captured[inst[2]]) {
+                inst[0] = CODE_MOVE;
+            }
+            live_here[inst[2]] = true;
+        } else if (inst[0] == CODE_DEFINE_LOCAL) {
+            live_here[inst[1]] = false;
+        }
+    }
+    free(starts);
+    free(live);
+}
+
+
+static void compile(scope_t* scope, ScamVal* ast, bool tail) {
+    ScamCode* code = scope->code;
+    if (ScamVal_type(ast) == SCAM_SYM) {
+        compile_symbol(scope, (ScamStr*)ast);
+    } else if (ScamVal_type(ast) == SCAM_SEXPR) {
+        ScamSeq* seq = (ScamSeq*)ast;
+        if (ScamSeq_len(seq) == 0) {
+            compile_error(code, ScamErr_new("empty expression"));
+            return;
+        }
+        ScamVal* head = ScamSeq_get(seq, 0);
+        if (ScamVal_type(head) == SCAM_SYM) {
+            switch (ScamSym_keyword((ScamStr*)head)) {
+                case KEYWORD_DEFINE: compile_define(scope, seq); return;
+                case KEYWORD_IF: compile_if(scope, seq, tail); return;
+                case KEYWORD_LAMBDA: compile_lambda(scope, seq); return;
+                case KEYWORD_AND: compile_and_or(scope, seq, CODE_AND, tail); return;
+                case KEYWORD_OR: compile_and_or(scope, seq, CODE_OR, tail); return;
+                case KEYWORD_BEGIN: compile_begin(scope, seq, tail); return;
+                case KEYWORD_LIST: compile_elements(scope, seq, CODE_LIST); return;
+                case KEYWORD_DICT: compile_elements(scope, seq, CODE_DICT); return;
+                default: break;
+            }
+        }
+        compile_call(scope, seq, tail);
+    } else {
+        emit(code, CODE_CONST);
+        emit(code, add_constant(code, ast));
+    }
+}
+
+
+/* Variables of the enclosing functions are addressed by frame depth and slot. Anything else is a
+ * global, or is bound at runtime in some other way, so it is looked up by name, skipping the
+ * frames that are known not to bind it.
+ */
+static void compile_symbol(scope_t* scope, ScamStr* sym) {
+    int depth = 0;
+    for (scope_t* s = scope; s != NULL && s->code->slot_names != NULL; s = s->enclosing) {
+        int slot = find_slot(s->code->slot_names, (ScamVal*)sym);
+        if (slot != -1) {
+            if (depth > 0) {
+                s->captured[slot] = true;
+            }
+            emit(scope->code, CODE_LOCAL);
+            emit(scope->code, depth);
+            emit(scope->code, slot);
+            return;
+        }
+        depth++;
+    }
+    emit(scope->code, CODE_LOOKUP);
+    emit(scope->code, add_constant(scope->code, (ScamVal*)sym));
+    emit(scope->code, depth);
+}
+
+
+static void compile_define(scope_t* scope, ScamSeq* ast) {
+    ScamCode* code = scope->code;
+    if (ScamSeq_len(ast) != 3) {
+        compile_error(code, ScamErr_arity("define", ScamSeq_len(ast), 3));
+    } else if (ScamVal_type(ScamSeq_get(ast, 1)) != SCAM_SYM) {
+        compile_error(code, ScamErr_new("cannot define non-symbol"));
+    } else {
+        compile(scope, ScamSeq_get(ast, 2), false);
+        if (code->slot_names != NULL) {
+            emit(code, CODE_DEFINE_LOCAL);
+            emit(code, find_slot(code->slot_names, ScamSeq_get(ast, 1)));
+        } else {
+            emit(code, CODE_DEFINE);
+            emit(code, add_constant(code, ScamSeq_get(ast, 1)));
+        }
+    }
+}
+
 
-codeobj* ScamVal_compile(const ScamVal*);
+static void compile_if(scope_t* scope, ScamSeq* ast, bool tail) {
+    ScamCode* code = scope->code;
+    if (ScamSeq_len(ast) != 4) {
+        compile_error(code, ScamErr_arity("if", ScamSeq_len(ast), 4));
+        return;
+    }
+    compile(scope, ScamSeq_get(ast, 1), false);
+    emit(code, CODE_JUMP_IF_FALSE);
+    size_t false_jump = emit(code, 0);
+    compile(scope, ScamSeq_get(ast, 2), tail);
+    emit(code, CODE_JUMP);
+    size_t end_jump = emit(code, 0);
+    patch(code, false_jump);
+    compile(scope, ScamSeq_get(ast, 3), tail);
+    patch(code, end_jump);
+}
 
 
-int main(int argc, char* argv[]) {
-    puts(codeobj_to_str(ScamVal_compile(NULL)));
-    return 0;
+static void compile_lambda(scope_t* scope, ScamSeq* ast) {
+    ScamCode* code = scope->code;
+    if (ScamSeq_len(ast) < 3) {
+        compile_error(code, ScamErr_arity("lambda", ScamSeq_len(ast), 3));
+        return;
+    }
+    ScamSeq* parameters = (ScamSeq*)ScamSeq_get(ast, 1);
+    if (ScamVal_type(parameters) != SCAM_SEXPR) {
+        compile_error(code, ScamErr_new("arg 1 to 'lambda' should be a parameter list"));
+        return;
+    }
+    for (size_t i = 0; i < ScamSeq_len(parameters); i++) {
+        if (ScamVal_type(ScamSeq_get(parameters, i)) != SCAM_SYM) {
+            compile_error(code, ScamErr_new("lambda parameter must be symbol"));
+            return;
+        }
+    }
+    ScamSeq* body = (ScamSeq*)ScamSeq_get(ast, 2);
+    ScamCode* body_code = compile_function(scope, parameters, (ScamVal*)body);
+    /* The template has no environment: CODE_LAMBDA closes a copy of it over the current one. */
+    ScamFunction* template = ScamFunction_compiled(NULL, parameters, body, body_code);
+    gc_unset_root((ScamVal*)body_code);
+    emit(code, CODE_LAMBDA);
+    emit(code, add_constant(code, (ScamVal*)template));
 }
 
 
-static const char* bytecode_to_str(bytecode_t inst) {
+/* The last operand is in tail position, so its value is the value of the whole expression. */
+static void compile_and_or(scope_t* scope, ScamSeq* ast, bytecode_t inst, bool tail) {
+    ScamCode* code = scope->code;
+    size_t n = ScamSeq_len(ast) - 1;
+    if (n == 0) {
+        emit(code, CODE_CONST);
+        emit(code, add_constant(code, (ScamVal*)ScamBool_new(inst == CODE_AND)));
+        return;
+    }
+    size_t* jumps = gc_malloc(n * sizeof *jumps);
+    for (size_t i = 0; i < n - 1; i++) {
+        compile(scope, ScamSeq_get(ast, i + 1), false);
+        emit(code, inst);
+        emit(code, i);
+        jumps[i] = emit(code, 0);
+    }
+    compile(scope, ScamSeq_get(ast, n), tail);
+    for (size_t i = 0; i < n - 1; i++) {
+        patch(code, jumps[i]);
+    }
+    free(jumps);
+}
+
+
+static void compile_begin(scope_t* scope, ScamSeq* ast, bool tail) {
+    size_t n = ScamSeq_len(ast);
+    if (n < 2) {
+        compile_error(scope->code, ScamErr_min_arity("begin", n - 1, 1));
+        return;
+    }
+    for (size_t i = 1; i < n; i++) {
+        compile(scope, ScamSeq_get(ast, i), tail && i == n - 1);
+        if (i != n - 1) {
+            emit(scope->code, CODE_POP);
+        }
+    }
+}
+
+
+static void compile_call(scope_t* scope, ScamSeq* ast, bool tail) {
+    for (size_t i = 0; i < ScamSeq_len(ast); i++) {
+        compile(scope, ScamSeq_get(ast, i), false);
+    }
+    emit(scope->code, tail ? CODE_TAIL_CALL : CODE_CALL);
+    emit(scope->code, ScamSeq_len(ast) - 1);
+}
+
+
+/* Compile a call to list or dict into an instruction that builds the value directly. */
+static void compile_elements(scope_t* scope, ScamSeq* ast, bytecode_t inst) {
+    for (size_t i = 1; i < ScamSeq_len(ast); i++) {
+        compile(scope, ScamSeq_get(ast, i), false);
+    }
+    emit(scope->code, inst);
+    emit(scope->code, ScamSeq_len(ast) - 1);
+}
+
+
+size_t bytecode_nargs(bytecode_t inst) {
     switch (inst) {
-        case CODE_ADD:
-            return "CODE_ADD";
-        default:
-            return "unknown bytecode instruction";
+        #define EXPAND_BYTECODE(inst, nargs) \
+            case inst: return nargs;
+        #include "bytecode.def"
+        default: return 0;
     }
 }
 
 
-char* codeobj_to_str(const codeobj* code) {
-    char* ret;
-    size_t n;
-    FILE* stream = open_memstream(&ret, &n);
-    fputs(bytecode_to_str(code->inst), stream);
-    if (code->arg1)
-        ScamVal_write(code->arg1, stream);
-    if (code->arg2)
-        ScamVal_write(code->arg2, stream);
-    fclose(stream);
-    return ret;
+const char* bytecode_name(bytecode_t inst) {
+    switch (inst) {
+        #define EXPAND_BYTECODE(inst, nargs) \
+            case inst: return #inst ;
+        #include "bytecode.def"
+        default: return "unknown bytecode instruction";
+    }
 }
 
 
-codeobj* ScamVal_compile(const ScamVal* v) {
-    codeobj* ret = gc_malloc(sizeof *ret);
-    ret->inst = CODE_ADD;
-    ret->arg1 = ret->arg2 = NULL;
-    return ret;
+void ScamCode_print(const ScamCode* code, int indent) {
+    size_t i = 0;
+    while (i < code->count) {
+        bytecode_t inst = code->arr[i];
+        for (int j = 0; j < indent; j++)
+            printf("  ");
+        printf("%.4ld: %s", i, bytecode_name(inst));
+        size_t nargs = bytecode_nargs(inst);
+        for (size_t j = 1; j <= nargs; j++) {
+            printf(" %d", code->arr[i + j]);
+        }
+        ScamVal* constant = NULL;
+        if (inst == CODE_CONST || inst == CODE_LOOKUP || inst == CODE_DEFINE ||
+            inst == CODE_LAMBDA || inst == CODE_ERROR) {
+            constant = ScamSeq_get(code->constants, code->arr[i + 1]);
+            if (inst != CODE_LAMBDA) {
+                printf(" (");
+                ScamVal_write(constant, stdout);
+                printf(")");
+            }
+        }
+        printf("\n");
+        if (inst == CODE_LAMBDA) {
+            ScamCode_print(ScamFunction_code((ScamFunction*)constant), indent + 1);
+        }
+        i += nargs + 1;
+    }
 }
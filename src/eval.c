@@ -1,7 +1,11 @@
+#include <stdlib.h>
 #include <string.h>
 #include "collector.h"
+#include "compile.h"
 #include "eval.h"
 #include "parse.h"
+#include "profiler.h"
+#include "vm.h"
 
 #define SCAM_ASSERT(cond, ast, err, ...) { \
     if (!(cond)) { \
@@ -23,156 +27,512 @@
     } \
 }
 
-/* Forward declaration of various eval utilities */
-ScamVal* eval_begin(ScamSeq*, ScamEnv*);
-ScamVal* eval_define(ScamSeq*, ScamEnv*);
-ScamVal* eval_lambda(ScamSeq*, ScamEnv*);
-ScamVal* eval_if(ScamSeq*, ScamEnv*);
-ScamVal* eval_and(ScamSeq*, ScamEnv*);
-ScamVal* eval_or(ScamSeq*, ScamEnv*);
-ScamSeq* eval_list(ScamSeq*, ScamEnv*);
-ScamDict* eval_dict(ScamSeq*, ScamEnv*);
+/* The values that the evaluators are working on. */
+ScamVal** eval_stack = NULL;
+size_t eval_stack_count = 0;
+static size_t eval_stack_size = 0;
 
-ScamVal* eval(ScamVal* ast_or_val, ScamEnv* env) {
-    if (ast_or_val->type == SCAM_SYM) {
+/* The views of the arguments of the builtins that are running, which see part of the stack in
+ * place and have to be moved along with it.
+ */
+static ScamSeq** views = NULL;
+static size_t views_count = 0;
+static size_t views_size = 0;
+
+enum { STACK_SIZE_INITIAL = 256, STACK_SIZE_GROW = 2 };
+static void grow_stack(void) {
+    if (eval_stack == NULL) {
+        gc_add_stack(&eval_stack, &eval_stack_count);
+    }
+    size_t new_size = eval_stack_size ? eval_stack_size * STACK_SIZE_GROW : STACK_SIZE_INITIAL;
+    ScamVal** new_stack = gc_malloc(new_size * sizeof *new_stack);
+    memcpy(new_stack, eval_stack, eval_stack_count * sizeof *eval_stack);
+    /* The collector's marker thread may be reading the old stack through a view. */
+    gc_lock();
+    for (size_t i = 0; i < views_count; i++) {
+        ScamSeq_move_view(views[i], eval_stack, new_stack);
+    }
+    ScamVal** old_stack = eval_stack;
+    eval_stack = new_stack;
+    eval_stack_size = new_size;
+    gc_unlock();
+    free(old_stack);
+}
+
+void eval_push(ScamVal* v) {
+    if (eval_stack_count == eval_stack_size) {
+        grow_stack();
+    }
+    gc_unset_root(v);
+    eval_stack[eval_stack_count++] = v;
+}
+
+ScamSeq* eval_pop_n(size_t n) {
+    ScamSeq* ret = ScamSeq_view(eval_stack + eval_stack_count - n, n);
+    ScamSeq_close_view(ret, true);
+    eval_stack_count -= n;
+    return ret;
+}
+
+ScamVal* eval_call_top(size_t n) {
+    ScamVal* fun_val = eval_stack[eval_stack_count - n - 1];
+    if (!ScamVal_typecheck(fun_val, SCAM_BASE_FUNCTION)) {
+        return (ScamVal*)ScamErr_new("first element of S-expression must be function");
+    }
+    ScamSeq* args = ScamSeq_view(eval_stack + eval_stack_count - n, n);
+    if (views_count == views_size) {
+        views_size = views_size ? views_size * STACK_SIZE_GROW : STACK_SIZE_INITIAL;
+        views = gc_realloc(views, views_size * sizeof *views);
+    }
+    views[views_count++] = args;
+    ScamVal* ret = eval_call(fun_val, args);
+    views_count--;
+    /* Some builtins (e.g., list) return their argument list, which then needs values of its own. */
+    if (ret == (ScamVal*)args) {
+        ScamSeq_close_view(args, true);
+    } else {
+        ScamSeq_close_view(args, false);
+        gc_unset_root((ScamVal*)args);
+    }
+    eval_stack_count -= n + 1;
+    return ret;
+}
+
+
+/* Rather than recursing on the C stack, the tree walker keeps a frame for every expression that it
+ * is part way through, in an array that grows as needed. The values that a frame has collected,
+ * such as the arguments of a call evaluated so far, are on the value stack from its base on, and
+ * the value of each subexpression is handed to the frame on top once it has been evaluated.
+ *   - An expression in tail position gets no frame: it is evaluated in place of the one that it is
+ *     part of, so that loops written as tail calls run in constant space.
+ *   - The frame of a function body keeps the function and the environment of the call on the value
+ *     stack, and a call in tail position of the body finds it on top and replaces them.
+ */
+typedef enum {
+    FRAME_CALL, FRAME_LIST, FRAME_DICT, FRAME_DEFINE, FRAME_IF, FRAME_BEGIN, FRAME_AND, FRAME_OR,
+    FRAME_BODY
+} eval_frame_kind_t;
+
+typedef struct {
+    eval_frame_kind_t kind;
+    ScamSeq* ast; /* NULL for a function body, which needn't be an S-expression. */
+    ScamEnv* env;
+    size_t i; /* For a call, literal, begin, and or or, the index of the next subexpression. */
+    size_t base;
+} eval_frame_t;
+
+static eval_frame_t* frames = NULL;
+static size_t frames_count = 0;
+static size_t frames_size = 0;
+
+static eval_frame_t* push_frame(eval_frame_kind_t kind, ScamSeq* ast, ScamEnv* env, size_t i) {
+    if (frames_count == frames_size) {
+        frames_size = frames_size ? frames_size * STACK_SIZE_GROW : STACK_SIZE_INITIAL;
+        frames = gc_realloc(frames, frames_size * sizeof *frames);
+    }
+    frames[frames_count] = (eval_frame_t){ kind, ast, env, i, eval_stack_count };
+    return &frames[frames_count++];
+}
+
+/* The steps below either return the value of the expression that they finish, or return NULL and
+ * set *next and *next_env to the subexpression to evaluate next and its environment.
+ */
+static ScamVal* eval_lambda(ScamSeq*, ScamEnv*);
+
+/* Evaluate the next element of a call or literal from the frame on top, or finish the frame once
+ * they have all been evaluated.
+ */
+static ScamVal* eval_next_element(size_t frames_base, ScamVal** next, ScamEnv** next_env);
+
+/* Start evaluating an expression. */
+static ScamVal* eval_start(ScamVal* ast_or_val, ScamEnv* env, size_t frames_base, ScamVal** next,
+                           ScamEnv** next_env) {
+    if (ScamVal_type(ast_or_val) == SCAM_SYM) {
         return ScamEnv_lookup(env, (ScamStr*)ast_or_val);
-    } else if (ast_or_val->type == SCAM_SEXPR) {
-        ScamSeq* ast = (ScamSeq*)ast_or_val;
-        SCAM_ASSERT(ScamSeq_len(ast) > 0, ast, "empty expression");
-        /* Handle special expressions and statements. */
-        if (ScamSeq_get(ast, 0)->type == SCAM_SYM) {
-            const char* name = ScamStr_unbox((ScamStr*)ScamSeq_get(ast, 0));
-            if (strcmp(name, "define") == 0) {
-                return eval_define(ast, env);
-            } else if (strcmp(name, "if") == 0) {
-                return eval_if(ast, env);
-            } else if (strcmp(name, "lambda") == 0) {
-                return eval_lambda(ast, env);
-            } else if (strcmp(name, "and") == 0) {
-                return eval_and(ast, env);
-            } else if (strcmp(name, "or") == 0) {
-                return eval_or(ast, env);
+    } else if (ScamVal_type(ast_or_val) != SCAM_SEXPR) {
+        return ast_or_val;
+    }
+    ScamSeq* ast = (ScamSeq*)ast_or_val;
+    prof_locate(ast);
+    size_t n = ScamSeq_len(ast);
+    if (n == 0) {
+        return (ScamVal*)ScamErr_new("empty expression");
+    }
+    ScamVal* head = ScamSeq_get(ast, 0);
+    enum ScamKeyword keyword = ScamVal_type(head) == SCAM_SYM ? ScamSym_keyword((ScamStr*)head)
+                                                              : KEYWORD_NONE;
+    *next_env = env;
+    switch (keyword) {
+        case KEYWORD_NONE:
+            push_frame(FRAME_CALL, ast, env, 0);
+            return eval_next_element(frames_base, next, next_env);
+        case KEYWORD_DEFINE:
+            SCAM_ASSERT_ARITY("define", ast, 3);
+            SCAM_ASSERT(ScamVal_type(ScamSeq_get(ast, 1)) == SCAM_SYM, ast,
+                        "cannot define non-symbol");
+            push_frame(FRAME_DEFINE, ast, env, 0);
+            *next = ScamSeq_get(ast, 2);
+            return NULL;
+        case KEYWORD_IF:
+            SCAM_ASSERT_ARITY("if", ast, 4);
+            push_frame(FRAME_IF, ast, env, 0);
+            *next = ScamSeq_get(ast, 1);
+            return NULL;
+        case KEYWORD_LAMBDA:
+            return eval_lambda(ast, env);
+        case KEYWORD_AND:
+        case KEYWORD_OR:
+        case KEYWORD_BEGIN:
+            if (n == 1) {
+                if (keyword == KEYWORD_BEGIN) {
+                    return (ScamVal*)ScamErr_min_arity("begin", 0, 1);
+                }
+                return (ScamVal*)ScamBool_new(keyword == KEYWORD_AND);
             }
+            /* Only the subexpressions before the last one need a frame. */
+            if (n > 2) {
+                push_frame(keyword == KEYWORD_AND ? FRAME_AND :
+                           keyword == KEYWORD_OR ? FRAME_OR : FRAME_BEGIN, ast, env, 2);
+            }
+            *next = ScamSeq_get(ast, 1);
+            return NULL;
+        case KEYWORD_LIST:
+        case KEYWORD_DICT:
+            /* Literals are evaluated without looking up the builtin. */
+            push_frame(keyword == KEYWORD_LIST ? FRAME_LIST : FRAME_DICT, ast, env, 1);
+            return eval_next_element(frames_base, next, next_env);
+        default:
+            return (ScamVal*)ScamErr_new("unknown keyword");
+    }
+}
+
+/* Call the function of the call whose frame has just been finished, with the values above the
+ * frame's base as arguments. A function made by the tree walker has its body evaluated next.
+ */
+static ScamVal* eval_application(size_t base, size_t frames_base, ScamVal** next,
+                                 ScamEnv** next_env) {
+    ScamVal* fun_val = eval_stack[base];
+    size_t got = eval_stack_count - base - 1;
+    if (ScamVal_type(fun_val) != SCAM_FUNCTION || ScamFunction_code((ScamFunction*)fun_val) != NULL) {
+        return eval_call_top(got);
+    }
+    ScamFunction* lamb = (ScamFunction*)fun_val;
+    size_t expected = ScamFunction_nparams(lamb);
+    if (got != expected) {
+        eval_stack_count = base;
+        return (ScamVal*)ScamErr_new("lambda function got %d argument(s), expected %d", got,
+                                     expected);
+    }
+    ScamEnv* inner_env = ScamFunction_env(lamb);
+    for (size_t i = 0; i < expected; i++) {
+        ScamEnv_insert(inner_env, ScamFunction_param(lamb, i), eval_stack[base + 1 + i]);
+    }
+    if (frames_count > frames_base && frames[frames_count - 1].kind == FRAME_BODY) {
+        /* A tail call, which replaces the function and environment of the current one. Tail calls
+         * don't nest, but a loop of them still has to stop when memory runs out.
+         */
+        eval_stack_count = base;
+        gc_unset_root((ScamVal*)inner_env);
+        if (gc_heap_exhausted()) {
+            return (ScamVal*)ScamErr_new("out of memory");
         }
-        ScamSeq* arglist = eval_list(ast, env);
-        if (arglist->type == SCAM_ERR) {
-            return (ScamVal*)arglist;
+        size_t body_base = frames[frames_count - 1].base;
+        eval_stack[body_base] = fun_val;
+        eval_stack[body_base + 1] = (ScamVal*)inner_env;
+        prof_replace(fun_val);
+    } else {
+        ScamVal* err = eval_enter();
+        if (err != NULL) {
+            eval_stack_count = base;
+            gc_unset_root((ScamVal*)inner_env);
+            return err;
         }
-        ScamVal* fun_val = ScamSeq_pop(arglist, 0);
-        ScamVal* ret;
-        if (ScamVal_typecheck(fun_val, SCAM_BASE_FUNCTION)) {
-            ret = eval_apply(fun_val, arglist);
-        } else {
-            gc_unset_root((ScamVal*)arglist);
-            ret = (ScamVal*)ScamErr_new("first element of S-expression must be function");
+        /* The function stays on the stack where it is, followed by the environment. */
+        push_frame(FRAME_BODY, NULL, inner_env, 0)->base = base;
+        eval_stack_count = base + 1;
+        eval_push((ScamVal*)inner_env);
+        prof_enter(fun_val);
+    }
+    *next = (ScamVal*)ScamFunction_body(lamb);
+    *next_env = inner_env;
+    return NULL;
+}
+
+static ScamVal* eval_next_element(size_t frames_base, ScamVal** next, ScamEnv** next_env) {
+    eval_frame_t* frame = &frames[frames_count - 1];
+    if (frame->i < ScamSeq_len(frame->ast)) {
+        *next = ScamSeq_get(frame->ast, frame->i++);
+        *next_env = frame->env;
+        return NULL;
+    }
+    eval_frame_t done = frames[--frames_count];
+    size_t n = eval_stack_count - done.base;
+    if (done.kind == FRAME_CALL) {
+        return eval_application(done.base, frames_base, next, next_env);
+    } else if (done.kind == FRAME_LIST) {
+        ScamSeq* ret = eval_pop_n(n);
+        ret->type = SCAM_LIST;
+        for (size_t i = 0; i < n; i++) {
+            ScamVal_share(ScamSeq_get(ret, i));
         }
-        gc_unset_root((ScamVal*)arglist);
-        gc_unset_root(fun_val);
+        return (ScamVal*)ret;
+    } else {
+        ScamSeq* pairs = eval_pop_n(n);
+        ScamVal* ret = ScamDict_from_pairs(pairs);
+        gc_unset_root((ScamVal*)pairs);
         return ret;
+    }
+}
+
+/* Hand the value of a subexpression to the frame on top. */
+static ScamVal* eval_resume(ScamVal* v, size_t frames_base, ScamVal** next, ScamEnv** next_env) {
+    eval_frame_t* frame = &frames[frames_count - 1];
+    if (frame->kind == FRAME_BODY) {
+        frames_count--;
+        eval_stack_count = frame->base;
+        prof_leave();
+        eval_leave();
+        return v;
+    }
+    ScamSeq* ast = frame->ast;
+    size_t last = ScamSeq_len(ast) - 1;
+    /* Back in the expression that the value belongs to, for the profiler. */
+    prof_locate(ast);
+    *next_env = frame->env;
+    switch (frame->kind) {
+        case FRAME_CALL:
+        case FRAME_LIST:
+        case FRAME_DICT:
+            eval_push(v);
+            return eval_next_element(frames_base, next, next_env);
+        case FRAME_DEFINE:
+        {
+            ScamVal* k = ScamSeq_get(ast, 1);
+            frames_count--;
+            if (ScamVal_type(v) == SCAM_FUNCTION) {
+                ScamFunction_set_name((ScamFunction*)v, (ScamStr*)k);
+            }
+            ScamEnv_insert(*next_env, (ScamStr*)k, v);
+            return ScamNull_new();
+        }
+        case FRAME_IF:
+        {
+            /* The chosen clause is in tail position. */
+            frames_count--;
+            gc_unset_root(v);
+            if (ScamVal_type(v) != SCAM_BOOL) {
+                return (ScamVal*)ScamErr_new("condition of an if expression must be a bool");
+            }
+            *next = ScamSeq_get(ast, ScamBool_unbox((ScamBool*)v) ? 2 : 3);
+            return NULL;
+        }
+        case FRAME_BEGIN:
+        case FRAME_AND:
+        case FRAME_OR:
+        {
+            /* The last subexpression is in tail position, so that of and or or is returned as is,
+             * like in Scheme.
+             */
+            gc_unset_root(v);
+            if (frame->kind != FRAME_BEGIN) {
+                bool is_and = (frame->kind == FRAME_AND);
+                if (ScamVal_type(v) != SCAM_BOOL) {
+                    frames_count--;
+                    return (ScamVal*)ScamErr_type(is_and ? "and" : "or", frame->i - 2,
+                                                  ScamVal_type(v), SCAM_BOOL);
+                } else if (ScamBool_unbox((ScamBool*)v) != is_and) {
+                    frames_count--;
+                    return (ScamVal*)ScamBool_new(!is_and);
+                }
+            }
+            if (frame->i == last) {
+                frames_count--;
+            }
+            *next = ScamSeq_get(ast, frame->i++);
+            return NULL;
+        }
+        default:
+            return (ScamVal*)ScamErr_new("bad evaluation frame");
+    }
+}
+
+/* Drop the frames that an evaluation left when it failed, and their values. */
+static void eval_unwind(size_t frames_base, size_t values_base) {
+    while (frames_count > frames_base) {
+        if (frames[--frames_count].kind == FRAME_BODY) {
+            prof_leave();
+            eval_leave();
+        }
+    }
+    eval_stack_count = values_base;
+}
+
+ScamVal* eval(ScamVal* ast_or_val, ScamEnv* env) {
+    size_t frames_base = frames_count;
+    size_t values_base = eval_stack_count;
+    prof_location_t location = prof_save_location();
+    ScamVal* ret = NULL;
+    for (;;) {
+        if (ret == NULL) {
+            ret = eval_start(ast_or_val, env, frames_base, &ast_or_val, &env);
+        } else if (ScamVal_type(ret) == SCAM_ERR) {
+            eval_unwind(frames_base, values_base);
+            break;
+        } else if (frames_count == frames_base) {
+            break;
+        } else {
+            ret = eval_resume(ret, frames_base, &ast_or_val, &env);
+        }
+    }
+    prof_restore_location(location);
+    return ret;
+}
+
+static bool use_vm = false;
+
+void eval_set_vm(bool on) {
+    use_vm = on;
+}
+
+static bool check_roots = false;
+
+void eval_set_check_roots(bool on) {
+    check_roots = on;
+}
+
+enum { MAX_DEPTH_DEFAULT = 10000 };
+static size_t max_depth = MAX_DEPTH_DEFAULT;
+static size_t depth = 0;
+
+void eval_set_max_depth(size_t n) {
+    max_depth = n;
+}
+
+ScamVal* eval_enter(void) {
+    if (depth >= max_depth) {
+        return (ScamVal*)ScamErr_new("stack overflow (maximum depth is %zu)", max_depth);
+    }
+    if (gc_heap_exhausted()) {
+        return (ScamVal*)ScamErr_new("out of memory");
+    }
+    depth++;
+    return NULL;
+}
+
+void eval_leave(void) {
+    depth--;
+}
+
+/* Neither evaluator recurses on the C stack for the calls that it makes itself, but a function
+ * called from elsewhere, such as by map, runs in a nested call of the evaluator. That does use the
+ * C stack, so those calls can only nest so deep, whatever the maximum depth.
+ */
+enum { MAX_NESTING = 2000 };
+static size_t nesting = 0;
+
+/* Evaluate a freshly parsed program with whichever evaluator was selected. */
+static ScamVal* eval_program(ScamVal* ast, ScamEnv* env) {
+    ScamVal* ret;
+    if (use_vm) {
+        ScamCode* code = ScamVal_compile(ast);
+        ret = vm_run(code, env);
+        gc_unset_root((ScamVal*)code);
     } else {
-        return ast_or_val;
+        ret = eval(ast, env);
     }
+    /* A program that ran out of memory has unwound by now, so what it was building can be collected
+     * and the reserve taken back before the next one.
+     */
+    if (gc_heap_exhausted()) {
+        gc_collect();
+    }
+    return ret;
 }
 
 ScamVal* eval_str(char* line, ScamEnv* env) {
+    size_t nroots = gc_root_count();
     ScamSeq* ast = parse_str(line);
-    ScamVal* ret = eval((ScamVal*)ast, env);
+    ScamVal* ret = eval_program((ScamVal*)ast, env);
     gc_unset_root((ScamVal*)ast);
+    if (check_roots) {
+        gc_report_roots(nroots, ret);
+    }
     return ret;
 }
 
 ScamVal* eval_file(char* fp, ScamEnv* env) {
+    size_t nroots = gc_root_count();
     ScamSeq* ast = parse_file(fp);
-    ScamVal* ret = eval((ScamVal*)ast, env);
+    ScamVal* ret = eval_program((ScamVal*)ast, env);
     gc_unset_root((ScamVal*)ast);
+    if (check_roots) {
+        gc_report_roots(nroots, ret);
+    }
     return ret;
 }
 
 /* Evaluate a lambda expression. */
-ScamVal* eval_lambda(ScamSeq* ast, ScamEnv* env) {
+static ScamVal* eval_lambda(ScamSeq* ast, ScamEnv* env) {
     SCAM_ASSERT_MIN_ARITY("lambda", ast, 3);
     ScamSeq* parameters_copy = (ScamSeq*)ScamSeq_get(ast, 1);
-    SCAM_ASSERT(parameters_copy->type == SCAM_SEXPR, ast,
+    SCAM_ASSERT(ScamVal_type(parameters_copy) == SCAM_SEXPR, ast,
                 "arg 1 to 'lambda' should be a parameter list");
     for (size_t i = 0; i < ScamSeq_len(parameters_copy); i++) {
-        SCAM_ASSERT(ScamSeq_get(parameters_copy, i)->type == SCAM_SYM, ast,
+        SCAM_ASSERT(ScamVal_type(ScamSeq_get(parameters_copy, i)) == SCAM_SYM, ast,
                     "lambda parameter must be symbol");
     }
     return (ScamVal*)ScamFunction_new(env, (ScamSeq*)ScamSeq_get(ast, 1),
                                            (ScamSeq*)ScamSeq_get(ast, 2));
 }
 
-/* Evaluate a define statement. */
-ScamVal* eval_define(ScamSeq* ast, ScamEnv* env) {
-    SCAM_ASSERT_ARITY("define", ast, 3);
-    SCAM_ASSERT(ScamSeq_get(ast, 1)->type == SCAM_SYM, ast, "cannot define non-symbol");
-    ScamVal* k = ScamSeq_get(ast, 1);
-    ScamVal* v = eval(ScamSeq_get(ast, 2), env);
-    if (v->type != SCAM_ERR) {
-        ScamEnv_insert(env, (ScamStr*)k, v);
-        return ScamNull_new();
-    } else {
-        return v;
+/* Prepare the arguments of a builtin for the way it uses them (see ScamBuiltin). The builtin may
+ * only change an argument that nothing else refers to, so any other is replaced by a copy, and an
+ * argument that it may keep a reference to is no longer owned.
+ */
+static void prepare_arguments(const ScamBuiltin* bltin, ScamSeq* arglist) {
+    for (size_t i = 0; i < ScamSeq_len(arglist); i++) {
+        ScamVal* arg = ScamSeq_get(arglist, i);
+        switch (ScamBuiltin_arg_mode(bltin, i)) {
+            case ARG_MUTATE:
+            {
+                ScamVal* owned = ScamVal_own(arg);
+                if (owned != arg) {
+                    ScamSeq_set(arglist, i, owned);
+                    gc_unset_root(owned);
+                }
+                break;
+            }
+            case ARG_CONSUME:
+                ScamVal_share(arg);
+                break;
+            case ARG_BORROW:
+                break;
+        }
     }
 }
 
-/* Evaluate an if expression. */
-ScamVal* eval_if(ScamSeq* ast, ScamEnv* env) {
-    SCAM_ASSERT_ARITY("if", ast, 4);
-    ScamVal* cond = eval(ScamSeq_get(ast, 1), env);
-    if (cond->type == SCAM_BOOL) {
-        long long cond_val = ScamBool_unbox((ScamBool*)cond);
-        gc_unset_root(cond);
-        ScamVal* true_clause = ScamSeq_get(ast, 2);
-        ScamVal* false_clause = ScamSeq_get(ast, 3);
-        return cond_val ? eval(true_clause, env) : eval(false_clause, env);
-    } else {
-        gc_unset_root(cond);
-        return (ScamVal*)ScamErr_new("condition of an if expression must be a bool");
+/* Run the body of a function in a nested call of the evaluator that made it. */
+static ScamVal* apply_function(ScamFunction* lamb, ScamSeq* arglist) {
+    if (ScamFunction_code(lamb) != NULL) {
+        /* Functions created by the virtual machine run their compiled body. */
+        return vm_apply(lamb, arglist);
     }
-}
-
-/* Evaluate an and expression. */
-ScamVal* eval_and(ScamSeq* ast, ScamEnv* env) {
-    size_t n = ScamSeq_len(ast) - 1;
-    for (size_t i = 0; i < n; i++) {
-        ScamVal* v = eval(ScamSeq_pop(ast, 1), env);
-        int v_type = v->type;
-        if (v_type != SCAM_BOOL) {
-            gc_unset_root(v);
-            return (ScamVal*)ScamErr_type("and", i, v_type, SCAM_BOOL);
-        } else if (!ScamBool_unbox((ScamBool*)v)) {
-            gc_unset_root(v);
-            return (ScamVal*)ScamBool_new(0);
-        } else {
-            gc_unset_root(v);
-        }
+    ScamVal* err = eval_enter();
+    if (err != NULL) {
+        return err;
     }
-    return (ScamVal*)ScamBool_new(1);
-}
-
-/* Evaluate an or expression. */
-ScamVal* eval_or(ScamSeq* ast, ScamEnv* env) {
-    size_t n = ScamSeq_len(ast) - 1;
-    for (size_t i = 0; i < n; i++) {
-        ScamVal* v = eval(ScamSeq_pop(ast, 1), env);
-        int v_type = v->type;
-        if (v_type != SCAM_BOOL) {
-            gc_unset_root(v);
-            return (ScamVal*)ScamErr_type("or", i, v_type, SCAM_BOOL);
-        } else if (ScamBool_unbox((ScamBool*)v)) {
-            gc_unset_root(v);
-            return (ScamVal*)ScamBool_new(1);
-        } else {
-            gc_unset_root(v);
-        }
+    ScamEnv* inner_env = ScamFunction_env(lamb);
+    for (size_t i = 0; i < ScamSeq_len(arglist); i++) {
+        ScamEnv_insert(inner_env, ScamFunction_param(lamb, i), ScamSeq_get(arglist, i));
     }
-    return (ScamVal*)ScamBool_new(0);
+    ScamVal* ret = eval((ScamVal*)ScamFunction_body(lamb), inner_env);
+    gc_unset_root((ScamVal*)inner_env);
+    eval_leave();
+    return ret;
 }
 
-
-ScamVal* eval_apply(ScamVal* fun_val, ScamSeq* arglist) {
-    if (fun_val->type == SCAM_FUNCTION) {
+static ScamVal* apply(ScamVal* fun_val, ScamSeq* arglist) {
+    if (ScamVal_type(fun_val) == SCAM_FUNCTION) {
         ScamFunction* lamb = (ScamFunction*)fun_val;
         /* Make sure the right number of arguments were given. */
         size_t expected = ScamFunction_nparams(lamb);
@@ -181,34 +541,35 @@ ScamVal* eval_apply(ScamVal* fun_val, ScamSeq* arglist) {
             return (ScamVal*)ScamErr_new("lambda function got %d argument(s), expected %d",
                                          got, expected);
         }
-        ScamEnv* inner_env = ScamFunction_env((ScamFunction*)fun_val);
-        for (size_t i = 0; i < expected; i++) {
-            ScamEnv_insert(inner_env, ScamFunction_param(lamb, i), ScamSeq_pop(arglist, 0));
+        if (nesting >= MAX_NESTING) {
+            return (ScamVal*)ScamErr_new("stack overflow (nested calls from builtins are limited "
+                                         "to %d)", MAX_NESTING);
         }
-        ScamVal* ret = eval((ScamVal*)ScamFunction_body(lamb), inner_env);
-        gc_unset_root((ScamVal*)inner_env);
+        nesting++;
+        ScamVal* ret = apply_function(lamb, arglist);
+        nesting--;
         return ret;
     } else {
-        if (ScamBuiltin_is_const((ScamBuiltin*)fun_val)) {
-            return ScamBuiltin_function((ScamBuiltin*)fun_val)(arglist);
-        } else {
-            ScamSeq* arglist_copy = (ScamSeq*)gc_copy_ScamVal((ScamVal*)arglist);
-            ScamVal* ret = ScamBuiltin_function((ScamBuiltin*)fun_val)(arglist_copy);
-            gc_unset_root((ScamVal*)arglist_copy);
-            return ret;
+        prepare_arguments((ScamBuiltin*)fun_val, arglist);
+        ScamVal* ret = ScamBuiltin_function((ScamBuiltin*)fun_val)(arglist);
+        /* A builtin that ran out of memory has left out whatever it couldn't make room for. */
+        if (gc_heap_exhausted() && ScamVal_type(ret) != SCAM_ERR) {
+            gc_unset_root(ret);
+            return (ScamVal*)ScamErr_new("out of memory");
         }
+        return ret;
     }
 }
 
-ScamSeq* eval_list(ScamSeq* ast, ScamEnv* env) {
-    for (size_t i = 0; i < ScamSeq_len(ast); i++) {
-        ScamVal* v = eval(ScamSeq_get(ast, i), env);
-        if (v->type != SCAM_ERR) {
-            gc_unset_root(v);
-            ScamSeq_set(ast, i, v);
-        } else {
-            return (ScamSeq*)v;
-        }
-    }
-    return (ScamSeq*)ast;
+ScamVal* eval_call(ScamVal* fun_val, ScamSeq* arglist) {
+    prof_enter(fun_val);
+    ScamVal* ret = apply(fun_val, arglist);
+    prof_leave();
+    return ret;
+}
+
+ScamVal* eval_apply(ScamVal* fun_val, ScamSeq* arglist) {
+    ScamVal* ret = eval_call(fun_val, arglist);
+    ScamVal_share(ret);
+    return ret;
 }
@@ -1,6 +1,7 @@
 %output "grammar.c"
 %defines "grammar.h"
 %define api.pure full
+%locations
 %lex-param {void* scanner}
 %parse-param {void* scanner} {ScamVal** out}
 
@@ -16,9 +17,14 @@ typedef void* yyscan_t;
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "collector.h"
 #include "scamval.h"
 #include "flex.h"
-int yyerror(yyscan_t scanner, ScamVal** out, const char* msg);
+int yyerror(YYLTYPE* loc, yyscan_t scanner, ScamVal** out, const char* msg);
+
+/* Record where a sequence starts, for the profiler. */
+#define LOCATE(seq, loc) \
+    ScamSeq_set_location((ScamSeq*)(seq), (loc).first_line, (loc).first_column)
 
 ScamVal* bison_parse_str(char*);
 ScamVal* bison_parse_file(char*);
@@ -34,8 +40,12 @@ ScamVal* bison_parse_file(char*);
 %token DEFINE TRUE FALSE
 %token <ival> INT
 %token <fval> FLOAT
-%token <sval> STRING SYMBOL
-%type <nodeval> program block define_variable define_function expression expression_plus symbol_list symbol_plus statement_or_expression symbol value expression_star dictionary_item dictionary_list
+%token <sval> STRING
+%token <nodeval> SYMBOL
+/* Release the pieces of a parse tree that are discarded after a syntax error. */
+%destructor { gc_unset_root($$); } <nodeval>
+%destructor { free($$); } <sval>
+%type <nodeval> block define_variable define_function expression expression_plus symbol_list symbol_plus statement_or_expression symbol value expression_star dictionary_item dictionary_list
 
 %%
 program:
@@ -43,7 +53,7 @@ program:
     ;
 block:
     block statement_or_expression { $$ = $1; ScamSeq_append((ScamSeq*)$$, $2); }
-    | statement_or_expression { $$ = (ScamVal*)ScamExpr_from(2, ScamSym_new("begin"), $1); }
+    | statement_or_expression { $$ = (ScamVal*)ScamExpr_from(2, ScamSym_new("#begin"), $1); }
     ;
 statement_or_expression:
     define_variable
@@ -53,17 +63,20 @@ statement_or_expression:
 define_variable:
     '(' DEFINE symbol expression ')' {
         $$ = (ScamVal*)ScamExpr_from(3, ScamSym_new("define"), $3, $4);
+        LOCATE($$, @1);
     }
     ;
 define_function:
     '(' DEFINE symbol_list block ')' {
         ScamVal* name = ScamSeq_pop((ScamSeq*)$3, 0);
         ScamVal* lambda = (ScamVal*)ScamExpr_from(3, ScamSym_new("lambda"), $3, $4);
+        LOCATE(lambda, @1);
         $$ = (ScamVal*)ScamExpr_from(3, ScamSym_new("define"), name, lambda);
+        LOCATE($$, @1);
     }
     ;
 symbol_list:
-    '(' symbol_plus ')' { $$ = $2; }
+    '(' symbol_plus ')' { $$ = $2; LOCATE($$, @1); }
     ;
 symbol_plus:
     symbol_plus symbol { $$ = $1; ScamSeq_append((ScamSeq*)$$, $2); }
@@ -72,8 +85,8 @@ symbol_plus:
 expression:
     value
     | symbol
-    | '(' expression_plus ')' { $$ = $2; }
-    | '(' ')' { $$ = (ScamVal*)ScamExpr_new(); }
+    | '(' expression_plus ')' { $$ = $2; LOCATE($$, @1); }
+    | '(' ')' { $$ = (ScamVal*)ScamExpr_new(); LOCATE($$, @1); }
     ;
 expression_star:
     expression_star expression { $$ = $1; ScamSeq_append((ScamSeq*)$$, $2); }
@@ -82,7 +95,7 @@ expression_star:
 expression_plus:
     expression_star expression { $$ = $1; ScamSeq_append((ScamSeq*)$$, $2); }
 symbol:
-    SYMBOL { $$ = (ScamVal*)ScamSym_no_copy($1); }
+    SYMBOL { $$ = $1; }
     ;
 value:
     INT { $$ = (ScamVal*)ScamInt_new($1); }
@@ -90,8 +103,16 @@ value:
     | STRING { $$ = (ScamVal*)ScamStr_from_literal($1); }
     | TRUE { $$ = (ScamVal*)ScamBool_new(1); }
     | FALSE { $$ = (ScamVal*)ScamBool_new(0); }
-    | '[' expression_star ']' { $$ = $2; ScamSeq_prepend((ScamSeq*)$$, (ScamVal*)ScamSym_new("list")); }
-    | '{' dictionary_list '}' { $$ = $2; ScamSeq_prepend((ScamSeq*)$$, (ScamVal*)ScamSym_new("dict")); }
+    | '[' expression_star ']' {
+        $$ = $2;
+        ScamSeq_prepend((ScamSeq*)$$, (ScamVal*)ScamSym_new("#list"));
+        LOCATE($$, @1);
+    }
+    | '{' dictionary_list '}' {
+        $$ = $2;
+        ScamSeq_prepend((ScamSeq*)$$, (ScamVal*)ScamSym_new("#dict"));
+        LOCATE($$, @1);
+    }
     ;
 dictionary_list:
     dictionary_list dictionary_item { $$ = $1; ScamSeq_append((ScamSeq*)$$, $2); }
@@ -99,13 +120,16 @@ dictionary_list:
     ;
 dictionary_item:
     expression ':' expression {
-        $$ = (ScamVal*)ScamExpr_from(3, ScamSym_new("list"), $1, $3);
+        $$ = (ScamVal*)ScamExpr_from(3, ScamSym_new("#list"), $1, $3);
+        LOCATE($$, @1);
     }
     ;
 %%
 
-int yyerror(yyscan_t scanner, ScamVal** out, const char* s) {
-    ScamVal* ret = (ScamVal*)ScamErr_new(s);
+int yyerror(YYLTYPE* loc, yyscan_t scanner, ScamVal** out, const char* s) {
+    (void)scanner;
+    ScamVal* ret = (ScamVal*)ScamErr_new("line %d, column %d: %s", loc->first_line,
+                                         loc->first_column, s);
     *out = ret;
     return 0;
 }
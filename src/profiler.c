@@ -0,0 +1,582 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "collector.h"
+#include "profiler.h"
+
+
+/* A node of the call tree: one function or builtin, reached through the stack of its ancestors.
+ * Functions have the location of their parameter list, and builtins a location of zero.
+ */
+typedef struct prof_node_rec {
+    char* name;
+    unsigned int line, column;
+    struct prof_node_rec* parent;
+    struct prof_node_rec* children;
+    struct prof_node_rec* sibling;
+    /* The objects allocated while this node was on top of the stack, and their size in bytes. */
+    size_t allocations;
+    size_t allocation_bytes;
+    /* The number of times the sampler found this node on top of the stack. */
+    size_t samples;
+    /* The node's function in the report of the samples, and the number of samples taken anywhere in
+     * its subtree, only used while writing it.
+     */
+    size_t function;
+    size_t subtree_samples;
+} prof_node_t;
+
+/* A call on the shadow stack. The function is the innermost Scam function, which for a builtin is
+ * its caller's, and the location is that of the expression being evaluated in it.
+ */
+typedef struct {
+    prof_node_t* node;
+    prof_node_t* function;
+    prof_location_t location;
+} prof_frame_t;
+
+/* An allocation site, in the hash table. Sites of the same function reached through different
+ * stacks are kept apart here and merged in the report.
+ */
+typedef struct {
+    const prof_node_t* function;
+    prof_location_t location;
+    size_t allocations;
+    size_t bytes;
+} prof_site_t;
+
+
+bool prof_profiling = false;
+bool prof_allocating = false;
+static bool sampling = false;
+
+static prof_node_t root = { "toplevel", 0, 0, NULL, NULL, NULL, 0, 0, 0, 0, 0 };
+
+/* The node on top of the stack, which is all that the sampler's signal handler looks at, since the
+ * stack itself may be moved by realloc at any time.
+ */
+static prof_node_t* volatile current = &root;
+
+static prof_frame_t* frames = NULL;
+static size_t frame_count = 0;
+static size_t frame_size = 0;
+
+/* The site table uses open addressing, and is kept at most half full. */
+static prof_site_t* sites = NULL;
+static size_t site_count = 0;
+static size_t site_size = 0;
+
+enum { FRAMES_INIT = 64, SITES_INIT = 256, PROF_GROW = 2 };
+
+/* The sampler takes a sample every SAMPLE_INTERVAL microseconds of CPU time. */
+enum { SAMPLE_INTERVAL = 1000 };
+
+
+static void prof_init(void) {
+    if (frames == NULL) {
+        frame_size = FRAMES_INIT;
+        frames = gc_malloc(frame_size * sizeof *frames);
+        frames[0] = (prof_frame_t){ &root, &root, { 0, 0 } };
+        frame_count = 1;
+    }
+}
+
+
+void prof_set_allocations(bool on) {
+    prof_allocating = on;
+    prof_profiling = prof_allocating || sampling;
+    if (prof_profiling) {
+        prof_init();
+    }
+}
+
+
+static void prof_sample(int signum) {
+    (void)signum;
+    current->samples++;
+}
+
+
+/* Start or stop the timer that sends SIGPROF to the sampler. */
+static void prof_set_timer(bool on) {
+    struct itimerval timer = { { 0, 0 }, { 0, 0 } };
+    if (on) {
+        timer.it_interval.tv_usec = SAMPLE_INTERVAL;
+        timer.it_value.tv_usec = SAMPLE_INTERVAL;
+    }
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+
+void prof_set_sampling(bool on) {
+    if (on == sampling) {
+        return;
+    }
+    sampling = on;
+    prof_profiling = prof_allocating || sampling;
+    if (on) {
+        prof_init();
+        struct sigaction action;
+        memset(&action, 0, sizeof action);
+        action.sa_handler = prof_sample;
+        /* Don't let the samples interrupt reads from the program's files. */
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, NULL);
+        prof_set_timer(true);
+    } else {
+        prof_set_timer(false);
+        signal(SIGPROF, SIG_IGN);
+    }
+}
+
+
+/* Return the child of the node for the given function, adding it if there isn't one yet. Children
+ * are moved to the front of the list when they are found, since calls tend to repeat.
+ */
+static prof_node_t* prof_child(prof_node_t* parent, const char* name, unsigned int line,
+                               unsigned int column) {
+    prof_node_t** link = &parent->children;
+    for (prof_node_t* p = parent->children; p != NULL; link = &p->sibling, p = p->sibling) {
+        if (p->line == line && p->column == column && strcmp(p->name, name) == 0) {
+            *link = p->sibling;
+            p->sibling = parent->children;
+            parent->children = p;
+            return p;
+        }
+    }
+    prof_node_t* ret = gc_calloc(1, sizeof *ret);
+    ret->name = strdup(name);
+    ret->line = line;
+    ret->column = column;
+    ret->parent = parent;
+    ret->sibling = parent->children;
+    parent->children = ret;
+    return ret;
+}
+
+
+void prof_push(const ScamVal* fun) {
+    if (frame_count == frame_size) {
+        frame_size *= PROF_GROW;
+        frames = gc_realloc(frames, frame_size * sizeof *frames);
+    }
+    prof_frame_t* caller = &frames[frame_count - 1];
+    prof_frame_t* frame = &frames[frame_count++];
+    if (ScamVal_type(fun) == SCAM_FUNCTION) {
+        const ScamFunction* f = (const ScamFunction*)fun;
+        const ScamStr* name = ScamFunction_name(f);
+        unsigned int line = ScamSeq_line(f->parameters);
+        unsigned int column = ScamSeq_column(f->parameters);
+        frame->node = prof_child(caller->node, name != NULL ? ScamStr_unbox(name) : "lambda",
+                                 line, column);
+        frame->function = frame->node;
+        frame->location = (prof_location_t){ line, column };
+    } else {
+        frame->node = prof_child(caller->node, ScamBuiltin_name((const ScamBuiltin*)fun), 0, 0);
+        frame->function = caller->function;
+        frame->location = caller->location;
+    }
+    current = frame->node;
+}
+
+
+void prof_pop(void) {
+    frame_count--;
+    current = frames[frame_count - 1].node;
+}
+
+
+prof_location_t prof_get_location(void) {
+    return frames[frame_count - 1].location;
+}
+
+
+void prof_set_location(prof_location_t location) {
+    frames[frame_count - 1].location = location;
+}
+
+
+static size_t prof_site_hash(const prof_node_t* function, prof_location_t location) {
+    size_t h = (uintptr_t)function / sizeof *function;
+    h = h * 31 + location.line;
+    h = h * 31 + location.column;
+    return h;
+}
+
+
+/* Return the entry of the site table for the site, which is empty if the site is new. */
+static prof_site_t* prof_find_site(prof_site_t* table, size_t size, const prof_node_t* function,
+                                   prof_location_t location) {
+    size_t i = prof_site_hash(function, location) & (size - 1);
+    while (table[i].function != NULL && (table[i].function != function ||
+                                         table[i].location.line != location.line ||
+                                         table[i].location.column != location.column)) {
+        i = (i + 1) & (size - 1);
+    }
+    return &table[i];
+}
+
+
+static void prof_grow_sites(void) {
+    size_t new_size = site_size ? site_size * PROF_GROW : SITES_INIT;
+    prof_site_t* new_sites = gc_calloc(new_size, sizeof *new_sites);
+    for (size_t i = 0; i < site_size; i++) {
+        if (sites[i].function != NULL) {
+            *prof_find_site(new_sites, new_size, sites[i].function, sites[i].location) = sites[i];
+        }
+    }
+    free(sites);
+    sites = new_sites;
+    site_size = new_size;
+}
+
+
+void prof_record_allocation(size_t bytes) {
+    prof_frame_t* frame = &frames[frame_count - 1];
+    frame->node->allocations++;
+    frame->node->allocation_bytes += bytes;
+    if (site_count * 2 >= site_size) {
+        prof_grow_sites();
+    }
+    prof_site_t* site = prof_find_site(sites, site_size, frame->function, frame->location);
+    if (site->function == NULL) {
+        site->function = frame->function;
+        site->location = frame->location;
+        site_count++;
+    }
+    site->allocations++;
+    site->bytes += bytes;
+}
+
+
+/* Order sites by their function's name and location, and then by their own location. */
+static int prof_site_cmp(const void* a, const void* b) {
+    const prof_site_t* x = a;
+    const prof_site_t* y = b;
+    int cmp = strcmp(x->function->name, y->function->name);
+    if (cmp != 0) {
+        return cmp;
+    }
+    unsigned int xs[] = { x->function->line, x->function->column, x->location.line,
+                          x->location.column };
+    unsigned int ys[] = { y->function->line, y->function->column, y->location.line,
+                          y->location.column };
+    for (size_t i = 0; i < sizeof xs / sizeof *xs; i++) {
+        if (xs[i] != ys[i]) {
+            return xs[i] < ys[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+
+static int prof_site_bytes_cmp(const void* a, const void* b) {
+    const prof_site_t* x = a;
+    const prof_site_t* y = b;
+    if (x->bytes != y->bytes) {
+        return x->bytes > y->bytes ? -1 : 1;
+    }
+    return prof_site_cmp(a, b);
+}
+
+
+/* Call enter on every node of the tree before its children, and leave after them. The tree is as
+ * deep as the program's deepest recursion, so it is walked through the parent links instead of
+ * recursively on the C stack.
+ */
+static void prof_walk(void (*enter)(prof_node_t*, void*), void (*leave)(prof_node_t*, void*),
+                      void* data) {
+    prof_node_t* node = &root;
+    for (;;) {
+        enter(node, data);
+        if (node->children != NULL) {
+            node = node->children;
+            continue;
+        }
+        for (;;) {
+            leave(node, data);
+            if (node == &root) {
+                return;
+            } else if (node->sibling != NULL) {
+                node = node->sibling;
+                break;
+            }
+            node = node->parent;
+        }
+    }
+}
+
+
+static void prof_write_name(const prof_node_t* node, FILE* fp) {
+    if (node->line != 0) {
+        fprintf(fp, "%s@%u:%u", node->name, node->line, node->column);
+    } else {
+        fputs(node->name, fp);
+    }
+}
+
+
+void prof_report_allocations(FILE* fp) {
+    prof_site_t* merged = gc_malloc((site_count + 1) * sizeof *merged);
+    size_t n = 0;
+    for (size_t i = 0; i < site_size; i++) {
+        if (sites[i].function != NULL) {
+            merged[n++] = sites[i];
+        }
+    }
+    qsort(merged, n, sizeof *merged, prof_site_cmp);
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (m > 0 && prof_site_cmp(&merged[m - 1], &merged[i]) == 0) {
+            merged[m - 1].allocations += merged[i].allocations;
+            merged[m - 1].bytes += merged[i].bytes;
+        } else {
+            merged[m++] = merged[i];
+        }
+    }
+    qsort(merged, m, sizeof *merged, prof_site_bytes_cmp);
+    fprintf(fp, "%14s %12s  %s\n", "bytes", "objects", "site");
+    for (size_t i = 0; i < m; i++) {
+        fprintf(fp, "%14zu %12zu  ", merged[i].bytes, merged[i].allocations);
+        if (merged[i].location.line != 0) {
+            fprintf(fp, "%u:%u in ", merged[i].location.line, merged[i].location.column);
+        }
+        prof_write_name(merged[i].function, fp);
+        fputc('\n', fp);
+    }
+    free(merged);
+}
+
+
+/* The frames of the stack being written, from the root down, separated by semicolons. */
+typedef struct {
+    char* s;
+    size_t len, size;
+} prof_path_t;
+
+
+static void prof_path_push(prof_path_t* path, const prof_node_t* node) {
+    char name[64];
+    const char* s = node->name;
+    if (node->line != 0) {
+        snprintf(name, sizeof name, "@%u:%u", node->line, node->column);
+    } else {
+        name[0] = '\0';
+    }
+    size_t n = strlen(s) + strlen(name) + 2;
+    if (path->len + n > path->size) {
+        path->size = (path->len + n) * PROF_GROW;
+        path->s = gc_realloc(path->s, path->size);
+    }
+    if (path->len > 0) {
+        path->s[path->len++] = ';';
+    }
+    path->len += sprintf(path->s + path->len, "%s%s", s, name);
+}
+
+
+/* Remove the last frame from the path. Names never contain a semicolon. */
+static void prof_path_pop(prof_path_t* path) {
+    while (path->len > 0 && path->s[--path->len] != ';') {
+    }
+}
+
+
+typedef struct {
+    size_t (*weight)(const prof_node_t*);
+    prof_path_t path;
+    FILE* fp;
+} prof_stacks_t;
+
+
+/* Write a line for every node with a non-zero weight. */
+static void prof_write_enter(prof_node_t* node, void* data) {
+    prof_stacks_t* stacks = data;
+    prof_path_push(&stacks->path, node);
+    if (stacks->weight(node) > 0) {
+        fprintf(stacks->fp, "%s %zu\n", stacks->path.s, stacks->weight(node));
+    }
+}
+
+
+static void prof_write_leave(prof_node_t* node, void* data) {
+    (void)node;
+    prof_path_pop(&((prof_stacks_t*)data)->path);
+}
+
+
+static void prof_write_stacks(size_t (*weight)(const prof_node_t*), FILE* fp) {
+    prof_stacks_t stacks = { weight, { NULL, 0, 0 }, fp };
+    prof_walk(prof_write_enter, prof_write_leave, &stacks);
+    free(stacks.path.s);
+}
+
+
+static size_t prof_allocation_bytes(const prof_node_t* node) {
+    return node->allocation_bytes;
+}
+
+
+static size_t prof_samples(const prof_node_t* node) {
+    return node->samples;
+}
+
+
+void prof_write_allocation_stacks(FILE* fp) {
+    prof_write_stacks(prof_allocation_bytes, fp);
+}
+
+
+void prof_write_sample_stacks(FILE* fp) {
+    prof_write_stacks(prof_samples, fp);
+}
+
+
+/* A function in the report of the samples. A sample counts towards a function's total if the
+ * function is anywhere on the stack, but only once however deep it has recursed.
+ */
+typedef struct {
+    const prof_node_t* node;
+    size_t self;
+    size_t total;
+    size_t active;
+} prof_function_t;
+
+
+typedef struct {
+    prof_node_t** nodes;
+    size_t count, size;
+} prof_nodes_t;
+
+
+static void prof_collect_node(prof_node_t* node, void* data) {
+    prof_nodes_t* nodes = data;
+    if (nodes->count == nodes->size) {
+        nodes->size = nodes->size ? nodes->size * PROF_GROW : FRAMES_INIT;
+        nodes->nodes = gc_realloc(nodes->nodes, nodes->size * sizeof *nodes->nodes);
+    }
+    nodes->nodes[nodes->count++] = node;
+}
+
+
+static void prof_ignore_node(prof_node_t* node, void* data) {
+    (void)node;
+    (void)data;
+}
+
+
+/* Order nodes by their function's name and location. */
+static int prof_node_cmp(const void* a, const void* b) {
+    const prof_node_t* x = *(const prof_node_t* const*)a;
+    const prof_node_t* y = *(const prof_node_t* const*)b;
+    int cmp = strcmp(x->name, y->name);
+    if (cmp != 0) {
+        return cmp;
+    } else if (x->line != y->line) {
+        return x->line < y->line ? -1 : 1;
+    } else if (x->column != y->column) {
+        return x->column < y->column ? -1 : 1;
+    }
+    return 0;
+}
+
+
+/* Add the samples of each node's subtree to their functions. The samples of a subtree are only known
+ * once all of its children have been left.
+ */
+static void prof_add_samples_enter(prof_node_t* node, void* data) {
+    prof_function_t* function = &((prof_function_t*)data)[node->function];
+    function->self += node->samples;
+    function->active++;
+    node->subtree_samples = node->samples;
+}
+
+
+static void prof_add_samples_leave(prof_node_t* node, void* data) {
+    prof_function_t* function = &((prof_function_t*)data)[node->function];
+    if (--function->active == 0) {
+        function->total += node->subtree_samples;
+    }
+    if (node->parent != NULL) {
+        node->parent->subtree_samples += node->subtree_samples;
+    }
+}
+
+
+static int prof_function_cmp(const void* a, const void* b) {
+    const prof_function_t* x = a;
+    const prof_function_t* y = b;
+    if (x->self != y->self) {
+        return x->self > y->self ? -1 : 1;
+    } else if (x->total != y->total) {
+        return x->total > y->total ? -1 : 1;
+    }
+    return prof_node_cmp(&x->node, &y->node);
+}
+
+
+void prof_report_samples(FILE* fp) {
+    prof_nodes_t collected = { NULL, 0, 0 };
+    prof_walk(prof_collect_node, prof_ignore_node, &collected);
+    prof_node_t** nodes = collected.nodes;
+    size_t count = collected.count;
+    qsort(nodes, count, sizeof *nodes, prof_node_cmp);
+    prof_function_t* functions = gc_calloc(count, sizeof *functions);
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (n == 0 || prof_node_cmp(&functions[n - 1].node, &nodes[i]) != 0) {
+            functions[n++].node = nodes[i];
+        }
+        nodes[i]->function = n - 1;
+    }
+    prof_walk(prof_add_samples_enter, prof_add_samples_leave, functions);
+    size_t total = root.subtree_samples;
+    qsort(functions, n, sizeof *functions, prof_function_cmp);
+    fprintf(fp, "%zu samples, one every %d ms of CPU time\n", total, SAMPLE_INTERVAL / 1000);
+    fprintf(fp, "%10s %7s %10s %7s  %s\n", "self", "", "total", "", "function");
+    double percent = total > 0 ? 100.0 / total : 0.0;
+    for (size_t i = 0; i < n && functions[i].total > 0; i++) {
+        fprintf(fp, "%10zu %6.2f%% %10zu %6.2f%%  ", functions[i].self,
+                functions[i].self * percent, functions[i].total, functions[i].total * percent);
+        prof_write_name(functions[i].node, fp);
+        fputc('\n', fp);
+    }
+    free(functions);
+    free(nodes);
+}
+
+
+/* Free the tree a leaf at a time: descending through the first children always reaches a leaf that
+ * is the first child of its parent, so it can be unlinked there.
+ */
+static void prof_free_tree(void) {
+    prof_node_t* node = &root;
+    while (root.children != NULL) {
+        if (node->children != NULL) {
+            node = node->children;
+        } else {
+            prof_node_t* parent = node->parent;
+            parent->children = node->sibling;
+            free(node->name);
+            free(node);
+            node = parent;
+        }
+    }
+}
+
+
+void prof_close(void) {
+    prof_set_sampling(false);
+    prof_profiling = false;
+    prof_allocating = false;
+    current = &root;
+    prof_free_tree();
+    free(frames);
+    frames = NULL;
+    frame_count = frame_size = 0;
+    free(sites);
+    sites = NULL;
+    site_count = site_size = 0;
+}
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "collector.h"
 #include "eval.h"
 #include "scamval.h"
@@ -45,7 +46,28 @@ int is_query(const char*);
 ssize_t get_good_line(char**, size_t*, FILE*, int* line_no);
 
 int main(int argc, char* argv[]) {
-    for (int i = 1; i < argc; i++) {
+    int c;
+    while ((c = getopt(argc, argv, "OrCI:")) != -1) {
+        switch (c) {
+            case 'O':
+                eval_set_vm(true);
+                break;
+            case 'r':
+                eval_set_check_roots(true);
+                break;
+            case 'C':
+                gc_set_concurrent(true);
+                break;
+            case 'I':
+                gc_set_mark_budget(strtoul(optarg, NULL, 10));
+                break;
+            case '?':
+                return 1;
+            default:
+                break;
+        }
+    }
+    for (int i = optind; i < argc; i++) {
         program_state_t ps;
         ps_init(&ps, argv[i]);
         if (!ps.fsock) {
@@ -59,7 +81,7 @@ int main(int argc, char* argv[]) {
             char* correct_str = ScamVal_to_repr(query_value);
             char* this_str = is_query(ps.answer) ? "" : ps.answer;
             if (strcmp(ps.answer, "ERROR") == 0) {
-                ASSERT(query_value->type == SCAM_ERR, ps, "expected error")
+                ASSERT(ScamVal_type(query_value) == SCAM_ERR, ps, "expected error")
             } else {
                 ASSERT_EQ(correct_str, this_str, ps);
             }
@@ -5,12 +5,15 @@
 #include <readline/readline.h>
 #include <readline/history.h>
 #include "collector.h"
+#include "compile.h"
 #include "eval.h"
 #include "parse.h"
+#include "profiler.h"
 
 
 void run_repl(ScamEnv*);
 void run_debug_repl(ScamEnv*);
+void write_profile(const char* fpath, void write(FILE*));
 
 
 int main(int argc, char** argv) {
@@ -18,8 +21,14 @@ int main(int argc, char** argv) {
     char* cvalue = NULL;
     int load_flag = 0;
     int debug_flag = 0;
+    int pause_flag = 0;
+    int stats_flag = 0;
+    int alloc_flag = 0;
+    char* alloc_stacks = NULL;
+    char* sample_report = NULL;
+    char* sample_stacks = NULL;
     int c;
-    while ((c = getopt(argc, argv, "igc:")) != -1) {
+    while ((c = getopt(argc, argv, "igOrpsaA:P:F:CI:m:d:c:")) != -1) {
         switch (c) {
             case 'i':
                 load_flag = 1;
@@ -27,26 +36,71 @@ int main(int argc, char** argv) {
             case 'g':
                 debug_flag = 1;
                 break;
+            case 'O':
+                eval_set_vm(true);
+                break;
+            case 'r':
+                eval_set_check_roots(true);
+                break;
+            case 'p':
+                pause_flag = 1;
+                break;
+            case 's':
+                stats_flag = 1;
+                break;
+            case 'a':
+                alloc_flag = 1;
+                prof_set_allocations(true);
+                break;
+            case 'A':
+                alloc_stacks = optarg;
+                prof_set_allocations(true);
+                break;
+            case 'P':
+                sample_report = optarg;
+                prof_set_sampling(true);
+                break;
+            case 'F':
+                sample_stacks = optarg;
+                prof_set_sampling(true);
+                break;
+            case 'C':
+                gc_set_concurrent(true);
+                break;
+            case 'I':
+                gc_set_mark_budget(strtoul(optarg, NULL, 10));
+                break;
+            case 'm':
+                gc_set_heap_limit(strtoul(optarg, NULL, 10) << 20);
+                break;
+            case 'd':
+                eval_set_max_depth(strtoul(optarg, NULL, 10));
+                break;
             case 'c':
                 cvalue = optarg;
-                ScamVal* v = eval_str(cvalue, env);
-                ScamVal_println(v);
-                return 0;
+                break;
             case '?':
                 return 1;
             default:
                 break;
         }
     }
-    /* Evaluate files. */
-    for (int i = optind; i < argc; i++) {
-        ScamVal* v = eval_file(argv[i], env);
-        if (v->type == SCAM_ERR) {
-            ScamVal_println(v);
-        }
+    if (cvalue != NULL) {
+        /* Evaluate the expression once all the options have taken effect, instead of any files. */
+        ScamVal* v = eval_str(cvalue, env);
+        ScamVal_println(v);
         gc_unset_root(v);
+    } else {
+        /* Evaluate files. */
+        for (int i = optind; i < argc; i++) {
+            ScamVal* v = eval_file(argv[i], env);
+            if (ScamVal_type(v) == SCAM_ERR) {
+                ScamVal_println(v);
+            }
+            gc_unset_root(v);
+        }
     }
-    if (load_flag || debug_flag || argc == 1) {
+    if (cvalue == NULL && (load_flag || debug_flag || argc == 1)) {
         if (debug_flag) {
             run_debug_repl(env);
         } else {
@@ -54,10 +108,38 @@ int main(int argc, char** argv) {
         }
     }
     gc_unset_root((ScamVal*)env);
+    prof_set_sampling(false);
+    if (pause_flag) {
+        gc_report_pauses(stderr);
+    }
+    if (stats_flag) {
+        gc_print_stats(stderr);
+    }
+    if (alloc_flag) {
+        prof_report_allocations(stderr);
+    }
+    write_profile(alloc_stacks, prof_write_allocation_stacks);
+    write_profile(sample_report, prof_report_samples);
+    write_profile(sample_stacks, prof_write_sample_stacks);
+    prof_close();
     gc_close();
     return 0;
 }
 
+/* Write part of the profile to the file, if one was given. */
+void write_profile(const char* fpath, void write(FILE*)) {
+    if (fpath == NULL) {
+        return;
+    }
+    FILE* fp = fopen(fpath, "w");
+    if (fp != NULL) {
+        write(fp);
+        fclose(fp);
+    } else {
+        fprintf(stderr, "Error: unable to open file %s\n", fpath);
+    }
+}
+
 bool non_empty(const char* string) {
     for (; *string != '\0'; string++) {
         if (!isspace(*string)) {
@@ -89,11 +171,12 @@ void run_repl(ScamEnv* env) {
 }
 
 void parse_repl(char*);
+void compile_repl(char*);
 void eval_repl(char*, ScamEnv*);
 
 void print_generic_help(void);
 
-enum { REPL_EVAL, REPL_PARSE };
+enum { REPL_EVAL, REPL_PARSE, REPL_COMPILE };
 void run_debug_repl(ScamEnv* env) {
     int mode = REPL_EVAL;
     print_generic_help();
@@ -101,6 +184,7 @@ void run_debug_repl(ScamEnv* env) {
         switch (mode) {
             case REPL_PARSE: printf("parse"); break;
             case REPL_EVAL: printf("eval"); break;
+            case REPL_COMPILE: printf("compile"); break;
             default: printf("unknown mode"); break;
         }
         char* input = readline(">>> ");
@@ -117,9 +201,13 @@ void run_debug_repl(ScamEnv* env) {
                 mode = REPL_EVAL;
             } else if (strcmp(input, "!parse") == 0) {
                 mode = REPL_PARSE;
+            } else if (strcmp(input, "!compile") == 0) {
+                mode = REPL_COMPILE;
             } else {
                 if (mode == REPL_PARSE) {
                     parse_repl(input);
+                } else if (mode == REPL_COMPILE) {
+                    compile_repl(input);
                 } else if (mode == REPL_EVAL) {
                     eval_repl(input, env);
                 }
@@ -146,6 +234,19 @@ void parse_repl(char* command) {
     }
 }
 
+void compile_repl(char* command) {
+    if (strcmp(command, "help") == 0) {
+        print_generic_help();
+        puts("\nAny input is compiled and its bytecode is printed");
+    } else {
+        ScamSeq* ast = parse_str(command);
+        ScamCode* code = ScamVal_compile((ScamVal*)ast);
+        ScamCode_print(code, 0);
+        gc_unset_root((ScamVal*)code);
+        gc_unset_root((ScamVal*)ast);
+    }
+}
+
 void eval_repl(char* command, ScamEnv* env) {
     if (strcmp(command, "heap") == 0) {
         gc_smart_print();
@@ -153,12 +254,15 @@ void eval_repl(char* command, ScamEnv* env) {
         gc_print();
     } else if (strcmp(command, "collect") == 0) {
         gc_collect();
+    } else if (strcmp(command, "stats") == 0) {
+        gc_print_stats(stdout);
     } else if (strcmp(command, "help") == 0) {
         print_generic_help();
         puts("Evaluator commands:");
         puts("\theap: print some objects in the heap (the interesting ones)");
         puts("\theapall: print all objects in the heap");
         puts("\tcollect: invoke the garbage collector");
+        puts("\tstats: print the garbage collector's counters");
         puts("\nAny other input is evaluated normally and printed");
     } else {
         ScamVal* v = eval_str(command, env);
@@ -172,5 +276,6 @@ void print_generic_help(void) {
     puts("\thelp: print a help message");
     puts("\t!parse: switch to parse mode");
     puts("\t!eval: switch to evaluate mode");
+    puts("\t!compile: switch to compile mode");
     puts("\tquit: exit the program");
 }
@@ -11,17 +11,18 @@ static int ScamVal_numeric_gt(const ScamVal*, const ScamVal*);
 int ScamVal_eq(const ScamVal* v1, const ScamVal* v2) {
     if (ScamVal_typecheck(v1, SCAM_NUM) && ScamVal_typecheck(v2, SCAM_NUM)) {
         return ScamVal_numeric_eq(v1, v2);
-    } else if (v1->type == v2->type) {
-        switch (v1->type) {
+    } else if (ScamVal_type(v1) == ScamVal_type(v2)) {
+        switch (ScamVal_type(v1)) {
             case SCAM_BOOL:
                 return ScamBool_unbox((ScamBool*)v1) == ScamBool_unbox((ScamBool*)v2);
             case SCAM_SEXPR:
             case SCAM_LIST:
                 return ScamSeq_eq((ScamSeq*)v1, (ScamSeq*)v2);
             case SCAM_SYM:
+                /* Symbols are interned. */
+                return v1 == v2;
             case SCAM_STR:
                 return (strcmp(ScamStr_unbox((ScamStr*)v1), ScamStr_unbox((ScamStr*)v2)) == 0);
-            case SCAM_ENV:
             case SCAM_DICT:
                 return ScamDict_eq((ScamDict*)v1, (ScamDict*)v2);
             case SCAM_NULL:
@@ -47,14 +48,14 @@ int ScamVal_gt(const ScamVal* v1, const ScamVal* v2) {
 
 
 static int ScamVal_numeric_eq(const ScamVal* v1, const ScamVal* v2) {
-    if (v1->type == SCAM_INT) {
-        if (v2->type == SCAM_INT) {
+    if (ScamVal_type(v1) == SCAM_INT) {
+        if (ScamVal_type(v2) == SCAM_INT) {
             return ScamInt_unbox((ScamInt*)v1) == ScamInt_unbox((ScamInt*)v2);
         } else {
             return ScamInt_unbox((ScamInt*)v1) == ScamDec_unbox((ScamDec*)v2);
         }
     } else {
-        if (v2->type == SCAM_INT) {
+        if (ScamVal_type(v2) == SCAM_INT) {
             return ScamDec_unbox((ScamDec*)v1) == ScamInt_unbox((ScamInt*)v2);
         } else {
             return ScamDec_unbox((ScamDec*)v1) == ScamDec_unbox((ScamDec*)v2);
@@ -80,12 +81,13 @@ static int ScamSeq_eq(const ScamSeq* v1, const ScamSeq* v2) {
 
 
 static int ScamDict_eq(const ScamDict* v1, const ScamDict* v2) {
-    for (size_t i = 0; i < SCAM_DICT_SIZE; i++) {
-        for (ScamDict_list* p = v1->data[i]; p != NULL; p = p->next) {
-            ScamVal* val2 = ScamDict_lookup(v2, p->key);
-            if (!ScamVal_eq(p->val, val2)) {
-                return 0;
-            }
+    if (ScamDict_len(v1) != ScamDict_len(v2)) {
+        return 0;
+    }
+    for (size_t i = 0; i < ScamDict_len(v1); i++) {
+        ScamVal* val2 = ScamDict_get(v2, ScamDict_key(v1, i));
+        if (val2 == NULL || !ScamVal_eq(ScamDict_val(v1, i), val2)) {
+            return 0;
         }
     }
     return 1;
@@ -93,14 +95,14 @@ static int ScamDict_eq(const ScamDict* v1, const ScamDict* v2) {
 
 
 static int ScamVal_numeric_gt(const ScamVal* v1, const ScamVal* v2) {
-    if (v1->type == SCAM_INT) {
-        if (v2->type == SCAM_INT) {
+    if (ScamVal_type(v1) == SCAM_INT) {
+        if (ScamVal_type(v2) == SCAM_INT) {
             return ScamInt_unbox((ScamInt*)v1) > ScamInt_unbox((ScamInt*)v2);
         } else {
             return ScamInt_unbox((ScamInt*)v1) > ScamDec_unbox((ScamDec*)v2);
         }
     } else {
-        if (v2->type == SCAM_INT) {
+        if (ScamVal_type(v2) == SCAM_INT) {
             return ScamDec_unbox((ScamDec*)v1) > ScamInt_unbox((ScamInt*)v2);
         } else {
             return ScamDec_unbox((ScamDec*)v1) > ScamDec_unbox((ScamDec*)v2);
@@ -1,22 +1,42 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "collector.h"
 #include "scamval.h"
 
 
 static unsigned long long hash_int(long long x);
-static unsigned long long hash_str(const char* str);
 static unsigned long long hash(const ScamVal* v);
-static ScamDict_list* ScamDict_list_new(ScamDict_list* next, ScamVal* key, ScamVal* val);
+static ScamDict_entry* ScamTrie_find(const ScamTrie* node, const ScamVal* key, size_t hashval);
+static ScamTrie* ScamTrie_insert(ScamDict* dct, ScamTrie* node, unsigned int shift,
+                                 const ScamDict_entry* entry, bool* added);
+static void ScamDict_order(ScamDict* dct);
+
+
+/* Every dictionary gets a new edit number when it is created, and whenever its nodes become shared
+ * with another one, so that it no longer changes them in place.
+ */
+static size_t next_edit = 1;
 
 
 ScamDict* ScamDict_new() {
     SCAMVAL_NEW(ret, ScamDict, SCAM_DICT);
     ret->len = 0;
-    for (size_t i = 0; i < SCAM_DICT_SIZE; i++) {
-        ret->data[i] = NULL;
-    }
+    ret->edit = next_edit++;
+    ret->next_order = 0;
+    ret->trie = NULL;
+    ret->ordered = NULL;
+    return ret;
+}
+
+
+ScamDict* ScamDict_copy(ScamDict* dct) {
+    ScamDict* ret = ScamDict_new();
+    ret->len = dct->len;
+    ret->next_order = dct->next_order;
+    ret->trie = dct->trie;
+    dct->edit = next_edit++;
     return ret;
 }
 
@@ -24,9 +44,54 @@ ScamDict* ScamDict_new() {
 ScamEnv* ScamEnv_new(ScamEnv* enclosing) {
     SCAMVAL_NEW(ret, ScamEnv, SCAM_ENV);
     ret->enclosing = enclosing;
-    ret->len = 0;
-    for (size_t i = 0; i < SCAM_DICT_SIZE; i++) {
-        ret->data[i] = NULL;
+    ret->nslots = 0;
+    ret->slots = NULL;
+    ret->slot_names = NULL;
+    /* names must be valid before the next allocation, in case it invokes the collector. */
+    ret->names = NULL;
+    ScamDict* names = ScamDict_new();
+    gc_unset_root((ScamVal*)names);
+    gc_lock();
+    ret->names = names;
+    gc_write_barrier((ScamVal*)ret, (ScamVal*)names);
+    gc_unlock();
+    return ret;
+}
+
+
+ScamVal* ScamDict_from_pairs(const ScamSeq* pairs) {
+    for (size_t i = 0; i < ScamSeq_len(pairs); i++) {
+        enum ScamType type = ScamVal_type(ScamSeq_get(pairs, i));
+        if (type != SCAM_LIST) {
+            return (ScamVal*)ScamErr_type("dict", i, type, SCAM_LIST);
+        }
+    }
+    ScamDict* ret = ScamDict_new();
+    for (size_t i = 0; i < ScamSeq_len(pairs); i++) {
+        ScamSeq* pair = (ScamSeq*)ScamSeq_get(pairs, i);
+        if (ScamSeq_len(pair) == 2) {
+            ScamDict_insert(ret, ScamSeq_get(pair, 0), ScamSeq_get(pair, 1));
+        } else {
+            gc_unset_root((ScamVal*)ret);
+            return (ScamVal*)ScamErr_new("'dict' expects each argument to be a pair");
+        }
+    }
+    return (ScamVal*)ret;
+}
+
+
+ScamEnv* ScamEnv_frame(ScamEnv* enclosing, ScamSeq* slot_names) {
+    SCAMVAL_NEW(ret, ScamEnv, SCAM_ENV);
+    ret->enclosing = enclosing;
+    ret->names = NULL;
+    ret->slot_names = slot_names;
+    ret->nslots = 0;
+    ret->slots = NULL;
+    size_t n = ScamSeq_len(slot_names);
+    if (n > 0) {
+        ret->slots = gc_alloc_block(n * sizeof *ret->slots);
+        memset(ret->slots, 0, n * sizeof *ret->slots);
+        ret->nslots = n;
     }
     return ret;
 }
@@ -35,10 +100,10 @@ ScamEnv* ScamEnv_new(ScamEnv* enclosing) {
 ScamDict* ScamDict_from(size_t n, ...) {
     va_list vlist;
     va_start(vlist, n);
-    ScamDict* ret = ScamDict_new(NULL);
+    ScamDict* ret = ScamDict_new();
     for (size_t i = 0; i < n; i++) {
         ScamSeq* key_val_pair = (ScamSeq*)va_arg(vlist, ScamVal*);
-        if (key_val_pair->type == SCAM_LIST && ScamSeq_len(key_val_pair) == 2) {
+        if (ScamVal_type(key_val_pair) == SCAM_LIST && ScamSeq_len(key_val_pair) == 2) {
             ScamVal* key = ScamSeq_get(key_val_pair, 0);
             ScamVal* val = ScamSeq_get(key_val_pair, 1);
             ScamDict_insert(ret, key, val);
@@ -62,64 +127,334 @@ size_t ScamDict_len(const ScamDict* dct) {
 }
 
 
+ScamVal* ScamDict_key(const ScamDict* dct, size_t i) {
+    if (dct->ordered == NULL) {
+        ScamDict_order((ScamDict*)dct);
+    }
+    return dct->ordered[i].key;
+}
+
+
+ScamVal* ScamDict_val(const ScamDict* dct, size_t i) {
+    if (dct->ordered == NULL) {
+        ScamDict_order((ScamDict*)dct);
+    }
+    return dct->ordered[i].val;
+}
+
+
 void ScamDict_insert(ScamDict* dct, ScamVal* sym, ScamVal* val) {
-    if (sym->type != SCAM_STR && sym->type != SCAM_SYM && sym->type != SCAM_INT) {
+    if (ScamVal_type(sym) != SCAM_STR && ScamVal_type(sym) != SCAM_SYM && ScamVal_type(sym) != SCAM_INT) {
         /* Unbindable types (for now) */
         return;
-        /*return ScamErr_new("cannot bind type '%s'", scamtype_name(sym->type));*/
-    }
-    size_t hashval = hash(sym) % SCAM_DICT_SIZE;
-    ScamDict_list* head = dct->data[hashval];
-    for (ScamDict_list* p = head; p != NULL; p = p->next) {
-        if (ScamVal_eq(sym, p->key)) {
-            gc_unset_root((ScamVal*)val);
-            p->val = val;
-            return;
-        }
+        /*return ScamErr_new("cannot bind type '%s'", scamtype_name(ScamVal_type(sym)));*/
     }
+    /* Neither may be changed in place any more, least of all a key, whose hash is cached. */
+    ScamVal_share(sym);
+    ScamVal_share(val);
+    ScamDict_entry entry = { sym, val, hash(sym), dct->next_order };
+    bool added = false;
+    /* The key and the value stay rooted until the dictionary refers to them, since making nodes
+     * may invoke the collector.
+     */
+    ScamTrie* trie = ScamTrie_insert(dct, dct->trie, 0, &entry, &added);
+    gc_lock();
+    if (trie != dct->trie) {
+        dct->trie = trie;
+        gc_write_barrier((ScamVal*)dct, (ScamVal*)trie);
+    }
+    gc_free_block(dct->ordered, dct->len * sizeof *dct->ordered);
+    dct->ordered = NULL;
+    if (added) {
+        dct->len++;
+        dct->next_order++;
+    }
+    gc_unlock();
     /* The dictionary takes responsibility for the deallocation of the key and value from now on. */
+    gc_unset_root((ScamVal*)trie);
     gc_unset_root((ScamVal*)sym);
     gc_unset_root((ScamVal*)val);
-    dct->data[hashval] = ScamDict_list_new(head, sym, val);
-    dct->len++;
+}
+
+
+ScamDict* ScamDict_bind(ScamDict* dct, ScamVal* sym, ScamVal* val) {
+    ScamDict* ret = ScamDict_copy(dct);
+    ScamDict_insert(ret, sym, val);
+    return ret;
 }
 
 
 void ScamEnv_insert(ScamEnv* env, ScamStr* key, ScamVal* val) {
-    ScamDict_insert((ScamDict*)env, (ScamVal*)key, val);
+    if (env->names == NULL) {
+        ScamDict* names = ScamDict_new();
+        gc_unset_root((ScamVal*)names);
+        gc_lock();
+        env->names = names;
+        gc_write_barrier((ScamVal*)env, (ScamVal*)names);
+        gc_unlock();
+    }
+    ScamDict_insert(env->names, (ScamVal*)key, val);
+}
+
+
+ScamVal* ScamDict_get(const ScamDict* dct, const ScamVal* key) {
+    ScamDict_entry* entry = ScamTrie_find(dct->trie, key, hash(key));
+    return entry != NULL ? entry->val : NULL;
 }
 
 
 ScamVal* ScamDict_lookup(const ScamDict* dct, const ScamVal* key) {
-    size_t hashval = hash(key) % SCAM_DICT_SIZE;
-    for (ScamDict_list* p = dct->data[hashval]; p != NULL; p = p->next) {
-        if (ScamVal_eq(key, p->key)) {
-            return p->val;
+    ScamVal* val = ScamDict_get(dct, key);
+    return val != NULL ? val : (ScamVal*)ScamErr_new("key not in dictionary");
+}
+
+
+ScamVal* ScamEnv_get(const ScamEnv* env, const ScamStr* key) {
+    for (; env != NULL; env = ScamEnv_enclosing(env)) {
+        /* Search backwards, so that later parameters shadow earlier ones of the same name. */
+        for (size_t i = env->nslots; i-- > 0; ) {
+            if (env->slots[i] != NULL && ScamSeq_get(env->slot_names, i) == (const ScamVal*)key) {
+                return env->slots[i];
+            }
+        }
+        if (env->names != NULL) {
+            ScamVal* val = ScamDict_get(env->names, (const ScamVal*)key);
+            if (val != NULL) {
+                return val;
+            }
         }
     }
-    return (ScamVal*)ScamErr_new("key not in dictionary");
+    return NULL;
 }
 
 
 ScamVal* ScamEnv_lookup(const ScamEnv* env, const ScamStr* key) {
-    ScamVal* val = ScamDict_lookup((ScamDict*)env, (const ScamVal*)key);
-    if (val->type != SCAM_ERR) {
+    ScamVal* val = ScamEnv_get(env, key);
+    if (val != NULL) {
+        /* The variable still refers to the value. */
+        ScamVal_share(val);
         return val;
+    }
+    return (ScamVal*)ScamErr_new("unbound variable '%s'", ScamStr_unbox((ScamStr*)key));
+}
+
+
+void ScamDict_free_table(ScamDict* dct) {
+    gc_free_block(dct->ordered, dct->len * sizeof *dct->ordered);
+}
+
+
+void ScamTrie_free(ScamTrie* node) {
+    gc_free_block(node->slots, node->count * sizeof *node->slots);
+}
+
+
+/* Each level of the trie branches on TRIE_BITS bits of the hash. Past the last level, which may
+ * have fewer, the hashes of all the keys in a node are the same.
+ */
+enum { TRIE_BITS = 5, TRIE_BRANCHES = 1 << TRIE_BITS, HASH_BITS = 8 * sizeof(size_t) };
+
+static uint32_t trie_bit(size_t hashval, unsigned int shift) {
+    return (uint32_t)1 << ((hashval >> shift) & (TRIE_BRANCHES - 1));
+}
+
+
+/* Return the position among a node's slots of the branch for the given bit. */
+static unsigned int trie_index(const ScamTrie* node, uint32_t bit) {
+    return __builtin_popcount(node->bitmap & (bit - 1));
+}
+
+
+static bool entry_matches(const ScamDict_entry* entry, const ScamVal* key, size_t hashval) {
+    return entry->hash == hashval && (entry->key == key || ScamVal_eq(key, entry->key));
+}
+
+
+/* Return the entry with the given key in the trie, or NULL if there is none. */
+static ScamDict_entry* ScamTrie_find(const ScamTrie* node, const ScamVal* key, size_t hashval) {
+    for (unsigned int shift = 0; node != NULL; shift += TRIE_BITS) {
+        if (shift >= HASH_BITS) {
+            for (unsigned int i = 0; i < node->count; i++) {
+                if (entry_matches(&node->slots[i], key, hashval)) {
+                    return &node->slots[i];
+                }
+            }
+            return NULL;
+        }
+        uint32_t bit = trie_bit(hashval, shift);
+        if (!(node->bitmap & bit)) {
+            return NULL;
+        }
+        ScamDict_entry* slot = &node->slots[trie_index(node, bit)];
+        if (slot->key != NULL) {
+            return entry_matches(slot, key, hashval) ? slot : NULL;
+        }
+        node = (const ScamTrie*)slot->val;
+    }
+    return NULL;
+}
+
+
+/* Initialize a node with the given slots, which the dictionary may change in place. */
+static ScamTrie* ScamTrie_new(const ScamDict* dct, uint32_t bitmap, unsigned int count,
+                              const ScamDict_entry* slots) {
+    SCAMVAL_NEW(ret, ScamTrie, SCAM_TRIE);
+    ret->bitmap = bitmap;
+    ret->edit = dct->edit;
+    ret->slots = gc_alloc_block(count * sizeof *ret->slots);
+    memcpy(ret->slots, slots, count * sizeof *ret->slots);
+    ret->count = count;
+    return ret;
+}
+
+
+/* Return the node itself if the dictionary may change it in place, and otherwise a copy that it
+ * may change.
+ */
+static ScamTrie* ScamTrie_editable(const ScamDict* dct, ScamTrie* node) {
+    if (node->edit == dct->edit) {
+        return node;
+    }
+    return ScamTrie_new(dct, node->bitmap, node->count, node->slots);
+}
+
+
+static void ScamTrie_set(ScamTrie* node, unsigned int i, const ScamDict_entry* entry) {
+    gc_lock();
+    node->slots[i] = *entry;
+    gc_write_barrier((ScamVal*)node, entry->key);
+    gc_write_barrier((ScamVal*)node, entry->val);
+    gc_unlock();
+}
+
+
+/* Add a slot for a new entry at position i of a node that the dictionary may change. */
+static void ScamTrie_add(ScamTrie* node, unsigned int i, uint32_t bit, const ScamDict_entry* entry) {
+    gc_lock();
+    node->slots = gc_realloc_block(node->slots, node->count * sizeof *node->slots,
+                                   (node->count + 1) * sizeof *node->slots);
+    memmove(node->slots + i + 1, node->slots + i, (node->count - i) * sizeof *node->slots);
+    node->slots[i] = *entry;
+    node->count++;
+    node->bitmap |= bit;
+    gc_write_barrier((ScamVal*)node, entry->key);
+    gc_write_barrier((ScamVal*)node, entry->val);
+    gc_unlock();
+}
+
+
+/* Return a new subtrie, starting at the given level, with two entries whose keys are different. */
+static ScamTrie* ScamTrie_pair(const ScamDict* dct, unsigned int shift, const ScamDict_entry* a,
+                               const ScamDict_entry* b) {
+    if (shift >= HASH_BITS) {
+        ScamDict_entry slots[2] = { *a, *b };
+        return ScamTrie_new(dct, 0, 2, slots);
+    }
+    uint32_t bit_a = trie_bit(a->hash, shift);
+    uint32_t bit_b = trie_bit(b->hash, shift);
+    if (bit_a == bit_b) {
+        ScamTrie* child = ScamTrie_pair(dct, shift + TRIE_BITS, a, b);
+        ScamDict_entry slot = { NULL, (ScamVal*)child, 0, 0 };
+        ScamTrie* ret = ScamTrie_new(dct, bit_a, 1, &slot);
+        gc_unset_root((ScamVal*)child);
+        return ret;
+    } else if (bit_a < bit_b) {
+        ScamDict_entry slots[2] = { *a, *b };
+        return ScamTrie_new(dct, bit_a | bit_b, 2, slots);
+    } else {
+        ScamDict_entry slots[2] = { *b, *a };
+        return ScamTrie_new(dct, bit_a | bit_b, 2, slots);
+    }
+}
+
+
+/* Insert the entry into the subtrie that starts at the given level, and return the node to replace
+ * it with: the same node if it was changed in place, and otherwise a new one, which is a root. An
+ * existing key keeps its place in the order.
+ */
+static ScamTrie* ScamTrie_insert(ScamDict* dct, ScamTrie* node, unsigned int shift,
+                                 const ScamDict_entry* entry, bool* added) {
+    if (node == NULL) {
+        *added = true;
+        return ScamTrie_new(dct, trie_bit(entry->hash, 0), 1, entry);
+    }
+    if (shift >= HASH_BITS) {
+        for (unsigned int i = 0; i < node->count; i++) {
+            if (entry_matches(&node->slots[i], entry->key, entry->hash)) {
+                ScamDict_entry updated = { node->slots[i].key, entry->val, entry->hash,
+                                           node->slots[i].order };
+                node = ScamTrie_editable(dct, node);
+                ScamTrie_set(node, i, &updated);
+                return node;
+            }
+        }
+        *added = true;
+        node = ScamTrie_editable(dct, node);
+        ScamTrie_add(node, node->count, 0, entry);
+        return node;
+    }
+    uint32_t bit = trie_bit(entry->hash, shift);
+    unsigned int i = trie_index(node, bit);
+    if (!(node->bitmap & bit)) {
+        *added = true;
+        node = ScamTrie_editable(dct, node);
+        ScamTrie_add(node, i, bit, entry);
+        return node;
+    }
+    ScamDict_entry slot = node->slots[i];
+    if (slot.key == NULL) {
+        ScamTrie* child = ScamTrie_insert(dct, (ScamTrie*)slot.val, shift + TRIE_BITS, entry, added);
+        if (child != (ScamTrie*)slot.val) {
+            slot.val = (ScamVal*)child;
+            node = ScamTrie_editable(dct, node);
+            ScamTrie_set(node, i, &slot);
+            gc_unset_root((ScamVal*)child);
+        }
+        return node;
+    } else if (entry_matches(&slot, entry->key, entry->hash)) {
+        slot.val = entry->val;
+        node = ScamTrie_editable(dct, node);
+        ScamTrie_set(node, i, &slot);
+        return node;
     } else {
-        if (ScamEnv_enclosing(env) != NULL) {
-            return ScamEnv_lookup(ScamEnv_enclosing(env), key);
+        *added = true;
+        ScamTrie* child = ScamTrie_pair(dct, shift + TRIE_BITS, &slot, entry);
+        ScamDict_entry branch = { NULL, (ScamVal*)child, 0, 0 };
+        node = ScamTrie_editable(dct, node);
+        ScamTrie_set(node, i, &branch);
+        gc_unset_root((ScamVal*)child);
+        return node;
+    }
+}
+
+
+static void ScamTrie_collect(const ScamTrie* node, ScamDict_entry** out) {
+    for (unsigned int i = 0; i < node->count; i++) {
+        if (node->slots[i].key == NULL) {
+            ScamTrie_collect((const ScamTrie*)node->slots[i].val, out);
         } else {
-            return (ScamVal*)ScamErr_new("unbound variable '%s'", ScamStr_unbox((ScamStr*)key));
+            *(*out)++ = node->slots[i];
         }
     }
 }
 
 
-void ScamDict_list_free(ScamDict_list* p) {
-    if (p) {
-        ScamDict_list_free(p->next);
-        free(p);
+static int compare_order(const void* a, const void* b) {
+    size_t order_a = ((const ScamDict_entry*)a)->order;
+    size_t order_b = ((const ScamDict_entry*)b)->order;
+    return (order_a > order_b) - (order_a < order_b);
+}
+
+
+/* Gather the entries of the dictionary in the order they were inserted. */
+static void ScamDict_order(ScamDict* dct) {
+    ScamDict_entry* ordered = gc_alloc_block(dct->len * sizeof *ordered);
+    ScamDict_entry* end = ordered;
+    if (dct->trie != NULL) {
+        ScamTrie_collect(dct->trie, &end);
     }
+    qsort(ordered, dct->len, sizeof *ordered, compare_order);
+    dct->ordered = ordered;
 }
 
 
@@ -132,33 +467,15 @@ static unsigned long long hash_int(long long x) {
 }
 
 
-enum { HASH_MULTIPLIER = 31 };
-static unsigned long long hash_str(const char* str) {
-    /* This function is lightly adapted from section 2.9 of The Practice of Programming, by Brian
-     * Kernighan and Rob Pike.
-     */
-    unsigned long long h = 0;
-    for (const unsigned char* p = (const unsigned char*)str; *p != '\0'; p++) {
-        h = HASH_MULTIPLIER*h + *p;
-    }
-    return h;
-}
-
 static unsigned long long hash(const ScamVal* v) {
-    if (v->type == SCAM_INT) {
+    if (ScamVal_type(v) == SCAM_INT) {
         return hash_int(ScamInt_unbox((ScamInt*)v));
-    } else if (v->type == SCAM_STR) {
-        return hash_str(ScamStr_unbox((ScamStr*)v));
+    } else if (ScamVal_type(v) == SCAM_STR) {
+        return scamstr_hash(ScamStr_unbox((ScamStr*)v));
+    } else if (ScamVal_type(v) == SCAM_SYM) {
+        return ((ScamStr*)v)->hash;
     } else {
         /* Should have a better return value here... */
         return 0;
     }
 }
-
-static ScamDict_list* ScamDict_list_new(ScamDict_list* next, ScamVal* key, ScamVal* val) {
-    ScamDict_list* ret = gc_malloc(sizeof *ret);
-    ret->next = next;
-    ret->key = key;
-    ret->val = val;
-    return ret;
-}
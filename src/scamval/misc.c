@@ -13,24 +13,29 @@ static void ScamDict_write(const ScamDict* v, FILE* fp);
 ScamFunction* ScamFunction_new(ScamEnv* env, ScamSeq* parameters, ScamSeq* body) {
     SCAMVAL_NEW(ret, ScamFunction, SCAM_FUNCTION);
     ret->env = env;
+    ret->name = NULL;
     ret->parameters = parameters;
     ret->body = body;
+    ret->code = NULL;
     return ret;
 }
 
 
-ScamBuiltin* ScamBuiltin_new(scambuiltin_fun bltin) {
-    SCAMVAL_NEW(ret, ScamBuiltin, SCAM_BUILTIN);
-    ret->fun = bltin;
-    ret->constant = false;
+ScamFunction* ScamFunction_compiled(ScamEnv* env, ScamSeq* parameters, ScamSeq* body,
+                                    ScamCode* code) {
+    ScamFunction* ret = ScamFunction_new(env, parameters, body);
+    ret->code = code;
     return ret;
 }
 
 
-ScamBuiltin* ScamBuiltin_new_const(scambuiltin_fun bltin) {
+ScamBuiltin* ScamBuiltin_new(const char* name, scambuiltin_fun bltin, const char* modes) {
     SCAMVAL_NEW(ret, ScamBuiltin, SCAM_BUILTIN);
     ret->fun = bltin;
-    ret->constant = true;
+    /* An empty string would leave no mode for the arguments past its end. */
+    ret->modes = modes[0] != '\0' ? modes : "b";
+    ret->nmodes = strlen(ret->modes);
+    ret->name = name;
     return ret;
 }
 
@@ -43,9 +48,11 @@ ScamPort* ScamPort_new(FILE* fp) {
 }
 
 
+/* Like the booleans, null is a single object outside of the collector's heap. */
+static ScamVal scam_null = { .type = SCAM_NULL, .old = true, .permanent = true };
+
 ScamVal* ScamNull_new(void) {
-    SCAMVAL_NEW(ret, ScamVal, SCAM_NULL);
-    return ret;
+    return &scam_null;
 }
 
 
@@ -55,12 +62,32 @@ size_t ScamFunction_nparams(const ScamFunction* f) {
 
 
 ScamStr* ScamFunction_param(const ScamFunction* f, size_t i) {
-    return (ScamStr*)gc_copy_ScamVal(ScamSeq_get(f->parameters, i));
+    return (ScamStr*)ScamSeq_get(f->parameters, i);
 }
 
 
 ScamSeq* ScamFunction_body(const ScamFunction* f) {
-    return (ScamSeq*)gc_copy_ScamVal((ScamVal*)f->body);
+    return f->body;
+}
+
+
+void ScamFunction_set_name(ScamFunction* f, ScamStr* name) {
+    if (f->name == NULL) {
+        gc_lock();
+        f->name = name;
+        gc_write_barrier((ScamVal*)f, (ScamVal*)name);
+        gc_unlock();
+    }
+}
+
+
+ScamStr* ScamFunction_name(const ScamFunction* f) {
+    return f->name;
+}
+
+
+ScamCode* ScamFunction_code(const ScamFunction* f) {
+    return f->code;
 }
 
 
@@ -79,8 +106,13 @@ scambuiltin_fun ScamBuiltin_function(const ScamBuiltin* f) {
 }
 
 
-int ScamBuiltin_is_const(const ScamBuiltin* f) {
-    return f->constant;
+enum ScamArgMode ScamBuiltin_arg_mode(const ScamBuiltin* f, size_t i) {
+    return f->modes[i < f->nmodes ? i : f->nmodes - 1];
+}
+
+
+const char* ScamBuiltin_name(const ScamBuiltin* f) {
+    return f->name;
 }
 
 
@@ -101,7 +133,7 @@ void ScamPort_set_status(ScamPort* v, int new_status) {
 
 void ScamVal_write(const ScamVal* v, FILE* fp) {
     if (!v) return;
-    switch (v->type) {
+    switch (ScamVal_type(v)) {
         case SCAM_INT:
             fprintf(fp, "%lli", ScamInt_unbox((ScamInt*)v));
             break;
@@ -126,6 +158,9 @@ void ScamVal_write(const ScamVal* v, FILE* fp) {
         case SCAM_PORT:
             fprintf(fp, "<Scam port>");
             break;
+        case SCAM_CODE:
+            fprintf(fp, "<Scam code>");
+            break;
         case SCAM_STR:
             ScamStr_write((ScamStr*)v, fp);
             break;
@@ -135,10 +170,12 @@ void ScamVal_write(const ScamVal* v, FILE* fp) {
         case SCAM_ERR:
             fprintf(fp, "Error: %s", ScamStr_unbox((ScamStr*)v));
             break;
-        case SCAM_ENV:
         case SCAM_DICT:
             ScamDict_write((ScamDict*)v, fp);
             break;
+        case SCAM_ENV:
+            fprintf(fp, "<Scam environment>");
+            break;
         default:
             break;
     }
@@ -176,18 +213,14 @@ static void ScamSeq_write(const ScamSeq* seq, const char* start, const char* mid
 
 
 static void ScamDict_write(const ScamDict* dct, FILE* fp) {
-    size_t remaining = ScamDict_len(dct);
     fputc('{', fp);
-    for (size_t i = 0; i < SCAM_DICT_SIZE && remaining > 0; i++) {
-        for (ScamDict_list* p = dct->data[i]; p != NULL; p = p->next) {
-            ScamVal_write(p->key, fp);
-            fputc(':', fp);
-            ScamVal_write(p->val, fp);
-            remaining--;
-            if (remaining > 0) {
-                fputc(' ', fp);
-            }
+    for (size_t i = 0; i < ScamDict_len(dct); i++) {
+        if (i > 0) {
+            fputc(' ', fp);
         }
+        ScamVal_write(ScamDict_key(dct, i), fp);
+        fputc(':', fp);
+        ScamVal_write(ScamDict_val(dct, i), fp);
     }
     fputc('}', fp);
 }
@@ -195,7 +228,7 @@ static void ScamDict_write(const ScamDict* dct, FILE* fp) {
 
 char* ScamVal_to_str(const ScamVal* v) {
     if (!v) return NULL;
-    if (v->type == SCAM_STR) {
+    if (ScamVal_type(v) == SCAM_STR) {
         return strdup(ScamStr_unbox((ScamStr*)v));
     } else {
         return ScamVal_to_repr(v);
@@ -215,13 +248,13 @@ char* ScamVal_to_repr(const ScamVal* v) {
 
 
 void ScamVal_print(const ScamVal* v) {
-    if (!v || v->type == SCAM_NULL) return;
+    if (!v || ScamVal_type(v) == SCAM_NULL) return;
     ScamVal_write(v, stdout);
 }
 
 
 void ScamVal_println(const ScamVal* v) {
-    if (!v || v->type == SCAM_NULL) return;
+    if (!v || ScamVal_type(v) == SCAM_NULL) return;
     ScamVal_print(v);
     printf("\n");
 }
@@ -229,47 +262,76 @@ void ScamVal_println(const ScamVal* v) {
 
 void ScamVal_print_debug(const ScamVal* v) {
     ScamVal_print(v);
-    printf(" (%s)", scamtype_debug_name(v->type));
+    printf(" (%s)", scamtype_debug_name(ScamVal_type(v)));
 }
 
 
 void ScamVal_print_ast(const ScamVal* ast, int indent) {
     for (int i = 0; i < indent; i++)
         printf("  ");
-    if (ast->type == SCAM_SEXPR) {
+    if (ScamVal_type(ast) == SCAM_SEXPR) {
         size_t n = ScamSeq_len((ScamSeq*)ast);
         if (n == 0) {
-            printf("EMPTY EXPR%s\n", ast->is_root ? " (root)" : "");
+            printf("EMPTY EXPR%s\n", gc_is_root(ast) ? " (root)" : "");
         } else {
-            printf("EXPR%s\n", ast->is_root ? " (root)" : "");
+            printf("EXPR%s\n", gc_is_root(ast) ? " (root)" : "");
             for (size_t i = 0; i < ScamSeq_len((ScamSeq*)ast); i++) {
                 ScamVal_print_ast(ScamSeq_get((ScamSeq*)ast, i), indent + 1);
             }
         }
     } else {
         ScamVal_print(ast);
-        printf("%s\n", ast->is_root ? " (root)" : "");
+        printf("%s\n", gc_is_root(ast) ? " (root)" : "");
+    }
+}
+
+
+bool ScamVal_is_owned(const ScamVal* v) {
+    return !ScamVal_is_immediate(v) && v->owned;
+}
+
+
+void ScamVal_share(ScamVal* v) {
+    /* Check first, so that the shared objects outside the heap are never written to. */
+    if (ScamVal_is_owned(v)) {
+        v->owned = false;
     }
 }
 
 
+ScamVal* ScamVal_own(ScamVal* v) {
+    ScamVal* ret;
+    switch (ScamVal_type(v)) {
+        case SCAM_LIST:
+            ret = ScamVal_is_owned(v) ? v : (ScamVal*)ScamSeq_copy((ScamSeq*)v);
+            break;
+        case SCAM_STR:
+            ret = ScamVal_is_owned(v) ? v : (ScamVal*)ScamStr_copy((ScamStr*)v);
+            break;
+        default:
+            return v;
+    }
+    ret->owned = true;
+    return ret;
+}
+
+
 int ScamVal_typecheck(const ScamVal* v, enum ScamType type) {
     switch (type) {
         case SCAM_ANY:
             return 1;
         case SCAM_SEQ:
-            return v->type == SCAM_LIST || v->type == SCAM_STR;
+            return ScamVal_type(v) == SCAM_LIST || ScamVal_type(v) == SCAM_STR;
         case SCAM_CONTAINER:
-            return v->type == SCAM_LIST || v->type == SCAM_STR || v->type == SCAM_DICT ||
-                   v->type == SCAM_ENV;
+            return ScamVal_type(v) == SCAM_LIST || ScamVal_type(v) == SCAM_STR || ScamVal_type(v) == SCAM_DICT;
         case SCAM_NUM:
-            return v->type == SCAM_INT || v->type == SCAM_DEC;
+            return ScamVal_type(v) == SCAM_INT || ScamVal_type(v) == SCAM_DEC;
         case SCAM_CMP:
-            return v->type == SCAM_STR || v->type == SCAM_INT || v->type == SCAM_DEC;
+            return ScamVal_type(v) == SCAM_STR || ScamVal_type(v) == SCAM_INT || ScamVal_type(v) == SCAM_DEC;
         case SCAM_BASE_FUNCTION:
-            return v->type == SCAM_FUNCTION || v->type == SCAM_BUILTIN;
+            return ScamVal_type(v) == SCAM_FUNCTION || ScamVal_type(v) == SCAM_BUILTIN;
         default:
-            return v->type == type;
+            return ScamVal_type(v) == type;
     }
 }
 
@@ -285,7 +347,7 @@ int is_seq_type(enum ScamType type) {
 
 
 int is_container_type(enum ScamType type) {
-    return type == SCAM_LIST || type == SCAM_STR || type == SCAM_DICT || type == SCAM_ENV;
+    return type == SCAM_LIST || type == SCAM_STR || type == SCAM_DICT;
 }
 
 
@@ -307,9 +369,9 @@ enum ScamType narrowest_type(enum ScamType type1, enum ScamType type2) {
 enum ScamType ScamSeq_narrowest_type(ScamSeq* args) {
     size_t n = ScamSeq_len(args);
     if (n == 0) return SCAM_ANY;
-    int type_so_far = ScamSeq_get(args, 0)->type;
+    int type_so_far = ScamVal_type(ScamSeq_get(args, 0));
     for (size_t i = 1; i < n; i++) {
-        type_so_far = narrowest_type(ScamSeq_get(args, i)->type, type_so_far);
+        type_so_far = narrowest_type(ScamVal_type(ScamSeq_get(args, i)), type_so_far);
     }
     return type_so_far;
 }
@@ -3,6 +3,11 @@
 
 
 ScamInt* ScamInt_new(long long n) {
+    long long shifted = (long long)((unsigned long long)n << 1);
+    if ((shifted >> 1) == n) {
+        return (ScamInt*)(uintptr_t)(shifted | 1);
+    }
+    /* Integers that need all 64 bits are allocated as usual. */
     SCAMVAL_NEW(ret, ScamInt, SCAM_INT);
     ret->n = n;
     return ret;
@@ -16,15 +21,23 @@ ScamDec* ScamDec_new(double d) {
 }
 
 
+/* These are never collected, and they are flagged as old and permanent so that the collector never
+ * looks inside.
+ */
+static ScamBool scam_true = { .type = SCAM_BOOL, .old = true, .permanent = true, .b = true };
+static ScamBool scam_false = { .type = SCAM_BOOL, .old = true, .permanent = true, .b = false };
+
 ScamBool* ScamBool_new(bool b) {
-    SCAMVAL_NEW(ret, ScamBool, SCAM_BOOL);
-    ret->b = b;
-    return ret;
+    return b ? &scam_true : &scam_false;
 }
 
 
 long long ScamInt_unbox(const ScamInt* v) {
-    return v->n;
+    if (ScamVal_is_immediate(v)) {
+        return (long long)(intptr_t)v >> 1;
+    } else {
+        return v->n;
+    }
 }
 
 
@@ -34,9 +47,9 @@ bool ScamBool_unbox(const ScamBool* v) {
 
 
 double ScamDec_unbox(const ScamDec* v) {
-    if (v->type == SCAM_DEC) {
+    if (ScamVal_type(v) == SCAM_DEC) {
         return ((ScamDec*)v)->d;
     } else {
-        return ((ScamInt*)v)->n;
+        return ScamInt_unbox((ScamInt*)v);
     }
 }
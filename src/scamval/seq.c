@@ -1,4 +1,5 @@
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include "collector.h"
 #include "scamval.h"
@@ -10,17 +11,26 @@ static ScamSeq* ScamSeq_new_from(int type, size_t n, va_list vlist);
 /* Grow the size of the sequence in memory so that it is at least the given minimum size, and
  * possibly larger.
  */
-static void ScamSeq_grow(ScamSeq* seq, size_t min_new_sz);
+static bool ScamSeq_grow(ScamSeq* seq, size_t min_new_sz);
 /* Unlike ScamSeq_grow, the new sequence is guaranteed to be exactly the new size provided. */
-static void ScamSeq_resize(ScamSeq* seq, size_t new_sz);
+static bool ScamSeq_resize(ScamSeq* seq, size_t new_sz);
+/* Give the sequence an elements array of its own, if it shares one, so that it can be changed. */
+static bool ScamSeq_unshare(ScamSeq* seq);
+/* These three return false, leaving the sequence as it was, if there is no memory for its new
+ * array. The collector then makes the evaluators fail with an out of memory error, so the change
+ * that needed the memory is simply not made.
+ */
 
 
 /* Construct a value that is internally a sequence. */
 static ScamSeq* ScamSeq_new(int type) {
     SCAMVAL_NEW(ret, ScamSeq, type);
+    ret->line = 0;
+    ret->column = 0;
     ret->count = 0;
     ret->mem_size = 0;
     ret->arr = NULL;
+    ret->shared = NULL;
     return ret;
 }
 
@@ -52,8 +62,19 @@ ScamSeq* ScamExpr_from(size_t n, ...) {
 ScamVal* ScamSeq_pop(ScamSeq* seq, size_t i) {
     if (i < seq->count) {
         ScamVal* ret = seq->arr[i];
-        memmove(seq->arr+i, seq->arr+i+1, (seq->count-i-1) * sizeof *seq->arr);
+        gc_lock();
+        if (seq->shared != NULL && i == 0) {
+            /* Popping from the front of a shared array only narrows the part of it in view. */
+            seq->arr++;
+        } else if (seq->shared == NULL || i != seq->count - 1) {
+            if (!ScamSeq_unshare(seq)) {
+                gc_unlock();
+                return (ScamVal*)ScamErr_new("out of memory");
+            }
+            memmove(seq->arr+i, seq->arr+i+1, (seq->count-i-1) * sizeof *seq->arr);
+        }
         seq->count--;
+        gc_unlock();
         gc_set_root(ret);
         return ret;
     } else {
@@ -79,7 +100,12 @@ size_t ScamSeq_len(const ScamSeq* seq) {
 
 void ScamSeq_set(ScamSeq* seq, size_t i, ScamVal* v) {
     if (i < seq->count) {
-        seq->arr[i] = v;
+        gc_lock();
+        if (ScamSeq_unshare(seq)) {
+            seq->arr[i] = v;
+            gc_write_barrier((ScamVal*)seq, v);
+        }
+        gc_unlock();
     }
 }
 
@@ -96,73 +122,238 @@ void ScamSeq_append(ScamSeq* seq, ScamVal* v) {
 
 void ScamSeq_insert(ScamSeq* seq, size_t i, ScamVal* v) {
     gc_unset_root(v);
-    if (++seq->count > seq->mem_size) {
-        ScamSeq_grow(seq, seq->count);
+    gc_lock();
+    if (!ScamSeq_unshare(seq) ||
+        (seq->count == seq->mem_size && !ScamSeq_grow(seq, seq->count + 1))) {
+        gc_unlock();
+        return;
     }
+    seq->count++;
     memmove(seq->arr+i+1, seq->arr+i, (seq->count-i-1) * sizeof *seq->arr);
     seq->arr[i] = v;
+    gc_write_barrier((ScamVal*)seq, v);
+    gc_unlock();
 }
 
 
 void ScamSeq_concat(ScamSeq* seq1, ScamSeq* seq2) {
-    if (ScamSeq_len(seq2) > 0) {
-        ScamSeq_resize(seq1, ScamSeq_len(seq1) + ScamSeq_len(seq2));
-        while (ScamSeq_len(seq2) > 0) {
-            ScamSeq_append(seq1, ScamSeq_pop(seq2, 0));
+    size_t n1 = ScamSeq_len(seq1);
+    size_t n2 = ScamSeq_len(seq2);
+    if (n2 > 0) {
+        gc_lock();
+        if (!ScamSeq_unshare(seq1) ||
+            (n1 + n2 > seq1->mem_size && !ScamSeq_grow(seq1, n1 + n2))) {
+            gc_unlock();
+            gc_unset_root((ScamVal*)seq2);
+            return;
+        }
+        /* seq2 is read through its own pointer after growing, in case it is seq1. */
+        for (size_t i = 0; i < n2; i++) {
+            seq1->arr[n1 + i] = seq2->arr[i];
+            gc_write_barrier((ScamVal*)seq1, seq2->arr[i]);
+        }
+        seq1->count = n1 + n2;
+        gc_unlock();
+    }
+    gc_unset_root((ScamVal*)seq2);
+}
+
+
+/* The buffer of every open view. Views don't own the array that they see, so the buffer has no
+ * base, and its first reference, which is never released, keeps it from being freed.
+ */
+static ScamBuffer view_buffer = { 1, NULL, 0 };
+
+
+static bool ScamSeq_is_view(const ScamSeq* seq) {
+    return seq->shared == &view_buffer;
+}
+
+
+ScamSeq* ScamSeq_view(ScamVal** arr, size_t n) {
+    ScamSeq* ret = ScamSeq_new(SCAM_SEXPR);
+    view_buffer.refs++;
+    ret->shared = &view_buffer;
+    ret->arr = arr;
+    ret->count = ret->mem_size = n;
+    return ret;
+}
+
+
+void ScamSeq_move_view(ScamSeq* seq, ScamVal** from, ScamVal** to) {
+    if (ScamSeq_is_view(seq)) {
+        seq->arr = to + (seq->arr - from);
+    }
+}
+
+
+void ScamSeq_close_view(ScamSeq* seq, bool keep) {
+    if (!ScamSeq_is_view(seq)) {
+        return;
+    }
+    gc_lock();
+    /* A view that can't be copied is emptied instead, since its array is about to be reused. */
+    if (!keep || !ScamSeq_unshare(seq)) {
+        view_buffer.refs--;
+        seq->shared = NULL;
+        seq->arr = NULL;
+        seq->count = seq->mem_size = 0;
+    }
+    gc_unlock();
+}
+
+
+/* Return a new sequence that shares the elements array of the given one and sees the part of it
+ * from start to end.
+ */
+static ScamSeq* ScamSeq_share(ScamSeq* seq, size_t start, size_t end) {
+    if (start == end) {
+        return ScamSeq_new(ScamVal_type(seq));
+    }
+    if (ScamSeq_is_view(seq)) {
+        /* The copy may outlive the array that the view sees. */
+        gc_lock();
+        bool unshared = ScamSeq_unshare(seq);
+        gc_unlock();
+        if (!unshared) {
+            return ScamSeq_new(ScamVal_type(seq));
         }
     }
+    if (seq->shared == NULL) {
+        seq->shared = gc_malloc(sizeof *seq->shared);
+        seq->shared->refs = 1;
+        seq->shared->base = seq->arr;
+        seq->shared->size = seq->mem_size * sizeof *seq->arr;
+    }
+    /* The new sequence needs no write barriers, since it is allocated after its elements. */
+    ScamSeq* ret = ScamSeq_new(ScamVal_type(seq));
+    seq->shared->refs++;
+    ret->shared = seq->shared;
+    ret->arr = seq->arr + start;
+    ret->count = ret->mem_size = end - start;
+    return ret;
 }
 
 
-ScamVal* ScamSeq_subseq(const ScamSeq* seq, size_t start, size_t end) {
+ScamSeq* ScamSeq_copy(ScamSeq* seq) {
+    ScamSeq* ret = ScamSeq_share(seq, 0, seq->count);
+    ret->line = seq->line;
+    ret->column = seq->column;
+    return ret;
+}
+
+
+ScamVal* ScamSeq_subseq(ScamSeq* seq, size_t start, size_t end) {
     size_t n = ScamSeq_len(seq);
     if (end <= n && start <= end) {
-        ScamSeq* ret = ScamSeq_new(seq->type);
-        for (size_t i = start; i < end; i++) {
-            ScamSeq_append(ret, gc_copy_ScamVal(ScamSeq_get(seq, i)));
-        }
-        return (ScamVal*)ret;
+        return (ScamVal*)ScamSeq_share(seq, start, end);
     } else {
         return (ScamVal*)ScamErr_new("attempted sequence access out of bounds");
     }
 }
 
 
+enum { LINE_MAX = (1 << 20) - 1, COLUMN_MAX = (1 << 12) - 1 };
+void ScamSeq_set_location(ScamSeq* seq, unsigned int line, unsigned int column) {
+    seq->line = line <= LINE_MAX ? line : 0;
+    seq->column = column <= COLUMN_MAX ? column : 0;
+}
+
+
+unsigned int ScamSeq_line(const ScamSeq* seq) {
+    return seq->line;
+}
+
+
+unsigned int ScamSeq_column(const ScamSeq* seq) {
+    return seq->column;
+}
+
+
+void ScamSeq_sort(ScamSeq* seq, int compar(const void*, const void*)) {
+    gc_lock();
+    if (ScamSeq_unshare(seq)) {
+        qsort(seq->arr, seq->count, sizeof *seq->arr, compar);
+    }
+    gc_unlock();
+}
+
+
+/* Give up a reference to a shared buffer of elements, freeing it if it was the last one. */
+static void ScamBuffer_release(ScamBuffer* shared) {
+    if (--shared->refs == 0) {
+        gc_free_block(shared->base, shared->size);
+        free(shared);
+    }
+}
+
+
+void ScamSeq_free(ScamSeq* seq) {
+    if (seq->shared != NULL) {
+        ScamBuffer_release(seq->shared);
+    } else {
+        gc_free_block(seq->arr, seq->mem_size * sizeof *seq->arr);
+    }
+}
+
+
 static ScamSeq* ScamSeq_new_from(int type, size_t n, va_list vlist) {
     SCAMVAL_NEW(ret, ScamSeq, type);
-    ret->arr = gc_malloc(n * sizeof *ret->arr);
+    ret->line = 0;
+    ret->column = 0;
+    ret->arr = gc_alloc_block(n * sizeof *ret->arr);
     for (size_t i = 0; i < n; i++) {
         ret->arr[i] = va_arg(vlist, ScamVal*);
         gc_unset_root(ret->arr[i]);
     }
     ret->count = n;
     ret->mem_size = n;
+    ret->shared = NULL;
     va_end(vlist);
     return ret;
 }
 
 
 enum { SEQ_SIZE_INITIAL = 5, SEQ_SIZE_GROW = 2};
-static void ScamSeq_grow(ScamSeq* seq, size_t min_new_sz) {
-    if (seq->arr == NULL) {
-        seq->mem_size = SEQ_SIZE_INITIAL;
-        if (seq->mem_size < min_new_sz)
-            seq->mem_size = min_new_sz;
-        seq->arr = gc_malloc(seq->mem_size * sizeof *seq->arr);
-    } else {
-        seq->mem_size *= SEQ_SIZE_GROW;
-        if (seq->mem_size < min_new_sz)
-            seq->mem_size = min_new_sz;
-        seq->arr = gc_realloc(seq->arr, seq->mem_size * sizeof *seq->arr);
-    }
+static bool ScamSeq_grow(ScamSeq* seq, size_t min_new_sz) {
+    size_t new_sz = seq->arr == NULL ? SEQ_SIZE_INITIAL : seq->mem_size * SEQ_SIZE_GROW;
+    if (new_sz < min_new_sz)
+        new_sz = min_new_sz;
+    return ScamSeq_resize(seq, new_sz);
 }
 
 
-static void ScamSeq_resize(ScamSeq* seq, size_t new_sz) {
+static bool ScamSeq_resize(ScamSeq* seq, size_t new_sz) {
+    ScamVal** arr = gc_try_realloc_block(seq->arr, seq->mem_size * sizeof *seq->arr,
+                                         new_sz * sizeof *seq->arr);
+    if (arr == NULL) {
+        return false;
+    }
+    seq->arr = arr;
     seq->mem_size = new_sz;
-    if (seq->arr == NULL) {
-        seq->arr = gc_malloc(seq->mem_size * sizeof *seq->arr);
+    return true;
+}
+
+
+static bool ScamSeq_unshare(ScamSeq* seq) {
+    ScamBuffer* shared = seq->shared;
+    if (shared == NULL) {
+        return true;
+    }
+    if (shared->refs == 1 && shared->base == (void*)seq->arr) {
+        /* The others have all been freed, so the whole array is this sequence's again. */
+        seq->mem_size = shared->size / sizeof *seq->arr;
+        free(shared);
     } else {
-        seq->arr = gc_realloc(seq->arr, seq->mem_size * sizeof *seq->arr);
+        ScamVal** arr = gc_try_realloc_block(NULL, 0, seq->count * sizeof *arr);
+        if (arr == NULL && seq->count > 0) {
+            return false;
+        }
+        memcpy(arr, seq->arr, seq->count * sizeof *arr);
+        seq->arr = arr;
+        seq->mem_size = seq->count;
+        ScamBuffer_release(shared);
     }
+    seq->shared = NULL;
+    return true;
 }
@@ -7,7 +7,13 @@
 
 /* Construct a value that is internally a string (strings, symbols and errors). */
 static ScamStr* ScamStr_base_new(int type, const char* s);
-static void ScamStr_resize(ScamStr* sbox, size_t new_sz);
+static bool ScamStr_resize(ScamStr* sbox, size_t new_sz);
+/* Give the string a character array of its own, if it shares one, so that it can be changed. */
+static bool ScamStr_unshare(ScamStr* sbox);
+/* Both return false, leaving the string as it was, if there is no memory for its new array, in
+ * which case the change that needed it is not made and the evaluators fail with an out of memory
+ * error.
+ */
 
 
 ScamStr* ScamStr_new(const char* s) {
@@ -43,6 +49,7 @@ ScamStr* ScamStr_from_literal(char* s) {
 ScamStr* ScamStr_read(FILE* fp) {
     SCAMVAL_NEW(ret, ScamStr, SCAM_STR);
     ret->s = NULL;
+    ret->shared = NULL;
     ssize_t nread = getline(&ret->s, &ret->mem_size, fp);
     if (nread != -1) {
         ret->count = nread;
@@ -59,6 +66,7 @@ ScamStr* ScamStr_empty(void) {
     ret->count = 0;
     ret->mem_size = 0;
     ret->s = NULL;
+    ret->shared = NULL;
     return ret;
 }
 
@@ -67,6 +75,7 @@ ScamStr* ScamStr_no_copy(char* s) {
     SCAMVAL_NEW(ret, ScamStr, SCAM_STR);
     ret->s = s;
     ret->count = ret->mem_size = strlen(s);
+    ret->shared = NULL;
     return ret;
 }
 
@@ -78,20 +87,133 @@ ScamStr* ScamStr_from_char(char c) {
     ret->s[1] = '\0';
     ret->count = 1;
     ret->mem_size = 2;
+    ret->shared = NULL;
     return ret;
 }
 
 
+/* The symbol table, an open-addressing hash table (with linear probing) of every live symbol. Its
+ * size is always a power of two, and it is never more than half full.
+ */
+static ScamStr** symbols = NULL;
+static size_t symbols_size = 0;
+static size_t symbols_count = 0;
+enum { SYMBOLS_SIZE_INITIAL = 512, SYMBOLS_SIZE_GROW = 2 };
+
+
+/* Put a symbol into the first empty place on its probe sequence. */
+static void symbols_place(ScamStr** table, size_t size, ScamStr* sym) {
+    size_t i = sym->hash & (size - 1);
+    while (table[i] != NULL) {
+        i = (i + 1) & (size - 1);
+    }
+    table[i] = sym;
+}
+
+
+/* Return the symbol with the given name, or NULL if there is none. */
+static ScamStr* symbols_find(const char* s, size_t hash) {
+    if (symbols == NULL) {
+        return NULL;
+    }
+    for (size_t i = hash & (symbols_size - 1); symbols[i] != NULL; i = (i + 1) & (symbols_size - 1)) {
+        if (symbols[i]->hash == hash && strcmp(symbols[i]->s, s) == 0) {
+            return symbols[i];
+        }
+    }
+    return NULL;
+}
+
+
+static void symbols_insert(ScamStr* sym) {
+    if (2 * (symbols_count + 1) > symbols_size) {
+        size_t new_size = symbols_size ? symbols_size * SYMBOLS_SIZE_GROW : SYMBOLS_SIZE_INITIAL;
+        ScamStr** new_symbols = gc_calloc(new_size, sizeof *new_symbols);
+        for (size_t i = 0; i < symbols_size; i++) {
+            if (symbols[i] != NULL) {
+                symbols_place(new_symbols, new_size, symbols[i]);
+            }
+        }
+        free(symbols);
+        symbols = new_symbols;
+        symbols_size = new_size;
+    }
+    symbols_place(symbols, symbols_size, sym);
+    symbols_count++;
+}
+
+
+/* Return the symbol with the given name, creating it if it doesn't exist yet. If s_owned is not
+ * NULL, it is the same string as s, and it is either used by the new symbol or freed.
+ */
+static ScamStr* ScamSym_intern(const char* s, char* s_owned) {
+    size_t hash = scamstr_hash(s);
+    ScamStr* ret = symbols_find(s, hash);
+    if (ret != NULL) {
+        free(s_owned);
+        gc_set_root((ScamVal*)ret);
+        return ret;
+    }
+    SCAMVAL_NEW(sym, ScamStr, SCAM_SYM);
+    sym->s = s_owned != NULL ? s_owned : strdup(s);
+    sym->count = strlen(s);
+    sym->mem_size = sym->count + 1;
+    sym->shared = NULL;
+    sym->hash = hash;
+    sym->keyword = KEYWORD_NONE;
+    #define EXPAND_KEYWORD(kw, name) \
+        if (strcmp(s, name) == 0) sym->keyword = kw;
+    #include "../keyword.def"
+    symbols_insert(sym);
+    return sym;
+}
+
+
 ScamStr* ScamSym_new(const char* s) {
-    return (ScamStr*)ScamStr_base_new(SCAM_SYM, s);
+    return ScamSym_intern(s, NULL);
 }
 
 
 ScamStr* ScamSym_no_copy(char* s) {
-    SCAMVAL_NEW(ret, ScamStr, SCAM_SYM);
-    ret->s = s;
-    ret->count = ret->mem_size = strlen(s);
-    return ret;
+    return ScamSym_intern(s, s);
+}
+
+
+enum ScamKeyword ScamSym_keyword(const ScamStr* sym) {
+    return sym->keyword;
+}
+
+
+void ScamSym_free(ScamStr* sym) {
+    size_t mask = symbols_size - 1;
+    size_t i = sym->hash & mask;
+    while (symbols[i] != sym) {
+        i = (i + 1) & mask;
+    }
+    /* Shift back the symbols after the deleted one that would otherwise become unreachable. */
+    for (size_t j = (i + 1) & mask; symbols[j] != NULL; j = (j + 1) & mask) {
+        size_t home = symbols[j]->hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            symbols[i] = symbols[j];
+            i = j;
+        }
+    }
+    symbols[i] = NULL;
+    symbols_count--;
+    free(sym->s);
+}
+
+
+enum { HASH_MULTIPLIER = 31 };
+size_t scamstr_hash(const char* s) {
+    /* This function is lightly adapted from section 2.9 of The Practice of Programming, by Brian
+     * Kernighan and Rob Pike.
+     */
+    size_t h = 0;
+    for (const unsigned char* p = (const unsigned char*)s; *p != '\0'; p++) {
+        h = HASH_MULTIPLIER*h + *p;
+    }
+    return h;
 }
 
 
@@ -101,7 +223,10 @@ ScamStr* ScamErr_new(const char* format, ...) {
     va_list vlist;
     va_start(vlist, format);
     ret->s = gc_malloc(MAX_ERROR_SIZE);
+    ret->shared = NULL;
     vsnprintf(ret->s, MAX_ERROR_SIZE, format, vlist);
+    ret->count = strlen(ret->s);
+    ret->mem_size = MAX_ERROR_SIZE;
     va_end(vlist);
     return ret;
 }
@@ -128,13 +253,16 @@ const char* ScamStr_unbox(const ScamStr* sbox) {
 
 
 void ScamStr_set(ScamStr* sbox, size_t i, char c) {
-    if (i < sbox->count) {
+    if (i < sbox->count && ScamStr_unshare(sbox)) {
         sbox->s[i] = c;
     }
 }
 
 
 void ScamStr_map(ScamStr* sbox, int map_f(int)) {
+    if (!ScamStr_unshare(sbox)) {
+        return;
+    }
     for (char* p = sbox->s; *p != '\0'; p++) {
         *p = map_f(*p);
     }
@@ -161,7 +289,7 @@ char ScamStr_pop(ScamStr* sbox, size_t i) {
 
 
 void ScamStr_remove(ScamStr* sbox, size_t start, size_t end) {
-    if (end <= ScamStr_len(sbox) && start < end) {
+    if (end <= ScamStr_len(sbox) && start < end && ScamStr_unshare(sbox)) {
         memmove(sbox->s+start, sbox->s+end, sbox->count-end);
         sbox->count -= (end - start);
         sbox->s[sbox->count] = '\0';
@@ -170,8 +298,9 @@ void ScamStr_remove(ScamStr* sbox, size_t start, size_t end) {
 
 
 void ScamStr_truncate(ScamStr* sbox, size_t i) {
-    if (i < ScamStr_len(sbox)) {
+    if (i < ScamStr_len(sbox) && ScamStr_unshare(sbox)) {
         sbox->s[i] = '\0';
+        sbox->count = i;
     }
 }
 
@@ -188,6 +317,26 @@ ScamStr* ScamStr_substr(const ScamStr* sbox, size_t start, size_t end) {
 }
 
 
+ScamStr* ScamStr_copy(ScamStr* sbox) {
+    if (sbox->s == NULL) {
+        return ScamStr_empty();
+    }
+    if (sbox->shared == NULL) {
+        sbox->shared = gc_malloc(sizeof *sbox->shared);
+        sbox->shared->refs = 1;
+        sbox->shared->base = sbox->s;
+        sbox->shared->size = sbox->mem_size;
+    }
+    SCAMVAL_NEW(ret, ScamStr, ScamVal_type(sbox));
+    sbox->shared->refs++;
+    ret->shared = sbox->shared;
+    ret->s = sbox->s;
+    ret->count = sbox->count;
+    ret->mem_size = sbox->mem_size;
+    return ret;
+}
+
+
 size_t ScamStr_len(const ScamStr* sbox) {
     return sbox->count;
 }
@@ -196,11 +345,12 @@ size_t ScamStr_len(const ScamStr* sbox) {
 void ScamStr_concat(ScamStr* s1, ScamStr* s2) {
     size_t n1 = ScamStr_len(s1);
     size_t n2 = ScamStr_len(s2);
-    ScamStr_resize(s1, n1+n2+1);
-    for (size_t i = 0; i <= n2; i++) {
-        s1->s[n1 + i] = s2->s[i];
+    if (ScamStr_unshare(s1) && ScamStr_resize(s1, n1+n2+1)) {
+        for (size_t i = 0; i <= n2; i++) {
+            s1->s[n1 + i] = s2->s[i];
+        }
+        s1->count = n1 + n2;
     }
-    s1->count = n1 + n2;
     gc_unset_root((ScamVal*)s2);
 }
 
@@ -210,15 +360,58 @@ static ScamStr* ScamStr_base_new(int type, const char* s) {
     ret->count = strlen(s);
     ret->mem_size = ret->count + 1;
     ret->s = strdup(s);
+    ret->shared = NULL;
     return ret;
 }
 
 
-static void ScamStr_resize(ScamStr* sbox, size_t new_sz) {
+static bool ScamStr_resize(ScamStr* sbox, size_t new_sz) {
+    char* s = gc_try_realloc(sbox->s, new_sz);
+    if (s == NULL) {
+        return false;
+    }
+    sbox->s = s;
     sbox->mem_size = new_sz;
-    if (sbox->s == NULL) {
-        sbox->s = gc_malloc(new_sz);
+    return true;
+}
+
+
+/* Give up a reference to a shared character array, freeing it if it was the last one. */
+static void ScamBuffer_release(ScamBuffer* shared) {
+    if (--shared->refs == 0) {
+        free(shared->base);
+        free(shared);
+    }
+}
+
+
+void ScamStr_free(ScamStr* sbox) {
+    if (sbox->shared != NULL) {
+        ScamBuffer_release(sbox->shared);
+    } else {
+        free(sbox->s);
+    }
+}
+
+
+static bool ScamStr_unshare(ScamStr* sbox) {
+    ScamBuffer* shared = sbox->shared;
+    if (shared == NULL) {
+        return true;
+    }
+    if (shared->refs > 1) {
+        char* s = gc_try_realloc(NULL, sbox->count + 1);
+        if (s == NULL) {
+            return false;
+        }
+        memcpy(s, sbox->s, sbox->count + 1);
+        sbox->s = s;
+        sbox->mem_size = sbox->count + 1;
+        ScamBuffer_release(shared);
     } else {
-        sbox->s = gc_realloc(sbox->s, new_sz);
+        /* The others have all been freed, so the array is this string's again. */
+        free(shared);
     }
+    sbox->shared = NULL;
+    return true;
 }
@@ -8,6 +8,8 @@
 
 void parsetest(char* line, const ScamVal* answer, int line_no);
 void parsetest_err(char* line, int line_no);
+void parsetest_location(char* line, size_t i, unsigned int answer_line, unsigned int answer_column,
+                        int line_no);
 
 void evaltest(char* line, const ScamVal* answer, ScamEnv* env, int line_no);
 void evaltest_err(char* line, ScamEnv* env, int line_no);
@@ -15,6 +17,8 @@ void evaltest_err(char* line, ScamEnv* env, int line_no);
 int main() {
     #define PARSETEST(line, answer) parsetest(line, (ScamVal*)answer, __LINE__);
     #define PARSETEST_ERR(line) parsetest_err(line, __LINE__);
+    #define PARSETEST_LOCATION(line, i, answer_line, answer_column) \
+        parsetest_location(line, i, answer_line, answer_column, __LINE__);
     #define EVALTEST(line, answer) evaltest(line, (ScamVal*)answer, env, __LINE__);
     #define EVALTEST_ERR(line) evaltest_err(line, env, __LINE__);
     #define EVALDEF(line) EVALTEST(line, ScamNull_new());
@@ -44,11 +48,16 @@ int main() {
     PARSETEST("\"matador\"", ScamStr_new("matador"));
     /* Expressions and lists */
     PARSETEST("(+ 1 1)", S(3, ScamSym_new("+"), ScamInt_new(1), ScamInt_new(1)));
-    PARSETEST("[1 2 3]", S(4, ScamSym_new("list"), ScamInt_new(1), ScamInt_new(2), ScamInt_new(3)));
-    PARSETEST("{1:\"one\"}", S(2, ScamSym_new("dict"),
-                                  S(3, ScamSym_new("list"), ScamInt_new(1), ScamStr_new("one"))));
+    PARSETEST("[1 2 3]", S(4, ScamSym_new("#list"), ScamInt_new(1), ScamInt_new(2), ScamInt_new(3)));
+    PARSETEST("{1:\"one\"}", S(2, ScamSym_new("#dict"),
+                                  S(3, ScamSym_new("#list"), ScamInt_new(1), ScamStr_new("one"))));
     /* Invalid expressions */
     PARSETEST_ERR("(+ (define x 10) 3)");
+    /* Locations of expressions, lists and dictionaries */
+    PARSETEST_LOCATION("(+ 1\n   (* 2 3))", 0, 1, 1);
+    PARSETEST_LOCATION("(+ 1\n   (* 2 3))", 2, 2, 4);
+    PARSETEST_LOCATION("; comment\n  (f [1 2] {1:2})", 1, 2, 6);
+    PARSETEST_LOCATION("; comment\n  (f [1 2] {1:2})", 2, 2, 12);
 
     puts("\n=== EVALUATOR TESTS ===");
     puts("(you should see two failed (+ 1 1) == 3 tests)\n");
@@ -108,6 +117,13 @@ int main() {
     /*** LIST and DICTIONARY LITERALS ***/
     EVALTEST("[(* 2 2) (* 3 3) (* 4 4)]", L(3, ScamInt_new(4), ScamInt_new(9), ScamInt_new(16)));
     EVALTEST("{1:\"one\"}", D(1, L(2, ScamInt_new(1), ScamStr_new("one"))));
+    /* list and dict are evaluated directly, but must behave like the builtins. */
+    EVALTEST("(list)", L(0));
+    EVALTEST("(dict [1 2] [3 4])", D(2, L(2, ScamInt_new(1), ScamInt_new(2)),
+                                       L(2, ScamInt_new(3), ScamInt_new(4))));
+    EVALTEST_ERR("(dict [1 2 3])");
+    EVALTEST_ERR("(dict 1)");
+    EVALTEST("(map list [1 2])", L(2, L(1, ScamInt_new(1)), L(1, ScamInt_new(2))));
 
     /*** ARITHMETIC FUNCTIONS ***/
     /* Addition */
@@ -120,6 +136,12 @@ int main() {
     /* Multiplication */
     EVALTEST("(* 9 9 -437)", ScamInt_new(9 * 9 * -437));
     EVALTEST("(* 3.5 6.79 2.3)", ScamDec_new(3.5 * 6.79 * 2.3));
+    /* Integers on either side of the largest that can be stored without allocation */
+    EVALTEST("4611686018427387903", ScamInt_new(4611686018427387903LL));
+    EVALTEST("4611686018427387904", ScamInt_new(4611686018427387904LL));
+    EVALTEST("(* 2 2305843009213693952)", ScamInt_new(4611686018427387904LL));
+    EVALTEST("(* -2 4611686018427387904)", ScamInt_new(-9223372036854775807LL - 1));
+    EVALTEST("(= 4611686018427387904 -4611686018427387904)", ScamBool_new(false));
     /* Floating-point division */
     EVALTEST("(/ 10 3)", ScamDec_new(10 / 3.0));
     EVALTEST("(/ 3.7 8.91 2.3)", ScamDec_new((3.7 / 8.91) / 2.3));
@@ -155,6 +177,10 @@ int main() {
     EVALTEST_ERR("(and (begin (/ 10 0) true) false)");
     EVALTEST("(or true (begin (/ 10 0) true))", ScamBool_new(true));
     EVALTEST_ERR("(or (begin (/ 10 0) false) true)");
+    /* The last operand is in tail position, so it is returned as is. */
+    EVALTEST("(and true 42)", ScamInt_new(42));
+    EVALTEST("(or false 42)", ScamInt_new(42));
+    EVALTEST_ERR("(and 42 true)");
 
     /*** COMPARISON AND EQUALITY ***/
     /* Numeric equality */
@@ -312,6 +338,12 @@ int main() {
     EVALTEST("(port-good? fp)", ScamBool_new(false));
     EVALDEF("(close fp)");
 
+    /*** HEAP LIMIT ***/
+    gc_set_heap_limit(1 << 20);
+    EVALTEST_ERR("(map (lambda (n) [n \"abc\"]) (range 0 100000))");
+    gc_set_heap_limit(0);
+    EVALTEST("(len (map list [1 2]))", ScamInt_new(2));
+
     /*** INTENTIONAL FAIL ***/
     EVALTEST("(+ 1 1)", ScamInt_new(3));
     EVALTEST_ERR("(+ 1 1)");
@@ -321,7 +353,7 @@ int main() {
 
 void parsetest(char* line, const ScamVal* answer, int line_no) {
     ScamSeq* v = parse_str(line);
-    ScamVal* modified_answer = (ScamVal*)ScamExpr_from(2, ScamSym_new("begin"), answer);
+    ScamVal* modified_answer = (ScamVal*)ScamExpr_from(2, ScamSym_new("#begin"), answer);
     if (!ScamVal_eq((ScamVal*)v, modified_answer)) {
         printf("Failed parse example, line %d in %s:\n", line_no, __FILE__);
         printf("  %s\n", line);
@@ -335,7 +367,7 @@ void parsetest(char* line, const ScamVal* answer, int line_no) {
 
 void parsetest_err(char* line, int line_no) {
     ScamSeq* v = parse_str(line);
-    if (v->type != SCAM_ERR) {
+    if (ScamVal_type(v) != SCAM_ERR) {
         printf("Failed parse example, line %d in %s:\n", line_no, __FILE__);
         printf("  %s\n", line);
         printf("Expected:\n  ERROR\n");
@@ -346,6 +378,23 @@ void parsetest_err(char* line, int line_no) {
     gc_unset_root((ScamVal*)v);
 }
 
+/* Check the location of the i'th element of the first expression, or of the expression itself if
+ * i is zero.
+ */
+void parsetest_location(char* line, size_t i, unsigned int answer_line, unsigned int answer_column,
+                        int line_no) {
+    ScamSeq* v = parse_str(line);
+    ScamSeq* expr = (ScamSeq*)ScamSeq_get(v, 1);
+    ScamSeq* seq = i == 0 ? expr : (ScamSeq*)ScamSeq_get(expr, i);
+    if (ScamSeq_line(seq) != answer_line || ScamSeq_column(seq) != answer_column) {
+        printf("Failed parse example, line %d in %s:\n", line_no, __FILE__);
+        printf("  %s\n", line);
+        printf("Expected location:\n  %u:%u\n", answer_line, answer_column);
+        printf("Got:\n  %u:%u\n\n", ScamSeq_line(seq), ScamSeq_column(seq));
+    }
+    gc_unset_root((ScamVal*)v);
+}
+
 void evaltest(char* line, const ScamVal* answer, ScamEnv* env, int line_no) {
     ScamVal* v = eval_str(line, env);
     if (!ScamVal_eq(v, answer)) {
@@ -356,20 +405,20 @@ void evaltest(char* line, const ScamVal* answer, ScamEnv* env, int line_no) {
         printf("Got:\n  ");
         ScamVal_println(v);
         printf("\n");
-    } else if (v->type != answer->type) {
+    } else if (ScamVal_type(v) != ScamVal_type(answer)) {
         printf("Failed example, line %d in %s:\n", line_no, __FILE__);
         printf("  %s\n", line);
         printf("Expected:\n  ");
-        printf("  %s\n", scamtype_debug_name(answer->type));
+        printf("  %s\n", scamtype_debug_name(ScamVal_type(answer)));
         printf("Got:\n  ");
-        printf("  %s\n\n", scamtype_debug_name(v->type));
+        printf("  %s\n\n", scamtype_debug_name(ScamVal_type(v)));
     }
     gc_unset_root(v);
 }
 
 void evaltest_err(char* line, ScamEnv* env, int line_no) {
     ScamVal* v = eval_str(line, env);
-    if (v->type != SCAM_ERR) {
+    if (ScamVal_type(v) != SCAM_ERR) {
         printf("Failed example, line %d in %s:\n", line_no, __FILE__);
         printf("  %s\n", line);
         printf("Expected:\n  ERROR\n");
@@ -0,0 +1,332 @@
+#include <stdlib.h>
+#include "collector.h"
+#include "compile.h"
+#include "eval.h"
+#include "profiler.h"
+#include "vm.h"
+
+
+/* Remove and return the value on top of the stack, as a root. */
+static ScamVal* pop(void) {
+    ScamVal* v = eval_stack[--eval_stack_count];
+    gc_set_root(v);
+    return v;
+}
+
+
+/* The value n places down from the top of the stack, which is at zero. */
+static ScamVal* peek(size_t n) {
+    return eval_stack[eval_stack_count - n - 1];
+}
+
+
+/* The state of a caller while the function it called runs. The function and the frame of every
+ * active call are kept on the value stack, between the caller's values and the callee's, so that
+ * the collector sees them.
+ */
+typedef struct {
+    ScamCode* code;
+    size_t pc;
+    ScamEnv* env;
+} vm_call_t;
+
+
+enum { CALLS_SIZE_INITIAL = 16, CALLS_SIZE_GROW = 2 };
+typedef struct {
+    size_t count, mem_size;
+    vm_call_t* arr;
+} vm_calls_t;
+
+
+/* Drop what is left of the stack of this call of vm_run and the call records, and return the
+ * result.
+ */
+static ScamVal* vm_exit(size_t base, vm_calls_t* calls, ScamVal* ret) {
+    eval_stack_count = base;
+    for (size_t i = 0; i < calls->count; i++) {
+        prof_leave();
+        eval_leave();
+    }
+    free(calls->arr);
+    return ret;
+}
+
+#define VM_EXIT(ret) return vm_exit(base, &calls, (ret))
+
+
+/* Return the environment n frames up from the given one. */
+static ScamEnv* enclosing_frame(ScamEnv* env, size_t n) {
+    for (; n > 0; n--) {
+        env = ScamEnv_enclosing(env);
+    }
+    return env;
+}
+
+
+/* Return the compiled function below the top n values of the stack, if it can be called with
+ * those values as arguments, and NULL otherwise.
+ */
+static ScamFunction* compiled_callee(size_t n) {
+    ScamVal* fun_val = peek(n);
+    if (ScamVal_type(fun_val) == SCAM_FUNCTION && ScamFunction_code((ScamFunction*)fun_val) != NULL &&
+        ScamFunction_nparams((ScamFunction*)fun_val) == n) {
+        return (ScamFunction*)fun_val;
+    } else {
+        return NULL;
+    }
+}
+
+
+/* Move the top n values of the stack into the slots of a new frame for the function. */
+static ScamEnv* new_frame(ScamFunction* f, size_t n) {
+    ScamEnv* frame = ScamEnv_frame(f->env, ScamFunction_code(f)->slot_names);
+    eval_stack_count -= n;
+    for (size_t i = 0; i < n; i++) {
+        frame->slots[i] = eval_stack[eval_stack_count + i];
+    }
+    return frame;
+}
+
+
+/* Name a function after the variable it is defined as, as eval_define does. */
+static void name_function(ScamVal* v, ScamVal* sym) {
+    if (ScamVal_type(v) == SCAM_FUNCTION) {
+        ScamFunction_set_name((ScamFunction*)v, (ScamStr*)sym);
+    }
+}
+
+
+ScamVal* vm_run(ScamCode* code, ScamEnv* env) {
+    /* The values below base belong to whoever called vm_run, and are left in place on exit. */
+    size_t base = eval_stack_count;
+    ScamSeq* constants = code->constants;
+    const int* arr = code->arr;
+    size_t pc = 0;
+    /* Calls from compiled code to compiled functions don't recurse on the C stack. */
+    vm_calls_t calls = { 0, 0, NULL };
+    for (;;) {
+        switch (arr[pc++]) {
+            case CODE_CONST:
+                eval_push(ScamSeq_get(constants, arr[pc++]));
+                break;
+            case CODE_LOOKUP:
+            {
+                ScamStr* sym = (ScamStr*)ScamSeq_get(constants, arr[pc++]);
+                ScamVal* v = ScamEnv_lookup(enclosing_frame(env, arr[pc++]), sym);
+                if (ScamVal_type(v) == SCAM_ERR) {
+                    VM_EXIT(v);
+                }
+                eval_push(v);
+                break;
+            }
+            case CODE_LOCAL:
+            case CODE_MOVE:
+            {
+                bool is_move = (arr[pc - 1] == CODE_MOVE);
+                ScamEnv* frame = enclosing_frame(env, arr[pc++]);
+                size_t slot = arr[pc++];
+                ScamVal* v = frame->slots[slot];
+                if (v == NULL) {
+                    /* A local define that hasn't run yet doesn't hide the outer binding. */
+                    ScamStr* sym = (ScamStr*)ScamSeq_get(frame->slot_names, slot);
+                    v = ScamEnv_lookup(ScamEnv_enclosing(frame), sym);
+                    if (ScamVal_type(v) == SCAM_ERR) {
+                        VM_EXIT(v);
+                    }
+                } else if (!is_move) {
+                    /* The slot will be read again, so the value is shared with it. */
+                    ScamVal_share(v);
+                }
+                eval_push(v);
+                break;
+            }
+            case CODE_DEFINE:
+            {
+                ScamVal* sym = ScamSeq_get(constants, arr[pc++]);
+                ScamVal* v = pop();
+                name_function(v, sym);
+                ScamEnv_insert(env, (ScamStr*)sym, v);
+                eval_push(ScamNull_new());
+                break;
+            }
+            case CODE_DEFINE_LOCAL:
+            {
+                ScamVal* v = peek(0);
+                size_t slot = arr[pc++];
+                name_function(v, ScamSeq_get(env->slot_names, slot));
+                eval_stack_count--;
+                gc_lock();
+                env->slots[slot] = v;
+                gc_write_barrier((ScamVal*)env, v);
+                gc_unlock();
+                eval_push(ScamNull_new());
+                break;
+            }
+            case CODE_LAMBDA:
+            {
+                ScamFunction* template = (ScamFunction*)ScamSeq_get(constants, arr[pc++]);
+                ScamFunction* f = ScamFunction_compiled(env, template->parameters, template->body,
+                                                        ScamFunction_code(template));
+                eval_push((ScamVal*)f);
+                break;
+            }
+            case CODE_CALL:
+            case CODE_TAIL_CALL:
+            {
+                bool is_tail = (arr[pc - 1] == CODE_TAIL_CALL);
+                size_t n = arr[pc++];
+                ScamFunction* f = compiled_callee(n);
+                if (f == NULL) {
+                    /* Builtins and uncompiled functions are called recursively. Calls with the
+                     * wrong number of arguments are too, so that they report the error.
+                     */
+                    ScamVal* ret = eval_call_top(n);
+                    if (ScamVal_type(ret) == SCAM_ERR) {
+                        VM_EXIT(ret);
+                    }
+                    eval_push(ret);
+                    break;
+                }
+                if (is_tail && calls.count > 0) {
+                    /* Tail calls don't nest, but a loop of them still has to stop when memory
+                     * runs out.
+                     */
+                    if (gc_heap_exhausted()) {
+                        VM_EXIT((ScamVal*)ScamErr_new("out of memory"));
+                    }
+                    /* Replace the function and frame of the current call with the new ones. */
+                    ScamEnv* frame = new_frame(f, n);
+                    gc_unset_root((ScamVal*)frame);
+                    eval_stack[eval_stack_count - 3] = (ScamVal*)f;
+                    eval_stack[eval_stack_count - 2] = (ScamVal*)frame;
+                    eval_stack_count--;
+                    env = frame;
+                    prof_replace((ScamVal*)f);
+                } else {
+                    ScamVal* err = eval_enter();
+                    if (err != NULL) {
+                        VM_EXIT(err);
+                    }
+                    if (calls.count == calls.mem_size) {
+                        calls.mem_size = calls.mem_size ? calls.mem_size * CALLS_SIZE_GROW
+                                                        : CALLS_SIZE_INITIAL;
+                        calls.arr = gc_realloc(calls.arr, calls.mem_size * sizeof *calls.arr);
+                    }
+                    calls.arr[calls.count++] = (vm_call_t){ code, pc, env };
+                    /* The function itself stays on the stack, below its frame. */
+                    ScamEnv* frame = new_frame(f, n);
+                    eval_push((ScamVal*)frame);
+                    env = frame;
+                    prof_enter((ScamVal*)f);
+                }
+                code = ScamFunction_code(f);
+                constants = code->constants;
+                arr = code->arr;
+                pc = 0;
+                break;
+            }
+            case CODE_LIST:
+            case CODE_DICT:
+            {
+                bool is_list = (arr[pc - 1] == CODE_LIST);
+                size_t n = arr[pc++];
+                ScamSeq* elements = eval_pop_n(n);
+                ScamVal* ret;
+                if (is_list) {
+                    elements->type = SCAM_LIST;
+                    for (size_t i = 0; i < n; i++) {
+                        ScamVal_share(ScamSeq_get(elements, i));
+                    }
+                    ret = (ScamVal*)elements;
+                } else {
+                    ret = ScamDict_from_pairs(elements);
+                    gc_unset_root((ScamVal*)elements);
+                    if (ScamVal_type(ret) == SCAM_ERR) {
+                        VM_EXIT(ret);
+                    }
+                }
+                eval_push(ret);
+                break;
+            }
+            case CODE_JUMP:
+                pc = arr[pc];
+                break;
+            case CODE_JUMP_IF_FALSE:
+            {
+                ScamVal* cond = eval_stack[--eval_stack_count];
+                if (ScamVal_type(cond) != SCAM_BOOL) {
+                    VM_EXIT((ScamVal*)ScamErr_new(
+                        "condition of an if expression must be a bool"));
+                }
+                pc = ScamBool_unbox((ScamBool*)cond) ? pc + 1 : (size_t)arr[pc];
+                break;
+            }
+            case CODE_AND:
+            case CODE_OR:
+            {
+                bool is_and = (arr[pc - 1] == CODE_AND);
+                size_t i = arr[pc++];
+                size_t target = arr[pc++];
+                ScamVal* v = eval_stack[--eval_stack_count];
+                if (ScamVal_type(v) != SCAM_BOOL) {
+                    VM_EXIT((ScamVal*)ScamErr_type(is_and ? "and" : "or", i,
+                                                                  ScamVal_type(v), SCAM_BOOL));
+                }
+                if (ScamBool_unbox((ScamBool*)v) != is_and) {
+                    eval_push((ScamVal*)ScamBool_new(!is_and));
+                    pc = target;
+                }
+                break;
+            }
+            case CODE_POP:
+                eval_stack_count--;
+                break;
+            case CODE_ERROR:
+            {
+                ScamStr* err = (ScamStr*)ScamSeq_get(constants, arr[pc++]);
+                VM_EXIT((ScamVal*)ScamErr_new("%s", ScamStr_unbox(err)));
+            }
+            case CODE_RETURN:
+            {
+                if (calls.count == 0) {
+                    VM_EXIT(pop());
+                }
+                /* Replace the function and the frame of the call with the result and resume the
+                 * caller.
+                 */
+                ScamVal* ret = peek(0);
+                eval_stack_count -= 2;
+                eval_stack[eval_stack_count - 1] = ret;
+                vm_call_t* caller = &calls.arr[--calls.count];
+                prof_leave();
+                eval_leave();
+                code = caller->code;
+                pc = caller->pc;
+                env = caller->env;
+                constants = code->constants;
+                arr = code->arr;
+                break;
+            }
+            default:
+                VM_EXIT((ScamVal*)ScamErr_new("bad bytecode instruction %d",
+                                                             arr[pc - 1]));
+        }
+    }
+}
+
+
+ScamVal* vm_apply(ScamFunction* f, ScamSeq* arglist) {
+    ScamVal* err = eval_enter();
+    if (err != NULL) {
+        return err;
+    }
+    ScamCode* code = ScamFunction_code(f);
+    ScamEnv* frame = ScamEnv_frame(f->env, code->slot_names);
+    for (size_t i = 0; i < ScamSeq_len(arglist); i++) {
+        frame->slots[i] = ScamSeq_get(arglist, i);
+    }
+    ScamVal* ret = vm_run(code, frame);
+    gc_unset_root((ScamVal*)frame);
+    eval_leave();
+    return ret;
+}